@@ -1,24 +1,58 @@
+#include "compile-db.hpp"
 #include "helper.hpp"
 
 using namespace clang;
 using namespace clang::tooling;
 
+// Single-pass mode: references to file_operations-like variables are
+// written as "usage.pending" facts and resolved against the ioctl handlers
+// once every TU has been processed
+bool collect_usage = false;
+
 class StructVisitor : public RecursiveASTVisitor<StructVisitor> {
 public:
   explicit StructVisitor(ASTContext *context, bool collect_enum = true,
                          bool collect_struct = true, bool collect_func = true,
                          bool collect_handler = true,
-                         bool collect_typedef = true)
+                         bool collect_typedef = true,
+                         bool collect_usage = false)
       : context(context), collect_enum(collect_enum),
         collect_struct(collect_struct), collect_func(collect_func),
-        collect_handler(collect_handler), collect_typedef(collect_typedef) {}
+        collect_handler(collect_handler), collect_typedef(collect_typedef),
+        collect_usage(collect_usage) {}
+
+  // Track the innermost function or variable being traversed, references
+  // are attributed to it
+  bool TraverseDecl(Decl *decl) {
+    bool encloses = collect_usage && decl &&
+                    (isa<FunctionDecl>(decl) || isa<VarDecl>(decl));
+    if (encloses)
+      enclosing.push_back(cast<NamedDecl>(decl));
+    bool result = RecursiveASTVisitor<StructVisitor>::TraverseDecl(decl);
+    if (encloses)
+      enclosing.pop_back();
+    return result;
+  }
+
+  bool VisitDeclRefExpr(DeclRefExpr *expr) {
+    if (!collect_usage || enclosing.empty())
+      return true;
+    const auto *varDecl = dyn_cast<VarDecl>(expr->getDecl());
+    if (!varDecl || !has_ioctl_field(varDecl->getType()->getAsRecordDecl()))
+      return true;
+    // Whether the variable is an ioctl handler is only known at the end.
+    // Static handlers of different TUs may share its name, so the usage
+    // names its definition too when this TU has it.
+    output_decl(enclosing.back(), "usage.pending", true,
+                varDecl->getNameAsString(), varDecl->getDefinition());
+    return true;
+  }
 
   bool VisitFunctionDecl(FunctionDecl *funcDecl) {
     if (!collect_func)
       return true;
     if (funcDecl->isThisDeclarationADefinition()) {
       std::string funcName = funcDecl->getNameAsString();
-      std::string sourceCode = get_decl_code(funcDecl);
       if (funcName != "")
         output_decl(funcDecl, "func.jsonl");
     }
@@ -29,7 +63,6 @@ public:
     if (collect_struct) {
       if (recordDecl->isThisDeclarationADefinition()) {
         std::string structName = recordDecl->getNameAsString();
-        std::string sourceCode = get_decl_code(recordDecl);
         if (structName != "")
           output_decl(recordDecl, "struct.jsonl");
       }
@@ -42,7 +75,6 @@ public:
       return true;
     if (enumDecl->isThisDeclarationADefinition()) {
       std::string enumName = enumDecl->getNameAsString();
-      std::string sourceCode = get_decl_code(enumDecl);
 
       // Output the enum definition
       if (enumName != "")
@@ -111,6 +143,8 @@ public:
             const FieldDecl *fieldDecl = *fieldIt;
             auto fieldName = fieldDecl->getNameAsString();
             if (fieldName == "ioctl" || fieldName == "unlocked_ioctl") {
+              if (decl_emitted(declaration, "ioctl.jsonl"))
+                break;
               auto sourceCode = get_decl_code(declaration);
               // Check whether the ioctl is in the source code
               if (sourceCode.find(".ioctl") == std::string::npos &&
@@ -128,29 +162,63 @@ public:
   }
 
 private:
+  bool has_ioctl_field(const RecordDecl *recordDecl) {
+    if (!recordDecl || !(recordDecl = recordDecl->getDefinition()))
+      return false;
+    auto known = ioctl_records.find(recordDecl);
+    if (known != ioctl_records.end())
+      return known->second;
+
+    bool found = false;
+    for (const FieldDecl *fieldDecl : recordDecl->fields()) {
+      auto fieldName = fieldDecl->getName();
+      if (fieldName == "ioctl" || fieldName == "unlocked_ioctl") {
+        found = true;
+        break;
+      }
+    }
+    ioctl_records[recordDecl] = found;
+    return found;
+  }
+
   ASTContext *context;
   bool collect_enum;
   bool collect_struct;
   bool collect_func;
   bool collect_handler;
   bool collect_typedef;
+  bool collect_usage;
+  std::vector<NamedDecl *> enclosing;
+  llvm::DenseMap<const RecordDecl *, bool> ioctl_records;
 };
 
 class StructConsumer : public clang::ASTConsumer {
 public:
-  explicit StructConsumer(ASTContext *context, bool collect_enum = true,
-                          bool collect_struct = true, bool collect_func = true,
-                          bool collect_handler = true,
-                          bool collect_typedef = true)
+  explicit StructConsumer(ASTContext *context, Preprocessor &pp,
+                          bool collect_enum = true, bool collect_struct = true,
+                          bool collect_func = true, bool collect_handler = true,
+                          bool collect_typedef = true,
+                          bool collect_usage = false)
       : visitor(context, collect_enum, collect_struct, collect_func,
-                collect_handler, collect_typedef) {}
+                collect_handler, collect_typedef, collect_usage),
+        headers(pp.getHeaderSearchInfo()), macros(watch_header_macros(pp)) {
+    watch_tu_tokens(pp);
+  }
+
+  // Cuts the parse short once the TU is over its time or memory budget
+  bool HandleTopLevelDecl(DeclGroupRef group) override {
+    return group.isNull() ||
+           !tu_over_budget((*group.begin())->getASTContext());
+  }
 
   void HandleTranslationUnit(clang::ASTContext &context) override {
-    visitor.TraverseDecl(context.getTranslationUnitDecl());
+    traverse_unharvested_decls(visitor, context, headers, macros);
   }
 
 private:
   StructVisitor visitor;
+  HeaderSearch &headers;
+  HeaderMacroStates *macros;
 };
 
 class StructAction : public clang::ASTFrontendAction {
@@ -158,65 +226,83 @@ public:
   std::unique_ptr<clang::ASTConsumer>
   CreateASTConsumer(clang::CompilerInstance &compiler,
                     llvm::StringRef) override {
-    return std::make_unique<StructConsumer>(&compiler.getASTContext());
+    return std::make_unique<StructConsumer>(
+        &compiler.getASTContext(), compiler.getPreprocessor(), true, true, true,
+        true, true, collect_usage);
   }
 };
 
 int main(int argc, const char **argv) {
-  llvm::cl::OptionCategory MyToolCategory("my-tool options");
-  llvm::cl::opt<std::string> OptCompileCommands(
-      "p", llvm::cl::desc("Specify path compile_commands.json"),
-      llvm::cl::Required, llvm::cl::cat(MyToolCategory));
+  RunOptions options(".analyze-work", "analyze-report.json");
+  llvm::cl::opt<bool> OptUsage(
+      "usage",
+      llvm::cl::desc("Also collect usage.jsonl in this pass, without "
+                     "handler_names.txt and a second parse"),
+      llvm::cl::cat(options.category));
   llvm::cl::ParseCommandLineOptions(argc, argv);
-
-  // Load compile_commands.json manually
-  std::string ErrorMessage;
-  auto CompilationDatabase = JSONCompilationDatabase::loadFromFile(
-      OptCompileCommands, ErrorMessage,
-      clang::tooling::JSONCommandLineSyntax::AutoDetect);
-
-  if (!CompilationDatabase) {
-    llvm::errs() << "Error loading compile_commands.json: " << ErrorMessage
-                 << "\n";
+  if (!validate_run_options(options))
     return 1;
-  }
+  collect_usage = OptUsage;
 
-  // Extract source files from the loaded database
+  // Load compile_commands.json, or its packed form, manually, unless it is
+  // read while parsing
+  std::unique_ptr<clang::tooling::CompilationDatabase> CompilationDatabase;
   std::vector<std::string> sources;
-  for (const auto &command : CompilationDatabase->getAllCompileCommands()) {
-    // Only add .c and .h files
-    if (command.Filename.find(".c") == std::string::npos &&
-        command.Filename.find(".h") == std::string::npos)
-      continue;
-    sources.push_back(command.Filename);
+  if (!options.stream_db) {
+    std::string ErrorMessage;
+    CompilationDatabase = load_compilation_database(options.compile_commands,
+                                                    sources, ErrorMessage);
+    if (!CompilationDatabase) {
+      llvm::errs() << "Error loading compile_commands.json: " << ErrorMessage
+                   << "\n";
+      return 1;
+    }
   }
 
-  // Process each source file
-  std::vector<std::future<void>> futures;
-  auto frontendAction = newFrontendActionFactory<StructAction>();
+  apply_run_options(options, OptUsage ? "analyze -usage" : "analyze");
 
-  int maxThreads = 100;
-  Semaphore sem(maxThreads);
-  // Assuming 'sources' is a vector of strings containing source paths
-  for (const auto &sourcePath : sources) {
-    sem.wait(); // Wait for an available slot
-
-    // Capture necessary variables by reference
-    futures.push_back(
-        std::async(std::launch::async, [&sem, &sourcePath, &CompilationDatabase,
-                                        &frontendAction]() {
-          std::cout << sourcePath << std::endl;
-
-          // Processing logic with ClangTool
-          std::vector<std::string> currentSource = {sourcePath};
-          ClangTool tool(*CompilationDatabase, currentSource);
-          tool.run(frontendAction.get());
-
-          sem.notify(); // Signal that this thread is done
-        }));
+  auto frontendAction = newFrontendActionFactory<StructAction>();
+  if (options.stream_db) {
+    StreamingCompilationDatabase database(options.compile_commands,
+                                          is_tool_source);
+    run_sources(database, frontendAction.get(), options.jobs(),
+                options.file_cache_limit);
+    // The TUs parsed so far stay journaled for -resume
+    if (!database.error().empty()) {
+      llvm::errs() << "Error reading compile_commands.json: "
+                   << database.error() << "\n";
+      return 1;
+    }
+  } else {
+    run_sources(*CompilationDatabase, sources, frontendAction.get(),
+                options.jobs(), options.file_cache_limit);
   }
 
-  for (auto &fut : futures) {
-    fut.wait();
+  // A shard only knows its own handlers, fact-merge resolves the pending
+  // usages against those of all shards
+  if (!collect_usage || !options.shard.empty()) {
+    // Append every worker's shard to the final .jsonl files
+    merge_output_shards();
+    finish_run_report(options.report);
+    return 0;
   }
+
+  // Keep the pending usages that refer to ioctl handlers
+  IoctlHandlers handlers;
+  scan_output_shards([&handlers](llvm::StringRef output_file_name,
+                                 llvm::StringRef line) {
+    if (output_file_name == "ioctl.jsonl")
+      handlers.add(line);
+  });
+  run_report().set("ioctl_handlers", handlers.size());
+  merge_output_shards([&handlers](llvm::StringRef output_file_name,
+                                  llvm::StringRef line) -> std::string {
+    if (output_file_name != "usage.pending")
+      return output_file_name.str();
+    if (!handlers.resolve(line))
+      return "";
+    run_report().add("usage_facts", 1);
+    return "usage.jsonl";
+  });
+  finish_run_report(options.report);
 }
@@ -0,0 +1,30 @@
+#include "compile-db.hpp"
+
+// Packs compile_commands.json into the form analyze -p and usage -p map
+// instead of parsing, see PackedCompilationDatabase. The packed file is a
+// snapshot: pack again whenever compile_commands.json changes.
+
+int main(int argc, const char **argv) {
+  llvm::cl::OptionCategory category("compile-db-pack options");
+  llvm::cl::opt<std::string> input(llvm::cl::Positional,
+                                   llvm::cl::desc("<compile_commands.json>"),
+                                   llvm::cl::Required, llvm::cl::cat(category));
+  llvm::cl::opt<std::string> output(
+      "o", llvm::cl::desc("Where to write the packed database"),
+      llvm::cl::init("compile_commands.bin"), llvm::cl::cat(category));
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+
+  std::string error;
+  auto db = clang::tooling::JSONCompilationDatabase::loadFromFile(
+      input, error, clang::tooling::JSONCommandLineSyntax::AutoDetect);
+  if (!db) {
+    llvm::errs() << "Error loading compile_commands.json: " << error << "\n";
+    return 1;
+  }
+  if (!PackedCompilationDatabase::pack(*db, output, error)) {
+    llvm::errs() << "Error packing " << input << ": " << error << "\n";
+    return 1;
+  }
+  std::cout << "Packed " << db->getAllCompileCommands().size()
+            << " commands into " << output << std::endl;
+}
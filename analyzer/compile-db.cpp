@@ -0,0 +1,559 @@
+#include "compile-db.hpp"
+
+using namespace clang;
+using namespace clang::tooling;
+using json = nlohmann::json;
+
+bool is_tool_source(llvm::StringRef filename) {
+  return filename.contains(".c") || filename.contains(".h");
+}
+
+// The packed format: a Header, then the string bytes, the string table of
+// (offset, size) pairs into them, the Command records, the argument table
+// of string ids and the IndexEntry records sorted by path. Sections start
+// at multiples of 8 bytes; integers are in host byte order.
+struct PackedCompilationDatabase::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t strings;
+  uint32_t commands;
+  uint32_t arguments;
+  uint32_t entries;
+  uint32_t reserved;
+  uint64_t string_data;
+  uint64_t string_data_size;
+  uint64_t string_table;
+  uint64_t command_table;
+  uint64_t argument_table;
+  uint64_t index_table;
+};
+
+struct PackedCompilationDatabase::Command {
+  uint32_t directory;
+  uint32_t file;
+  uint32_t output;
+  uint32_t first_argument;
+  uint32_t arguments;
+};
+
+// Commands are indexed by the native absolute path of their file, and by
+// the file as given when that differs
+struct PackedCompilationDatabase::IndexEntry {
+  uint32_t path;
+  uint32_t command;
+};
+
+static const char PACKED_DB_MAGIC[8] = {'C', 'D', 'B', 'P', 'A', 'C', 'K', 0};
+constexpr uint32_t PACKED_DB_VERSION = 1;
+
+// The key a file is indexed and looked up by
+static std::string packed_db_key(llvm::StringRef file,
+                                 llvm::StringRef directory = "") {
+  llvm::SmallString<256> path(file);
+  if (!directory.empty())
+    llvm::sys::fs::make_absolute(directory, path);
+  llvm::sys::path::native(path);
+  llvm::sys::path::remove_dots(path, true);
+  return path.str().str();
+}
+
+bool PackedCompilationDatabase::is_packed(const std::string &path) {
+  char magic[sizeof(PACKED_DB_MAGIC)] = {};
+  std::ifstream file(path, std::ios_base::binary);
+  return file.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, PACKED_DB_MAGIC, sizeof(magic)) == 0;
+}
+
+bool PackedCompilationDatabase::pack(const CompilationDatabase &db,
+                                     const std::string &path,
+                                     std::string &error) {
+  std::string string_data;
+  std::vector<std::pair<uint32_t, uint32_t>> string_table;
+  llvm::StringMap<uint32_t> string_ids;
+  auto intern = [&](llvm::StringRef value) {
+    auto inserted = string_ids.try_emplace(value, string_table.size());
+    if (inserted.second) {
+      string_table.emplace_back(string_data.size(), value.size());
+      string_data += value.str();
+    }
+    return inserted.first->second;
+  };
+
+  std::vector<Command> commands;
+  std::vector<uint32_t> arguments;
+  std::vector<std::pair<std::string, uint32_t>> index;
+  for (const auto &command : db.getAllCompileCommands()) {
+    uint32_t id = commands.size();
+    Command record;
+    record.directory = intern(command.Directory);
+    record.file = intern(command.Filename);
+    record.output = intern(command.Output);
+    record.first_argument = arguments.size();
+    record.arguments = command.CommandLine.size();
+    for (const auto &argument : command.CommandLine)
+      arguments.push_back(intern(argument));
+    commands.push_back(record);
+
+    std::string key = packed_db_key(command.Filename, command.Directory);
+    index.emplace_back(key, id);
+    if (key != command.Filename)
+      index.emplace_back(command.Filename, id);
+  }
+  std::sort(index.begin(), index.end());
+  std::vector<IndexEntry> entries;
+  for (const auto &entry : index)
+    entries.push_back({intern(entry.first), entry.second});
+  if (string_data.size() > UINT32_MAX || arguments.size() > UINT32_MAX) {
+    error = "database too large to pack";
+    return false;
+  }
+
+  Header header = {};
+  std::memcpy(header.magic, PACKED_DB_MAGIC, sizeof(header.magic));
+  header.version = PACKED_DB_VERSION;
+  header.strings = string_table.size();
+  header.commands = commands.size();
+  header.arguments = arguments.size();
+  header.entries = entries.size();
+  auto align = [](uint64_t offset) { return (offset + 7) & ~uint64_t(7); };
+  header.string_data = align(sizeof(Header));
+  header.string_data_size = string_data.size();
+  header.string_table = align(header.string_data + string_data.size());
+  header.command_table =
+      align(header.string_table + string_table.size() * 2 * sizeof(uint32_t));
+  header.argument_table =
+      align(header.command_table + commands.size() * sizeof(Command));
+  header.index_table =
+      align(header.argument_table + arguments.size() * sizeof(uint32_t));
+
+  std::ofstream out(path + ".tmp",
+                    std::ios_base::binary | std::ios_base::trunc);
+  auto section = [&](uint64_t offset, const void *data, size_t size) {
+    out.seekp(offset);
+    out.write(static_cast<const char *>(data), size);
+  };
+  section(0, &header, sizeof(header));
+  section(header.string_data, string_data.data(), string_data.size());
+  std::vector<uint32_t> flat_table;
+  for (const auto &entry : string_table) {
+    flat_table.push_back(entry.first);
+    flat_table.push_back(entry.second);
+  }
+  section(header.string_table, flat_table.data(),
+          flat_table.size() * sizeof(uint32_t));
+  section(header.command_table, commands.data(),
+          commands.size() * sizeof(Command));
+  section(header.argument_table, arguments.data(),
+          arguments.size() * sizeof(uint32_t));
+  section(header.index_table, entries.data(),
+          entries.size() * sizeof(IndexEntry));
+  out.close();
+  if (!out) {
+    error = "cannot write " + path;
+    return false;
+  }
+  std::error_code ec;
+  std::filesystem::rename(path + ".tmp", path, ec);
+  if (ec) {
+    error = path + ": " + ec.message();
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<PackedCompilationDatabase>
+PackedCompilationDatabase::load(const std::string &path, std::string &error) {
+  // Large files are mapped rather than read
+  auto buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/false,
+                                            /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    error = path + ": " + buffer.getError().message();
+    return nullptr;
+  }
+  uint64_t size = (*buffer)->getBufferSize();
+  const Header *header =
+      reinterpret_cast<const Header *>((*buffer)->getBufferStart());
+  auto fits = [size](uint64_t offset, uint64_t count, uint64_t item) {
+    return offset <= size && count <= (size - offset) / item;
+  };
+  if (size < sizeof(Header) ||
+      std::memcmp(header->magic, PACKED_DB_MAGIC, sizeof(header->magic)) ||
+      header->version != PACKED_DB_VERSION ||
+      !fits(header->string_data, header->string_data_size, 1) ||
+      !fits(header->string_table, header->strings, 2 * sizeof(uint32_t)) ||
+      !fits(header->command_table, header->commands, sizeof(Command)) ||
+      !fits(header->argument_table, header->arguments, sizeof(uint32_t)) ||
+      !fits(header->index_table, header->entries, sizeof(IndexEntry))) {
+    error = path + ": not a packed compilation database of this version";
+    return nullptr;
+  }
+  return std::unique_ptr<PackedCompilationDatabase>(
+      new PackedCompilationDatabase(std::move(*buffer)));
+}
+
+const PackedCompilationDatabase::Header &
+PackedCompilationDatabase::header() const {
+  return *reinterpret_cast<const Header *>(buffer->getBufferStart());
+}
+
+// Ids and offsets out of range, from a damaged file, read as empty strings
+llvm::StringRef PackedCompilationDatabase::string(uint32_t id) const {
+  const Header &packed = header();
+  if (id >= packed.strings)
+    return "";
+  const char *start = buffer->getBufferStart();
+  const uint32_t *table =
+      reinterpret_cast<const uint32_t *>(start + packed.string_table);
+  uint64_t offset = table[2 * id], length = table[2 * id + 1];
+  if (offset + length > packed.string_data_size)
+    return "";
+  return llvm::StringRef(start + packed.string_data + offset, length);
+}
+
+size_t PackedCompilationDatabase::size() const { return header().commands; }
+
+llvm::StringRef PackedCompilationDatabase::file(size_t index) const {
+  const Command *commands = reinterpret_cast<const Command *>(
+      buffer->getBufferStart() + header().command_table);
+  return string(commands[index].file);
+}
+
+CompileCommand PackedCompilationDatabase::command(size_t index) const {
+  const Header &packed = header();
+  const char *start = buffer->getBufferStart();
+  const Command &record =
+      reinterpret_cast<const Command *>(start + packed.command_table)[index];
+  const uint32_t *arguments =
+      reinterpret_cast<const uint32_t *>(start + packed.argument_table);
+  std::vector<std::string> command_line;
+  for (uint64_t i = record.first_argument;
+       i < uint64_t(record.first_argument) + record.arguments &&
+       i < packed.arguments;
+       ++i)
+    command_line.push_back(string(arguments[i]).str());
+  return CompileCommand(string(record.directory), string(record.file),
+                        std::move(command_line), string(record.output));
+}
+
+std::pair<const PackedCompilationDatabase::IndexEntry *,
+          const PackedCompilationDatabase::IndexEntry *>
+PackedCompilationDatabase::entries(llvm::StringRef path) const {
+  const Header &packed = header();
+  const IndexEntry *begin = reinterpret_cast<const IndexEntry *>(
+      buffer->getBufferStart() + packed.index_table);
+  const IndexEntry *end = begin + packed.entries;
+  struct Less {
+    const PackedCompilationDatabase *db;
+    bool operator()(const IndexEntry &entry, llvm::StringRef path) const {
+      return db->string(entry.path) < path;
+    }
+    bool operator()(llvm::StringRef path, const IndexEntry &entry) const {
+      return path < db->string(entry.path);
+    }
+  };
+  return std::equal_range(begin, end, path, Less{this});
+}
+
+std::vector<CompileCommand>
+PackedCompilationDatabase::getCompileCommands(llvm::StringRef file_path) const {
+  auto range = entries(packed_db_key(file_path));
+  if (range.first == range.second)
+    range = entries(file_path);
+  std::vector<CompileCommand> commands;
+  for (const IndexEntry *entry = range.first; entry != range.second; ++entry)
+    if (entry->command < size())
+      commands.push_back(command(entry->command));
+  return commands;
+}
+
+// Absolute paths, like JSONCompilationDatabase gives
+std::vector<std::string> PackedCompilationDatabase::getAllFiles() const {
+  std::vector<std::string> files;
+  std::unordered_set<std::string> seen;
+  for (size_t i = 0; i < size(); ++i) {
+    CompileCommand entry = command(i);
+    std::string path = packed_db_key(entry.Filename, entry.Directory);
+    if (seen.insert(path).second)
+      files.push_back(path);
+  }
+  return files;
+}
+
+std::vector<CompileCommand>
+PackedCompilationDatabase::getAllCompileCommands() const {
+  std::vector<CompileCommand> commands;
+  for (size_t i = 0; i < size(); ++i)
+    commands.push_back(command(i));
+  return commands;
+}
+
+std::unique_ptr<CompilationDatabase>
+load_compilation_database(const std::string &path,
+                          std::vector<std::string> &sources,
+                          std::string &error) {
+  auto start = std::chrono::steady_clock::now();
+  uint64_t rss_before = resident_memory(getpid());
+  std::unique_ptr<CompilationDatabase> db;
+  bool packed = PackedCompilationDatabase::is_packed(path);
+  if (packed) {
+    auto packed_db = PackedCompilationDatabase::load(path, error);
+    if (packed_db)
+      for (size_t i = 0; i < packed_db->size(); ++i)
+        if (is_tool_source(packed_db->file(i)))
+          sources.push_back(packed_db->file(i).str());
+    db = std::move(packed_db);
+  } else {
+    db = JSONCompilationDatabase::loadFromFile(
+        path, error, JSONCommandLineSyntax::AutoDetect);
+    if (db)
+      for (const auto &command : db->getAllCompileCommands())
+        if (is_tool_source(command.Filename))
+          sources.push_back(command.Filename);
+  }
+  if (!db)
+    return nullptr;
+
+  uint64_t rss_after = resident_memory(getpid());
+  RunReport &report = run_report();
+  report.set("db_format", packed ? "packed" : "json");
+  report.set("db_load_ms", milliseconds_since(start));
+  report.set("db_rss_mib",
+             (rss_after > rss_before ? rss_after - rss_before : 0) >> 20);
+  return db;
+}
+
+// Builds the commands of a compilation database from the SAX events of its
+// JSON text: a top-level array of objects with "directory", "file",
+// "output" and "command" or "arguments". Other members are skipped.
+class StreamingCompilationDatabase::EntryReader
+    : public nlohmann::json_sax<json> {
+public:
+  explicit EntryReader(StreamingCompilationDatabase &db) : db(db) {}
+
+  bool null() override { return scalar(); }
+  bool boolean(bool) override { return scalar(); }
+  bool number_integer(number_integer_t) override { return scalar(); }
+  bool number_unsigned(number_unsigned_t) override { return scalar(); }
+  bool number_float(number_float_t, const string_t &) override {
+    return scalar();
+  }
+  bool binary(binary_t &) override { return scalar(); }
+
+  bool string(string_t &value) override {
+    if (depth == 2) {
+      if (member == "directory")
+        directory = std::move(value);
+      else if (member == "file")
+        file = std::move(value);
+      else if (member == "output")
+        output = std::move(value);
+      else if (member == "command")
+        command = std::move(value);
+    } else if (depth == 3 && in_arguments) {
+      arguments.push_back(std::move(value));
+    }
+    return scalar();
+  }
+
+  bool start_object(std::size_t) override {
+    if (depth == 0)
+      return fail("expected an array of commands");
+    if (depth == 1) {
+      directory.clear();
+      file.clear();
+      output.clear();
+      command.reset();
+      arguments.clear();
+      has_arguments = false;
+    }
+    depth++;
+    return true;
+  }
+
+  bool end_object() override {
+    if (--depth == 1)
+      return add_entry();
+    return true;
+  }
+
+  bool start_array(std::size_t) override {
+    if (depth == 2 && member == "arguments") {
+      in_arguments = true;
+      has_arguments = true;
+    } else if (depth == 1) {
+      return fail("expected an object per command");
+    }
+    depth++;
+    return true;
+  }
+
+  bool end_array() override {
+    if (--depth == 2)
+      in_arguments = false;
+    return true;
+  }
+
+  bool key(string_t &value) override {
+    if (depth == 2)
+      member = std::move(value);
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &error) override {
+    return fail(error.what());
+  }
+
+  std::string error;
+
+private:
+  bool scalar() {
+    if (depth <= 1)
+      return fail("expected an object per command");
+    return true;
+  }
+
+  bool fail(std::string message) {
+    error = std::move(message);
+    return false;
+  }
+
+  // Splits a "command" the way JSONCompilationDatabase does on POSIX
+  // systems: quotes and backslashes as a shell would take them
+  static std::vector<std::string> split_command(llvm::StringRef command) {
+    llvm::BumpPtrAllocator allocator;
+    llvm::StringSaver saver(allocator);
+    llvm::SmallVector<const char *, 64> argv;
+    llvm::cl::TokenizeGNUCommandLine(command, saver, argv);
+    return std::vector<std::string>(argv.begin(), argv.end());
+  }
+
+  bool add_entry() {
+    if (directory.empty() || file.empty() || (!command && !has_arguments))
+      return fail("command entry without directory, file, or command or "
+                  "arguments");
+    db.add(CompileCommand(directory, file,
+                          has_arguments ? std::move(arguments)
+                                        : split_command(*command),
+                          output));
+    return true;
+  }
+
+  StreamingCompilationDatabase &db;
+  unsigned depth = 0;
+  // Member of the command entry being read
+  std::string member;
+  bool in_arguments = false;
+  std::string directory;
+  std::string file;
+  std::string output;
+  llvm::Optional<std::string> command;
+  std::vector<std::string> arguments;
+  bool has_arguments = false;
+};
+
+StreamingCompilationDatabase::StreamingCompilationDatabase(
+    const std::string &path, std::function<bool(llvm::StringRef)> select)
+    : path(path), select(std::move(select)),
+      start(std::chrono::steady_clock::now()) {
+  reader = std::thread(&StreamingCompilationDatabase::read, this);
+}
+
+StreamingCompilationDatabase::~StreamingCompilationDatabase() {
+  reader.join();
+}
+
+void StreamingCompilationDatabase::read() {
+  std::ifstream file;
+  if (path != "-")
+    file.open(path, std::ios_base::binary);
+  std::istream &in = path == "-" ? std::cin : file;
+  if (!in) {
+    finish("cannot open " + path);
+    return;
+  }
+  EntryReader entries(*this);
+  json::sax_parse(in, &entries);
+  finish(entries.error);
+}
+
+void StreamingCompilationDatabase::add(CompileCommand command) {
+  llvm::SmallString<256> absolute(command.Filename);
+  llvm::sys::fs::make_absolute(command.Directory, absolute);
+  llvm::sys::path::native(absolute);
+  llvm::sys::path::remove_dots(absolute, true);
+
+  std::lock_guard<std::mutex> lock(mtx);
+  size_t index = commands.size();
+  by_file[absolute].push_back(index);
+  if (llvm::StringRef(command.Filename) != absolute.str())
+    by_file[command.Filename].push_back(index);
+  if (!select || select(command.Filename))
+    unclaimed.push_back(command.Filename);
+  commands.push_back(std::move(command));
+  read_cv.notify_all();
+}
+
+void StreamingCompilationDatabase::finish(std::string error) {
+  std::lock_guard<std::mutex> lock(mtx);
+  complete = true;
+  error_message = std::move(error);
+  RunReport &report = run_report();
+  report.set("db_commands", commands.size());
+  report.set("db_read_ms", milliseconds_since(start));
+  read_cv.notify_all();
+}
+
+bool StreamingCompilationDatabase::next_source(std::string &source) {
+  std::unique_lock<std::mutex> lock(mtx);
+  read_cv.wait(lock, [this] { return complete || !unclaimed.empty(); });
+  if (unclaimed.empty())
+    return false;
+  source = std::move(unclaimed.front());
+  unclaimed.pop_front();
+  if (!first_claimed) {
+    first_claimed = true;
+    run_report().set("db_first_source_ms", milliseconds_since(start));
+  }
+  return true;
+}
+
+std::string StreamingCompilationDatabase::error() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return error_message;
+}
+
+std::vector<CompileCommand>
+StreamingCompilationDatabase::getCompileCommands(
+    llvm::StringRef file_path) const {
+  llvm::SmallString<256> native(file_path);
+  llvm::sys::path::native(native);
+  llvm::sys::path::remove_dots(native, true);
+  std::lock_guard<std::mutex> lock(mtx);
+  auto found = by_file.find(native);
+  if (found == by_file.end())
+    found = by_file.find(file_path);
+  std::vector<CompileCommand> result;
+  if (found != by_file.end())
+    for (size_t index : found->second)
+      result.push_back(commands[index]);
+  return result;
+}
+
+std::vector<std::string> StreamingCompilationDatabase::getAllFiles() const {
+  std::unique_lock<std::mutex> lock(mtx);
+  read_cv.wait(lock, [this] { return complete; });
+  std::vector<std::string> files;
+  std::unordered_set<std::string> seen;
+  for (const auto &command : commands)
+    if (seen.insert(command.Filename).second)
+      files.push_back(command.Filename);
+  return files;
+}
+
+std::vector<CompileCommand>
+StreamingCompilationDatabase::getAllCompileCommands() const {
+  std::unique_lock<std::mutex> lock(mtx);
+  read_cv.wait(lock, [this] { return complete; });
+  return commands;
+}
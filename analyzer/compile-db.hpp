@@ -0,0 +1,112 @@
+#ifndef COMPILE_DB_HPP
+#define COMPILE_DB_HPP
+
+#include "helper.hpp"
+#include "llvm/Support/StringSaver.h"
+
+// Whether the tools parse the file of a compile command: .c and .h files
+bool is_tool_source(llvm::StringRef filename);
+
+// A compilation database packed by compile-db-pack: every string (paths,
+// arguments) stored once, fixed-size command records pointing at them and
+// an index of the commands sorted by file path. The file is mapped, not
+// read, so loading costs the same however large the database is, and only
+// the pages of the commands looked up become resident.
+class PackedCompilationDatabase : public clang::tooling::CompilationDatabase {
+public:
+  static std::unique_ptr<PackedCompilationDatabase>
+  load(const std::string &path, std::string &error);
+  // Whether `path` starts like a packed database
+  static bool is_packed(const std::string &path);
+  // Writes the commands of `db` to `path` in the packed format
+  static bool pack(const clang::tooling::CompilationDatabase &db,
+                   const std::string &path, std::string &error);
+
+  std::vector<clang::tooling::CompileCommand>
+  getCompileCommands(llvm::StringRef file_path) const override;
+  std::vector<std::string> getAllFiles() const override;
+  std::vector<clang::tooling::CompileCommand>
+  getAllCompileCommands() const override;
+
+  size_t size() const;
+  // The file of command `index`, without building the command
+  llvm::StringRef file(size_t index) const;
+
+private:
+  struct Header;
+  struct Command;
+  struct IndexEntry;
+
+  explicit PackedCompilationDatabase(
+      std::unique_ptr<llvm::MemoryBuffer> buffer)
+      : buffer(std::move(buffer)) {}
+
+  const Header &header() const;
+  llvm::StringRef string(uint32_t id) const;
+  clang::tooling::CompileCommand command(size_t index) const;
+  // The index entries of `path`
+  std::pair<const IndexEntry *, const IndexEntry *>
+  entries(llvm::StringRef path) const;
+
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+};
+
+// Loads -p for the tools, as compile_commands.json or packed, and lists the
+// files of its commands the tools parse in `sources`. The report shows the
+// format, how long loading took and the resident memory it added.
+std::unique_ptr<clang::tooling::CompilationDatabase>
+load_compilation_database(const std::string &path,
+                          std::vector<std::string> &sources,
+                          std::string &error);
+
+// A compilation database in the JSON format of compile_commands.json,
+// read by a thread of its own from a file or a pipe ("-" for stdin). The
+// command entries are parsed one at a time as the text comes in, and only
+// the commands are kept, not the text or a tree of it. Commands are looked
+// up like those of a JSONCompilationDatabase once they have been read.
+class StreamingCompilationDatabase
+    : public clang::tooling::CompilationDatabase {
+public:
+  // Only the files for which `select` returns true are handed out by
+  // next_source(); all commands can be looked up
+  StreamingCompilationDatabase(
+      const std::string &path,
+      std::function<bool(llvm::StringRef)> select = nullptr);
+  ~StreamingCompilationDatabase() override;
+
+  // Blocks until another command has been read and sets `source` to its
+  // file; returns false once the whole database has been read
+  bool next_source(std::string &source);
+  // Why reading stopped early, empty when it did not
+  std::string error() const;
+
+  std::vector<clang::tooling::CompileCommand>
+  getCompileCommands(llvm::StringRef file_path) const override;
+  // These wait until the whole database has been read
+  std::vector<std::string> getAllFiles() const override;
+  std::vector<clang::tooling::CompileCommand>
+  getAllCompileCommands() const override;
+
+private:
+  class EntryReader;
+
+  void read();
+  void add(clang::tooling::CompileCommand command);
+  void finish(std::string error);
+
+  std::string path;
+  std::function<bool(llvm::StringRef)> select;
+  std::chrono::steady_clock::time_point start;
+  mutable std::mutex mtx;
+  mutable std::condition_variable read_cv;
+  std::vector<clang::tooling::CompileCommand> commands;
+  // Native absolute path, and the path as given -> indices into `commands`
+  llvm::StringMap<std::vector<size_t>> by_file;
+  std::deque<std::string> unclaimed;
+  bool complete = false;
+  bool first_claimed = false;
+  std::string error_message;
+  std::thread reader;
+};
+
+#endif
@@ -0,0 +1,650 @@
+#include "fact-cache.hpp"
+
+using namespace clang;
+using namespace clang::tooling;
+using json = nlohmann::json;
+
+// On-disk fact cache shared by runs over any checkout, in the manner of
+// ccache's direct mode. A manifest, keyed by the tool configuration, the
+// normalized compile command and the main file's content, lists entries of
+// input files with content hashes and the fact blocks of the TU that was
+// parsed with them. A block holds the facts located in one file and is
+// stored under the hash of its contents, so the facts of a header are kept
+// once for all TUs that produce the same ones. Paths under the compile
+// directory, as given or with symlinks resolved, are stored relative to it
+// wherever they occur.
+//
+// With -pp-hash a TU that misses is preprocessed first, and a second kind
+// of entry, keyed by the flags that matter after preprocessing and a
+// digest of the kinds and spellings of its tokens, maps to its blocks and
+// parse time, and gives for each fact the positions in the stream of the
+// first and last token of its declaration and of the first token of its
+// target. A hit takes the text and location of every fact from the tokens
+// now at those positions, so its line follows its tokens when comments or
+// blank lines move them.
+std::string fact_cache_dir;
+uint64_t fact_cache_config = 0;
+bool token_hashing = false;
+std::atomic<uint64_t> fact_cache_hits{0};
+std::atomic<uint64_t> fact_cache_misses{0};
+std::mutex fact_cache_mutex;
+// Current content hash of every input looked at in this run, 0 if missing
+std::unordered_map<std::string, uint64_t> input_hashes;
+// Blocks whose facts this run has already committed, by committed_block()
+std::unordered_set<std::string> cached_blocks;
+
+void enable_fact_cache(const std::string &dir, llvm::StringRef config) {
+  fact_cache_dir = dir;
+  fact_cache_config = fact_config_hash(config);
+  complete_batches = true;
+}
+
+void enable_token_hashing() { token_hashing = true; }
+
+thread_local TokenStream *current_tokens = nullptr;
+
+bool TokenDigest::add(const Preprocessor &pp, const Token &token) {
+  if (done || token.isAnnotation())
+    return false;
+  done = token.is(tok::eof);
+  bool invalid = false;
+  llvm::StringRef text = pp.getSpelling(token, spelling, &invalid);
+  uint16_t kind = token.getKind();
+  md5.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<uint8_t *>(&kind),
+                                     sizeof(kind)));
+  md5.update(text);
+  md5.update(llvm::StringRef("", 1));
+  return true;
+}
+
+std::string TokenDigest::digest() {
+  llvm::MD5::MD5Result result;
+  md5.final(result);
+  return result.digest().str().str();
+}
+
+void TokenStream::add(const Preprocessor &pp, const Token &token) {
+  if (digest.add(pp, token))
+    positions.try_emplace(token.getLocation().getRawEncoding(), size++);
+}
+
+uint32_t TokenStream::position(SourceLocation loc) {
+  if (loc.isInvalid())
+    return NO_TOKEN;
+  auto found = positions.find(loc.getRawEncoding());
+  if (found != positions.end())
+    return found->second;
+  complete = false;
+  return NO_TOKEN;
+}
+
+static uint64_t input_hash(const std::string &path) {
+  {
+    std::lock_guard<std::mutex> lock(fact_cache_mutex);
+    auto known = input_hashes.find(path);
+    if (known != input_hashes.end())
+      return known->second;
+  }
+  auto buffer = llvm::MemoryBuffer::getFile(path, false, false);
+  uint64_t hash = buffer ? llvm::xxHash64((*buffer)->getBuffer()) : 0;
+  std::lock_guard<std::mutex> lock(fact_cache_mutex);
+  input_hashes.emplace(path, hash);
+  return hash;
+}
+
+// Whether `c` may continue a file name
+static bool file_name_char(char c) {
+  return llvm::isAlnum(c) || c == '_' || c == '-' || c == '.' || c == '+' ||
+         c == '~';
+}
+
+// Facts of declarations a macro writes name several paths, as in
+// "<path>:1:2 <Spelling=<path>:3:4>:1", and flags such as -I<path>.
+std::string relocate(llvm::StringRef text, const CheckoutDir &dir,
+                     bool as_key) {
+  std::pair<llvm::StringRef, const char *> prefixes[] = {
+      {dir.real, "$DIR"}, {dir.given, as_key ? "$DIR" : "$CWD"}};
+  // The longer first, in case one lies under the other
+  if (prefixes[1].first.size() > prefixes[0].first.size())
+    std::swap(prefixes[0], prefixes[1]);
+  // Whether a path starts at `i`, rather than continues there: nothing or
+  // a flag like -I leads up to it
+  auto path_starts = [&](size_t i) {
+    size_t begin = i;
+    while (begin > 0 && file_name_char(text[begin - 1]))
+      begin--;
+    return (begin == 0 || text[begin - 1] != '/') &&
+           (begin == i || text[begin] == '-');
+  };
+  std::string out;
+  size_t i = 0;
+  while (i < text.size()) {
+    bool replaced = false;
+    if (text[i] == '$') {
+      out += "$$";
+      i++;
+      continue;
+    }
+    if (text[i] == '/' && path_starts(i)) {
+      for (const auto &prefix : prefixes) {
+        size_t end = i + prefix.first.size();
+        if (!prefix.first.empty() &&
+            text.substr(i).startswith(prefix.first) &&
+            (end == text.size() || !file_name_char(text[end]))) {
+          out += prefix.second;
+          i = end;
+          replaced = true;
+          break;
+        }
+      }
+    }
+    if (!replaced)
+      out += text[i++];
+  }
+  return out;
+}
+
+std::string unrelocate(llvm::StringRef text, const CheckoutDir &dir) {
+  std::string out;
+  while (!text.empty()) {
+    size_t pos = text.find('$');
+    out += text.take_front(pos).str();
+    if (pos == llvm::StringRef::npos)
+      break;
+    text = text.drop_front(pos);
+    if (text.consume_front("$DIR"))
+      out += dir.real;
+    else if (text.consume_front("$CWD"))
+      out += dir.given;
+    else if (text.consume_front("$$"))
+      out += '$';
+    else {
+      out += '$';
+      text = text.drop_front();
+    }
+  }
+  return out;
+}
+
+std::string hex_digest(llvm::StringRef data) {
+  llvm::MD5 md5;
+  md5.update(data);
+  llvm::MD5::MD5Result result;
+  md5.final(result);
+  return result.digest().str().str();
+}
+
+static bool checkout_dir(const CompilationDatabase &db,
+                         const std::string &source, CheckoutDir &dir) {
+  auto commands = db.getCompileCommands(source);
+  llvm::SmallString<256> real_dir;
+  if (commands.empty() ||
+      llvm::sys::fs::real_path(commands.front().Directory, real_dir))
+    return false;
+  llvm::SmallString<256> given(commands.front().Directory);
+  llvm::sys::path::remove_dots(given, true);
+  dir.given = given.str().str();
+  dir.real = real_dir.str().str();
+  return true;
+}
+
+// Whether a flag only steers the preprocessor (or the output), so that its
+// effect shows in the token stream; `separate` is set when it takes the
+// next argument as its operand
+static bool preprocessor_flag(llvm::StringRef arg, bool &separate) {
+  static const char *const with_operand[] = {
+      "-D",         "-U",       "-I",       "-isystem", "-iquote",
+      "-idirafter", "-include", "-imacros", "-MF",      "-MT",
+      "-MQ",        "-o"};
+  separate = false;
+  for (const char *flag : with_operand) {
+    if (arg == flag) {
+      separate = true;
+      return true;
+    }
+  }
+  return arg.startswith("-D") || arg.startswith("-U") ||
+         arg.startswith("-I") || arg.startswith("-M") ||
+         arg.startswith("-W") || arg.startswith("-o");
+}
+
+// A compile command as a cache key: without the output, paths under `dir`
+// relocated and, if `after_preprocessing`, without preprocessor flags.
+// Paths outside of it, such as the source tree of an O= build, stay
+// absolute, so entries are only shared by checkouts that agree on them.
+static std::string command_key(const CompileCommand &command,
+                               const CheckoutDir &dir,
+                               bool after_preprocessing) {
+  std::string key;
+  const auto &args = command.CommandLine;
+  for (size_t i = 0; i < args.size(); ++i) {
+    llvm::StringRef arg = args[i];
+    bool separate = false;
+    // The output does not change the facts
+    if (arg == "-o" ||
+        (after_preprocessing && preprocessor_flag(arg, separate))) {
+      if (arg == "-o" || separate)
+        i++;
+      continue;
+    }
+    if (arg.startswith("-o"))
+      continue;
+    // Wherever a path starts, as in -I<dir>/include, whether the command
+    // names the checkout by its real path or through a symlink
+    key += relocate(arg, dir, true) + '\0';
+  }
+  return key;
+}
+
+// Path of the cache entry of `kind` for a TU, "manifests" keyed by the
+// hash of its main file or "tokens" keyed by its token digest; empty when
+// its command cannot be normalized
+static std::string entry_path(const CompilationDatabase &db,
+                              const std::string &source, llvm::StringRef kind,
+                              llvm::StringRef inputs, CheckoutDir &dir) {
+  auto commands = db.getCompileCommands(source);
+  if (commands.empty() || !checkout_dir(db, source, dir))
+    return "";
+  std::string hex = hex_digest(
+      llvm::utohexstr(fact_cache_config) + "\n" + inputs.str() + "\n" +
+      command_key(commands.front(), dir, kind == "tokens"));
+  return (fact_cache_dir + "/" + kind + "/" + hex.substr(0, 2) + "/" + hex)
+      .str();
+}
+
+static std::string block_path(llvm::StringRef hex) {
+  return (fact_cache_dir + "/blocks/" + hex.take_front(2) + "/" + hex).str();
+}
+
+// The paths in a block are relative to the checkout directory, so the same
+// block holds other facts for a command in another directory
+static std::string committed_block(const std::string &hex,
+                                   const CheckoutDir &dir) {
+  return hex + '\t' + dir.real + '\t' + dir.given;
+}
+
+// Parses a block line, "<output>\t<file>\t<spelling file>\t<json>"
+static bool parse_block_line(llvm::StringRef line, const CheckoutDir &dir,
+                             FactRecord &record, json &fact) {
+  llvm::SmallVector<llvm::StringRef, 4> fields;
+  line.split(fields, '\t', 3);
+  if (fields.size() < 4)
+    return false;
+  fact = json::parse(fields[3].begin(), fields[3].end(), nullptr, false);
+  if (fact.is_discarded())
+    return false;
+  for (const char *field : {"filename", "target"})
+    if (fact.contains(field))
+      fact[field] = unrelocate(fact.value(field, std::string()), dir);
+  record.has_key = false;
+  record.output_file_name = fields[0].str();
+  record.key_name = fact_key_name(fact, fields[0]);
+  record.json = fact.dump();
+  record.file = unrelocate(fields[1], dir);
+  record.spelling_file = unrelocate(fields[2], dir);
+  return true;
+}
+
+// Adds the facts of `blocks` this run has not committed yet to `batch`;
+// false if one of them is gone
+static bool load_blocks(const std::vector<std::string> &blocks,
+                        const CheckoutDir &dir, FactBatch &batch) {
+  // Blocks another TU of this run brought in are already committed
+  std::vector<std::pair<std::string, std::unique_ptr<llvm::MemoryBuffer>>>
+      contents;
+  for (const auto &hex : blocks) {
+    {
+      std::lock_guard<std::mutex> lock(fact_cache_mutex);
+      if (cached_blocks.count(committed_block(hex, dir)))
+        continue;
+    }
+    auto block = llvm::MemoryBuffer::getFile(block_path(hex));
+    if (!block)
+      return false;
+    contents.emplace_back(hex, std::move(*block));
+  }
+
+  for (const auto &block : contents) {
+    run_report().add("fact_cache_bytes_read", block.second->getBufferSize());
+    llvm::StringRef lines = block.second->getBuffer();
+    while (!lines.empty()) {
+      llvm::StringRef line;
+      std::tie(line, lines) = lines.split('\n');
+      FactRecord record;
+      json fact;
+      if (parse_block_line(line, dir, record, fact))
+        batch.facts.push_back(std::move(record));
+    }
+  }
+  std::lock_guard<std::mutex> lock(fact_cache_mutex);
+  for (const auto &block : contents)
+    cached_blocks.insert(committed_block(block.first, dir));
+  return true;
+}
+
+static std::string token_position_text(uint32_t position) {
+  return position == NO_TOKEN ? "-" : std::to_string(position);
+}
+
+// Writes the blocks of a batch that are not in the cache yet and returns
+// all of their hashes. `positions` gets, per block, the token positions of
+// its facts, " <first>:<last>:<target>" for each.
+static std::vector<std::string>
+write_blocks(const FactBatch &batch, const CheckoutDir &dir,
+             std::vector<std::string> *positions = nullptr) {
+  // Contents and token positions of the block of each file
+  std::map<std::string, std::pair<std::string, std::string>> blocks;
+  for (const auto &record : batch.facts) {
+    auto fact = json::parse(record.json, nullptr, false);
+    if (fact.is_discarded())
+      continue;
+    for (const char *field : {"filename", "target"})
+      if (fact.contains(field))
+        fact[field] = relocate(fact.value(field, std::string()), dir);
+    auto &block = blocks[record.file];
+    block.first += record.output_file_name + "\t" +
+                   relocate(record.file, dir) + "\t" +
+                   relocate(record.spelling_file, dir) + "\t" +
+                   fact.dump() + "\n";
+    block.second += " " + token_position_text(record.first_token) + ":" +
+                    token_position_text(record.last_token) + ":" +
+                    token_position_text(record.target_token);
+  }
+
+  std::vector<std::string> hashes;
+  std::error_code ec;
+  for (const auto &entry : blocks) {
+    const std::string &block = entry.second.first;
+    std::string hex = hex_digest(block);
+    hashes.push_back(hex);
+    if (positions)
+      positions->push_back(entry.second.second);
+    {
+      std::lock_guard<std::mutex> lock(fact_cache_mutex);
+      cached_blocks.insert(committed_block(hex, dir));
+    }
+    std::string target = block_path(hex);
+    if (std::filesystem::exists(target, ec))
+      continue;
+    std::filesystem::create_directories(
+        std::filesystem::path(target).parent_path(), ec);
+    // Readers in other processes only ever see complete blocks
+    std::string temp = target + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream(temp, std::ios_base::binary | std::ios_base::trunc)
+        << block;
+    std::filesystem::rename(temp, target, ec);
+    run_report().add("fact_cache_bytes_written", block.size());
+  }
+  return hashes;
+}
+
+// Appends "entry", "I <hash> <path>"..., "B <block>"..., "end" to a
+// manifest, in a single O_APPEND write so concurrent writers do not
+// interleave
+static void append_manifest_entry(const std::string &path,
+                                  const TuInputs &inputs,
+                                  const std::vector<std::string> &blocks,
+                                  const CheckoutDir &dir) {
+  std::string entry = "entry\n";
+  for (const auto &input : inputs)
+    entry += "I " + llvm::utohexstr(input.second) + " " +
+             relocate(input.first, dir) + "\n";
+  for (const auto &hex : blocks)
+    entry += "B " + hex + "\n";
+  entry += "end\n";
+
+  std::error_code ec;
+  std::filesystem::create_directories(
+      std::filesystem::path(path).parent_path(), ec);
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+    return;
+  if (write(fd, entry.data(), entry.size()) == ssize_t(entry.size()))
+    run_report().add("fact_cache_bytes_written", entry.size());
+  close(fd);
+}
+
+bool serve_from_fact_cache(const CompilationDatabase &db,
+                           const std::string &source) {
+  CheckoutDir dir;
+  std::string path =
+      entry_path(db, source, "manifests",
+                 llvm::utohexstr(input_hash(main_file_path(db, source))), dir);
+  auto manifest = path.empty() ? nullptr
+                               : llvm::MemoryBuffer::getFile(path);
+  if (!manifest) {
+    fact_cache_misses++;
+    return false;
+  }
+
+  // The first entry whose inputs all match wins
+  FactBatch batch;
+  std::vector<std::string> blocks;
+  bool in_entry = false;
+  bool matches = false;
+  bool found = false;
+  llvm::StringRef rest = (*manifest)->getBuffer();
+  while (!rest.empty() && !found) {
+    llvm::StringRef line;
+    std::tie(line, rest) = rest.split('\n');
+    if (line == "entry") {
+      batch.inputs.clear();
+      blocks.clear();
+      in_entry = matches = true;
+    } else if (!in_entry || !matches) {
+      continue;
+    } else if (line.consume_front("I ")) {
+      auto fields = line.split(' ');
+      uint64_t hash;
+      std::string input = unrelocate(fields.second, dir);
+      matches = !fields.first.getAsInteger(16, hash) &&
+                input_hash(input) == hash;
+      batch.inputs.emplace_back(std::move(input), hash);
+    } else if (line.consume_front("B ")) {
+      blocks.push_back(line.str());
+    } else {
+      // An entry a crashed writer left unfinished never gets here
+      found = line == "end";
+      in_entry = false;
+    }
+  }
+  // A block removed from under us means parsing the TU after all
+  if (!found || !load_blocks(blocks, dir, batch)) {
+    fact_cache_misses++;
+    return false;
+  }
+  fact_cache_hits++;
+  commit_batch(batch, source);
+  return true;
+}
+
+void store_in_fact_cache(const CompilationDatabase &db,
+                         const std::string &source, const FactBatch &batch,
+                         llvm::StringRef digest, uint64_t parse_ms) {
+  if (batch.inputs.empty())
+    return;
+  CheckoutDir dir;
+  std::string manifest = entry_path(
+      db, source, "manifests", llvm::utohexstr(batch.inputs.front().second),
+      dir);
+  if (manifest.empty())
+    return;
+  std::vector<std::string> positions;
+  std::vector<std::string> blocks = write_blocks(batch, dir, &positions);
+  append_manifest_entry(manifest, batch.inputs, blocks, dir);
+  if (digest.empty())
+    return;
+
+  // "ms <parse time>", then "B <block> <first>:<last>:<target>..."
+  std::string path = entry_path(db, source, "tokens", digest, dir);
+  std::string entry = "ms " + std::to_string(parse_ms) + "\n";
+  for (size_t i = 0; i < blocks.size(); ++i)
+    entry += "B " + blocks[i] + positions[i] + "\n";
+  std::error_code ec;
+  std::filesystem::create_directories(
+      std::filesystem::path(path).parent_path(), ec);
+  std::string temp = path + "." + std::to_string(getpid()) + ".tmp";
+  std::ofstream(temp, std::ios_base::trunc) << entry;
+  std::filesystem::rename(temp, path, ec);
+  run_report().add("fact_cache_bytes_written", entry.size());
+}
+
+// Takes the facts of a TU from the token cache entry for `digest`, each
+// located anew at the tokens of `locations` at its positions, and records
+// them under the TU's current inputs. Returns the time the parse took back
+// then, or -1 on a miss.
+static int64_t reuse_facts(const CompilationDatabase &db,
+                           const std::string &source, llvm::StringRef digest,
+                           const SourceManager &srcMgr,
+                           const std::vector<SourceLocation> &locations,
+                           FactBatch &batch) {
+  CheckoutDir dir;
+  std::string path = entry_path(db, source, "tokens", digest, dir);
+  auto entry = path.empty() ? nullptr : llvm::MemoryBuffer::getFile(path);
+  if (!entry || batch.inputs.empty())
+    return -1;
+
+  auto locate = [&](llvm::StringRef position, SourceLocation &loc) {
+    unsigned index;
+    if (position == "-")
+      loc = SourceLocation();
+    else if (position.getAsInteger(10, index) || index >= locations.size())
+      return false;
+    else
+      loc = locations[index];
+    return true;
+  };
+
+  // Also the facts of blocks another TU of this run committed, as this TU
+  // may locate them elsewhere
+  int64_t parse_ms = -1;
+  std::vector<FactRecord> facts;
+  llvm::StringRef rest = (*entry)->getBuffer();
+  while (!rest.empty()) {
+    llvm::StringRef line;
+    std::tie(line, rest) = rest.split('\n');
+    if (line.consume_front("ms "))
+      line.getAsInteger(10, parse_ms);
+    if (!line.consume_front("B "))
+      continue;
+    llvm::StringRef hex, positions;
+    std::tie(hex, positions) = line.split(' ');
+    auto block = llvm::MemoryBuffer::getFile(block_path(hex));
+    if (!block)
+      return -1;
+    run_report().add("fact_cache_bytes_read", (*block)->getBufferSize());
+    llvm::StringRef lines = (*block)->getBuffer();
+    while (!lines.empty()) {
+      llvm::StringRef fact_line, position;
+      std::tie(fact_line, lines) = lines.split('\n');
+      std::tie(position, positions) = positions.split(' ');
+      llvm::SmallVector<llvm::StringRef, 3> tokens;
+      position.split(tokens, ':');
+      FactRecord record;
+      json fact;
+      SourceLocation begin, end, target;
+      if (tokens.size() != 3 ||
+          !parse_block_line(fact_line, dir, record, fact) ||
+          !locate(tokens[0], begin) || !locate(tokens[1], end) ||
+          !locate(tokens[2], target))
+        return -1;
+      locate_fact(srcMgr, begin, end, target, fact, record.file,
+                  record.spelling_file);
+      record.json = fact.dump();
+      record.key_name = fact_key_name(fact, record.output_file_name);
+      facts.push_back(std::move(record));
+    }
+  }
+  if (parse_ms < 0)
+    return -1;
+
+  batch.facts = std::move(facts);
+  std::string manifest = entry_path(
+      db, source, "manifests", llvm::utohexstr(batch.inputs.front().second),
+      dir);
+  append_manifest_entry(manifest, batch.inputs, write_blocks(batch, dir), dir);
+  return parse_ms;
+}
+
+// Preprocesses a TU without parsing it and takes its facts from the fact
+// cache when an earlier parse saw the same token stream
+class TokenHashAction : public PreprocessorFrontendAction {
+public:
+  TokenHashAction(const CompilationDatabase &db, const std::string &source,
+                  FactBatch &batch, int64_t &parse_ms)
+      : db(db), source(source), batch(batch), parse_ms(parse_ms) {}
+
+protected:
+  void ExecuteAction() override {
+    Preprocessor &pp = getCompilerInstance().getPreprocessor();
+    pp.EnterMainSourceFile();
+
+    TokenDigest digest;
+    std::vector<SourceLocation> locations;
+    Token token;
+    do {
+      pp.Lex(token);
+      if (digest.add(pp, token))
+        locations.push_back(token.getLocation());
+    } while (token.isNot(tok::eof));
+    // While the files the facts are located in are still loaded
+    parse_ms = reuse_facts(db, source, digest.digest(), pp.getSourceManager(),
+                           locations, batch);
+  }
+
+private:
+  const CompilationDatabase &db;
+  const std::string &source;
+  FactBatch &batch;
+  int64_t &parse_ms;
+};
+
+class TokenHashActionFactory : public FrontendActionFactory {
+public:
+  TokenHashActionFactory(const CompilationDatabase &db,
+                         const std::string &source, FactBatch &batch)
+      : db(db), source(source), batch(batch) {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<TokenHashAction>(db, source, batch, parse_ms);
+  }
+
+  // What the parse that left the facts took, -1 while there are none
+  int64_t parse_ms = -1;
+
+private:
+  const CompilationDatabase &db;
+  const std::string &source;
+  FactBatch &batch;
+};
+
+int64_t reuse_by_token_digest(WorkerToolContext &context,
+                              const CompilationDatabase &db,
+                              const std::string &source, FactBatch &batch) {
+  TokenHashActionFactory hashing(db, source, batch);
+  context.run(db, source, &hashing);
+  // The parse records the inputs again
+  if (hashing.parse_ms < 0)
+    batch.inputs.clear();
+  return hashing.parse_ms;
+}
+
+void report_fact_cache() {
+  if (fact_cache_dir.empty())
+    return;
+  RunReport &report = run_report();
+  uint64_t lookups = fact_cache_hits + fact_cache_misses;
+  report.set("fact_cache_hits", fact_cache_hits.load());
+  report.set("fact_cache_misses", fact_cache_misses.load());
+  report.set("fact_cache_hit_rate",
+             lookups ? double(fact_cache_hits) / lookups : 0.0);
+  // Counted where the cache is read and written, which may be a forked
+  // child; added to here so the keys exist when nothing was
+  for (const char *key : {"fact_cache_bytes_read", "fact_cache_bytes_written"})
+    report.add(key, 0);
+  if (!token_hashing)
+    return;
+  for (const char *key : {"pp_hash_hits", "pp_hash_misses", "pp_hash_ms",
+                          "pp_hash_miss_ms", "pp_hash_time_saved_ms"})
+    report.add(key, 0);
+}
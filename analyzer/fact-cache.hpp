@@ -0,0 +1,103 @@
+#ifndef FACT_CACHE_HPP
+#define FACT_CACHE_HPP
+
+#include "helper.hpp"
+#include "llvm/ADT/DenseMap.h"
+#include <fcntl.h>
+
+// The directory of the fact cache, empty when it is not enabled
+extern std::string fact_cache_dir;
+
+// MD5 digest of `data` in hex, as the cache names its entries
+std::string hex_digest(llvm::StringRef data);
+
+// Keeps the facts of every parsed TU in a content-addressed cache under
+// `dir` that any run over any checkout may share, and serves a TU from it
+// instead of parsing it when its normalized compile command and the
+// contents of all files it read match an earlier parse. `config` is as for
+// enable_incremental(). Cached TUs must carry all of their facts, so header
+// skipping and the cross-TU dedup shortcuts are off. Like the incremental
+// mode it cannot be combined with enable_forced_include_pch(); must be
+// called before run_sources()
+void enable_fact_cache(const std::string &dir, llvm::StringRef config);
+
+// Preprocesses each TU the fact cache misses before parsing it, and takes
+// its facts from the cache when an earlier parse with the same flags, apart
+// from preprocessor flags, saw the same token stream. Requires
+// enable_fact_cache(); must be called before run_sources()
+void enable_token_hashing();
+extern bool token_hashing;
+
+// Digest of the tokens the preprocessor hands to the parser, their kinds
+// and spellings only: whitespace, comments, disabled code and the names of
+// the files they come from leave it alone. Annotations the parser makes
+// of pragmas are left out, as a run without a parser has none.
+class TokenDigest {
+public:
+  // Returns whether `token` is part of the stream
+  bool add(const clang::Preprocessor &pp, const clang::Token &token);
+  // Whether the stream reached the end of the TU
+  bool finished() const { return done; }
+  std::string digest();
+
+private:
+  llvm::MD5 md5;
+  llvm::SmallString<64> spelling;
+  bool done = false;
+};
+
+// The token stream of a TU being parsed for the fact cache, with the
+// position of each token by its location
+struct TokenStream {
+  void add(const clang::Preprocessor &pp, const clang::Token &token);
+  // Position of the token at `loc`, NO_TOKEN for no location. A location
+  // the stream lacks keeps the TU out of the token cache.
+  uint32_t position(clang::SourceLocation loc);
+
+  TokenDigest digest;
+  llvm::DenseMap<unsigned, uint32_t> positions;
+  uint32_t size = 0;
+  // Whether every fact found its tokens
+  bool complete = true;
+};
+
+// The token stream of the TU this thread parses, if it is digested
+extern thread_local TokenStream *current_tokens;
+
+// The directory of a TU's compile command, as the command gives it and
+// with symlinks resolved. Paths under either are cached relative to it, so
+// an entry serves any checkout of the tree.
+struct CheckoutDir {
+  std::string given;
+  std::string real;
+};
+
+// Replaces the checkout directory wherever a path in `text` starts with
+// it: $DIR for its real path, $CWD for the one the command gives ($ itself
+// becomes $$). unrelocate() puts the paths of another checkout back. With
+// `as_key` both become $DIR, for text that is only compared.
+std::string relocate(llvm::StringRef text, const CheckoutDir &dir,
+                     bool as_key = false);
+std::string unrelocate(llvm::StringRef text, const CheckoutDir &dir);
+
+// Commits `source` from the cache if one of its manifest entries matches
+// its current inputs. Counts a hit or a miss either way.
+bool serve_from_fact_cache(const clang::tooling::CompilationDatabase &db,
+                           const std::string &source);
+// Adds the facts of a TU parsed with its full flags to the cache, under
+// its inputs and, if given, the digest of its token stream
+void store_in_fact_cache(const clang::tooling::CompilationDatabase &db,
+                         const std::string &source, const FactBatch &batch,
+                         llvm::StringRef digest = "", uint64_t parse_ms = 0);
+// Preprocesses `source` with `context` and, when an earlier parse saw the
+// same token stream, fills `batch` with its facts, each located anew at the
+// tokens it was found at, and records them under the TU's current inputs.
+// Returns the time that parse took, or -1 on a miss.
+int64_t reuse_by_token_digest(WorkerToolContext &context,
+                              const clang::tooling::CompilationDatabase &db,
+                              const std::string &source, FactBatch &batch);
+// Sets the hits, misses and bytes read and written in the run report, and
+// makes sure the -pp-hash counters are there
+void report_fact_cache();
+
+#endif
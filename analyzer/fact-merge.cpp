@@ -0,0 +1,184 @@
+#include "helper.hpp"
+
+// Merges the fact segments that `analyze -shard=i/N` or `usage -shard=i/N`
+// runs wrote, on one machine or several, into the .jsonl files one run
+// over the whole compilation database would write, with the same facts in
+// the order of the digests of their keys. Segments are sorted by fact key,
+// so they are merged a line at a time, however large they are.
+
+// A shard's manifest, "segments.shard-<i>-of-<N>", and the segments it lists
+struct ShardManifest {
+  unsigned index = 0;
+  unsigned count = 0;
+  std::string path;
+  // output file name -> segment path
+  std::map<std::string, std::string> segments;
+};
+
+static bool read_manifest(const std::string &path, ShardManifest &manifest) {
+  std::string name = llvm::sys::path::filename(path).str();
+  char end;
+  if (sscanf(name.c_str(), "segments.shard-%u-of-%u%c", &manifest.index,
+             &manifest.count, &end) != 2 ||
+      manifest.index >= manifest.count)
+    return false;
+  manifest.path = path;
+  std::string suffix = segment_suffix(manifest.index, manifest.count);
+  llvm::SmallString<256> dir(path);
+  llvm::sys::path::remove_filename(dir);
+
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    llvm::StringRef facts, output;
+    std::tie(facts, output) = llvm::StringRef(line).split('\t');
+    if (output.empty())
+      continue;
+    llvm::SmallString<256> segment(dir);
+    llvm::sys::path::append(segment, output.str() + suffix);
+    manifest.segments[output.str()] = segment.str().str();
+  }
+  return true;
+}
+
+// The manifests among `inputs`, which are manifests or directories holding
+// them
+static bool find_manifests(const std::vector<std::string> &inputs,
+                           std::vector<ShardManifest> &manifests) {
+  for (const auto &input : inputs) {
+    std::error_code ec;
+    if (!std::filesystem::is_directory(input, ec)) {
+      ShardManifest manifest;
+      if (!read_manifest(input, manifest)) {
+        llvm::errs() << input << ": not a segment manifest\n";
+        return false;
+      }
+      manifests.push_back(std::move(manifest));
+      continue;
+    }
+    for (const auto &entry : std::filesystem::directory_iterator(input, ec)) {
+      ShardManifest manifest;
+      std::string name = entry.path().filename().string();
+      if (name.rfind("segments.shard-", 0) == 0 &&
+          read_manifest(entry.path().string(), manifest))
+        manifests.push_back(std::move(manifest));
+    }
+  }
+  return true;
+}
+
+// Every shard of the same split must be there exactly once, or the merged
+// files would silently miss facts
+static bool check_shards(const std::vector<ShardManifest> &manifests) {
+  if (manifests.empty()) {
+    llvm::errs() << "No segment manifests found\n";
+    return false;
+  }
+  unsigned count = manifests.front().count;
+  std::vector<const ShardManifest *> shards(count, nullptr);
+  for (const auto &manifest : manifests) {
+    if (manifest.count != count) {
+      llvm::errs() << manifest.path << ": shard of " << manifest.count
+                   << ", the others are of " << count << "\n";
+      return false;
+    }
+    if (shards[manifest.index]) {
+      llvm::errs() << manifest.path << ": shard " << manifest.index
+                   << " also in " << shards[manifest.index]->path << "\n";
+      return false;
+    }
+    shards[manifest.index] = &manifest;
+  }
+  for (unsigned i = 0; i < count; ++i) {
+    if (!shards[i]) {
+      llvm::errs() << "Shard " << i << "/" << count << " is missing\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Merges the segments of `inputs` into `path`, replacing it
+static uint64_t merge_output(const std::string &path,
+                             const std::vector<std::string> &inputs,
+                             uint64_t &duplicates,
+                             const std::function<bool(llvm::StringRef)> &keep =
+                                 nullptr) {
+  std::ofstream out(path + ".tmp",
+                    std::ios_base::binary | std::ios_base::trunc);
+  uint64_t facts = merge_fact_segments(inputs, out, false, duplicates, keep);
+  out.close();
+  std::error_code ec;
+  std::filesystem::rename(path + ".tmp", path, ec);
+  if (ec)
+    llvm::errs() << path << ": " << ec.message() << "\n";
+  return facts;
+}
+
+int main(int argc, const char **argv) {
+  llvm::cl::OptionCategory category("fact-merge options");
+  llvm::cl::list<std::string> inputs(
+      llvm::cl::Positional,
+      llvm::cl::desc("<segment manifest or directory of them>..."),
+      llvm::cl::OneOrMore, llvm::cl::cat(category));
+  llvm::cl::opt<std::string> output_dir(
+      "o", llvm::cl::desc("Directory to write the .jsonl files to"),
+      llvm::cl::init("."), llvm::cl::cat(category));
+  llvm::cl::opt<std::string> report_path(
+      "report", llvm::cl::desc("Where to write the JSON run report"),
+      llvm::cl::init("fact-merge-report.json"), llvm::cl::cat(category));
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+
+  std::vector<ShardManifest> manifests;
+  if (!find_manifests(inputs, manifests) || !check_shards(manifests))
+    return 1;
+
+  std::map<std::string, std::vector<std::string>> outputs;
+  for (const auto &manifest : manifests)
+    for (const auto &segment : manifest.segments)
+      outputs[segment.first].push_back(segment.second);
+  std::error_code ec;
+  std::filesystem::create_directories(output_dir.getValue(), ec);
+  auto output_path = [&](const std::string &name) {
+    llvm::SmallString<256> path(output_dir.getValue());
+    llvm::sys::path::append(path, name);
+    return path.str().str();
+  };
+
+  RunReport &report = run_report();
+  report.set("shards", manifests.front().count);
+  // The usages `analyze -usage` holds back refer to the handlers of all
+  // shards, they are resolved once ioctl.jsonl is merged
+  IoctlHandlers handlers;
+  for (const auto &output : outputs) {
+    if (output.first == "usage.pending")
+      continue;
+    uint64_t duplicates = 0;
+    std::function<bool(llvm::StringRef)> collect_handlers;
+    if (output.first == "ioctl.jsonl")
+      collect_handlers = [&handlers](llvm::StringRef line) {
+        handlers.add(line);
+        return true;
+      };
+    uint64_t facts = merge_output(output_path(output.first), output.second,
+                                  duplicates, collect_handlers);
+    report.append("outputs", {{"output", output.first},
+                              {"segments", output.second.size()},
+                              {"facts", facts},
+                              {"duplicates", duplicates}});
+    report.add("facts", facts);
+    report.add("duplicates", duplicates);
+  }
+
+  auto pending = outputs.find("usage.pending");
+  if (pending != outputs.end()) {
+    uint64_t duplicates = 0;
+    uint64_t facts = merge_output(
+        output_path("usage.jsonl"), pending->second, duplicates,
+        [&handlers](llvm::StringRef line) { return handlers.resolve(line); });
+    report.set("ioctl_handlers", handlers.size());
+    report.set("usage_facts", facts);
+    report.add("duplicates", duplicates);
+  }
+  report.write(report_path);
+}
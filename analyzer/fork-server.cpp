@@ -0,0 +1,308 @@
+#include "fork-server.hpp"
+
+using namespace clang;
+using namespace clang::tooling;
+
+bool fork_server = false;
+bool retry_quarantined = false;
+
+void enable_fork_server(bool retry_quarantined_tus) {
+  fork_server = true;
+  retry_quarantined = retry_quarantined_tus;
+}
+
+// The template process of -fork-server. Forks a child per TU, kills
+// children that run out of time, retries a failed TU once with reduced
+// flags and quarantines it when that fails too.
+class ForkSupervisor {
+public:
+  ForkSupervisor(const CompilationDatabase &db, FrontendActionFactory *action,
+                 unsigned jobs, size_t file_cache_limit,
+                 MemoryAdmission *admission)
+      : db(db), action(action), jobs(std::max(jobs, 1u)),
+        context(file_cache_limit), admission(admission),
+        quarantine_path(shard_dir + "/quarantine.txt") {
+    std::ifstream quarantine_file(quarantine_path);
+    std::string line;
+    while (std::getline(quarantine_file, line)) {
+      auto tab = line.find('\t');
+      quarantine[line.substr(0, tab)] =
+          tab == std::string::npos ? "" : line.substr(tab + 1);
+    }
+  }
+
+  void run(const std::vector<std::string> &sources,
+           const std::function<bool(const CompilationDatabase &,
+                                    const std::string &)> &skip);
+
+private:
+  struct ForkedTU {
+    std::string source;
+    bool reduced = false;
+    std::string batch_path;
+    std::chrono::steady_clock::time_point start;
+    // Resident memory of the template when forking, shared with the child
+    uint64_t base_rss = 0;
+    // Expected growth above base_rss, with a memory budget
+    uint64_t predicted = 0;
+    std::string kill_reason;
+  };
+
+  void warm_up(const std::string &source);
+  // Reaps children until `tu` fits in the memory budget next to the others
+  void wait_for_memory(ForkedTU &tu);
+  void start(const std::string &source, bool reduced);
+  // Reaps finished children, returns false when none was ready
+  bool reap(bool block);
+  void finish(ForkedTU &tu, int status, const struct rusage &usage);
+  void write_quarantine();
+
+  const CompilationDatabase &db;
+  FrontendActionFactory *action;
+  unsigned jobs;
+  WorkerToolContext context;
+  MemoryAdmission *admission;
+  std::map<pid_t, ForkedTU> running;
+  std::deque<std::string> retries;
+  size_t forked = 0;
+  std::string quarantine_path;
+  // source -> why it failed
+  std::map<std::string, std::string> quarantine;
+};
+
+// Only preprocesses `source`, which looks up and reads the headers most TUs
+// share into the template's FileManager (and the shared VFS) for the
+// children to start from. Nothing is parsed, so the TU, however large, is
+// forked like all others and keeps its crash isolation and time limit.
+void ForkSupervisor::warm_up(const std::string &source) {
+  auto start = std::chrono::steady_clock::now();
+  auto preprocess = newFrontendActionFactory<PreprocessOnlyAction>();
+  context.run(db, source, preprocess.get());
+  run_report().set("fork_warm_up_ms", milliseconds_since(start));
+}
+
+void ForkSupervisor::wait_for_memory(ForkedTU &tu) {
+  tu.predicted = admission->predict(tu.source);
+  auto start = std::chrono::steady_clock::now();
+  size_t stalled_running = SIZE_MAX;
+  while (true) {
+    // A child shares the template's pages until it writes to them
+    uint64_t live = resident_memory(getpid()), outstanding = 0;
+    for (const auto &entry : running) {
+      uint64_t rss = resident_memory(entry.first);
+      uint64_t grown =
+          rss > entry.second.base_rss ? rss - entry.second.base_rss : 0;
+      live += grown;
+      if (entry.second.predicted > grown)
+        outstanding += entry.second.predicted - grown;
+    }
+    if (admission->admit(tu.predicted, live, outstanding, running.size()))
+      break;
+    stalled_running = std::min(stalled_running, running.size());
+    reap(true);
+  }
+  if (stalled_running != SIZE_MAX)
+    admission->stalled(milliseconds_since(start), stalled_running);
+}
+
+void ForkSupervisor::start(const std::string &source, bool reduced) {
+  ForkedTU tu;
+  tu.source = source;
+  tu.reduced = reduced;
+  if (admission)
+    wait_for_memory(tu);
+  tu.batch_path = shard_dir + "/tu-" + std::to_string(forked++) + ".batch";
+  tu.start = std::chrono::steady_clock::now();
+  tu.base_rss = resident_memory(getpid());
+
+  pid_t pid = fork();
+  int error = errno;
+  // A child that exits frees what fork() lacked, wait for one before
+  // giving up. The template itself never parses a TU.
+  while (pid < 0 && reap(true)) {
+    pid = fork();
+    error = errno;
+  }
+  if (pid == 0) {
+    // The parent counts what it added itself; the child only reports what
+    // it adds from here on
+    count_shared_file_cache();
+    run_report().collect_additions();
+    FactBatch batch;
+    parse_tu(context, db, source, action, reduced, batch);
+    count_shared_file_cache();
+    batch.counters = run_report().take_additions();
+    // Skips exit handlers and never flushes the template's shard buffers
+    _exit(write_batch(batch, tu.batch_path) ? 0 : 1);
+  }
+  if (pid < 0) {
+    // Not journaled, so -resume parses it again
+    std::cerr << source << ": fork: " << strerror(error) << std::endl;
+    run_report().append("fork_failed_tus", source);
+    return;
+  }
+  running[pid] = std::move(tu);
+}
+
+bool ForkSupervisor::reap(bool block) {
+  while (!running.empty()) {
+    int status = 0;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, WNOHANG, &usage);
+    if (pid < 0 && errno == ECHILD) {
+      running.clear();
+      return false;
+    }
+    if (pid > 0) {
+      auto tu = running.find(pid);
+      if (tu != running.end()) {
+        finish(tu->second, status, usage);
+        running.erase(tu);
+        return true;
+      }
+      continue;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    for (auto &entry : running) {
+      ForkedTU &tu = entry.second;
+      if (!tu.kill_reason.empty())
+        continue;
+      if (tu_timeout && now - tu.start > std::chrono::seconds(tu_timeout)) {
+        tu.kill_reason = "timeout after " + std::to_string(tu_timeout) + "s";
+      } else if (tu_memory_limit) {
+        uint64_t rss = resident_memory(entry.first);
+        if (rss > tu.base_rss && rss - tu.base_rss > tu_memory_limit)
+          tu.kill_reason = "memory over " +
+                           std::to_string(tu_memory_limit >> 20) + " MiB";
+      }
+      if (!tu.kill_reason.empty())
+        kill(entry.first, SIGKILL);
+    }
+    if (!block)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+void ForkSupervisor::finish(ForkedTU &tu, int status,
+                            const struct rusage &usage) {
+  uint64_t ms = milliseconds_since(tu.start);
+  // ru_maxrss is in KiB
+  uint64_t max_rss_mib = uint64_t(usage.ru_maxrss) >> 10;
+  RunReport &report = run_report();
+  report.append("fork_latency_ms", {{"source", tu.source},
+                                    {"ms", ms},
+                                    {"max_rss_mib", max_rss_mib}});
+  report.add("fork_latency_ms_total", ms);
+
+  FactBatch batch;
+  bool ok = tu.kill_reason.empty() && WIFEXITED(status) &&
+            WEXITSTATUS(status) == 0 && read_batch(tu.batch_path, batch);
+  std::error_code ec;
+  std::filesystem::remove(tu.batch_path, ec);
+  // A TU served by -pp-hash was only preprocessed, its time and memory
+  // would mislead the schedule and the memory predictions
+  if (!batch.from_token_cache) {
+    uint64_t max_rss = uint64_t(usage.ru_maxrss) << 10;
+    uint64_t peak = max_rss > tu.base_rss ? max_rss - tu.base_rss : 0;
+    record_tu_cost(tu.source, ms, peak);
+    if (admission)
+      admission->finished(tu.source, peak);
+  }
+
+  if (ok) {
+    for (const auto &counter : batch.counters)
+      report.add(counter.first, counter.second);
+    commit_batch(batch, tu.source);
+    if (tu.reduced)
+      report.append("tus_retried_reduced", tu.source);
+    quarantine.erase(tu.source);
+    return;
+  }
+
+  std::string reason = !tu.kill_reason.empty() ? tu.kill_reason
+                       : WIFSIGNALED(status)
+                           ? strsignal(WTERMSIG(status))
+                           : "exit " + std::to_string(WEXITSTATUS(status));
+  std::cerr << tu.source << ": worker died (" << reason << ")"
+            << (tu.reduced ? "" : ", retrying with reduced flags")
+            << std::endl;
+  report.add("tus_crashed", 1);
+  report.append("crashed_tus", {{"source", tu.source},
+                                {"reason", reason},
+                                {"reduced_flags", tu.reduced},
+                                {"seconds", ms / 1000.0},
+                                {"max_rss_mib", max_rss_mib}});
+  if (tu.reduced) {
+    quarantine[tu.source] = reason;
+    // Journaled as done, with none of what the dead child may have written
+    FactBatch nothing;
+    commit_batch(nothing, tu.source);
+  } else {
+    retries.push_back(tu.source);
+  }
+}
+
+void ForkSupervisor::write_quarantine() {
+  std::ofstream quarantine_file(quarantine_path, std::ios_base::trunc);
+  for (const auto &entry : quarantine)
+    quarantine_file << entry.first << '\t' << entry.second << '\n';
+}
+
+void ForkSupervisor::run(
+    const std::vector<std::string> &sources,
+    const std::function<bool(const CompilationDatabase &, const std::string &)>
+        &skip) {
+  bool warm = false;
+  for (const auto &sourcePath : sources) {
+    if (completed_tus.count(sourcePath) || (skip && skip(db, sourcePath)))
+      continue;
+    if (quarantine.count(sourcePath) && !retry_quarantined) {
+      run_report().add("tus_quarantined", 1);
+      continue;
+    }
+    std::cout << sourcePath << std::endl;
+    // Looked up by the template, a hit needs no child
+    if (!fact_cache_dir.empty() && serve_from_fact_cache(db, sourcePath))
+      continue;
+
+    if (!warm) {
+      warm_up(sourcePath);
+      warm = true;
+    }
+
+    while (reap(false))
+      ;
+    while (!retries.empty() && running.size() < jobs) {
+      start(retries.front(), true);
+      retries.pop_front();
+    }
+    while (running.size() >= jobs)
+      reap(true);
+    start(sourcePath, false);
+  }
+
+  while (!running.empty() || !retries.empty()) {
+    while (!retries.empty() && running.size() < jobs) {
+      start(retries.front(), true);
+      retries.pop_front();
+    }
+    reap(true);
+  }
+
+  run_report().set("tus_forked", forked);
+  run_report().set("quarantine_size", quarantine.size());
+  write_quarantine();
+}
+
+void run_sources_forked(
+    const CompilationDatabase &db, const std::vector<std::string> &sources,
+    FrontendActionFactory *action, unsigned jobs, size_t file_cache_limit,
+    const std::function<bool(const CompilationDatabase &, const std::string &)>
+        &skip,
+    MemoryAdmission *admission) {
+  ForkSupervisor(db, action, jobs, file_cache_limit, admission)
+      .run(sources, skip);
+}
@@ -0,0 +1,37 @@
+#ifndef FORK_SERVER_HPP
+#define FORK_SERVER_HPP
+
+#include "fact-cache.hpp"
+#include "helper.hpp"
+#include <chrono>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern bool fork_server;
+
+// Makes run_sources() parse every TU in a child process forked from a
+// template that has preprocessed the first TU, so the FileManager (and the
+// shared VFS) children start from are warm. At most `jobs` children run
+// at once; a crashing TU only loses its own facts. A TU whose child crashes
+// or times out is retried once with reduced flags, and when that fails too
+// it is written to `<work_dir>/quarantine.txt` and skipped by later runs
+// unless `retry_quarantined` is set.
+void enable_fork_server(bool retry_quarantined = false);
+
+// What run_sources() does with the fork server enabled. Each child adds
+// its TU to the fact cache, if there is one, and sends its facts, harvested
+// headers and the run report counters it added back in a batch file under
+// shard_dir. With `admission`, a child is only forked once its TU fits in
+// the memory budget. The template never parses a TU and no other thread
+// may exist when it is called.
+void run_sources_forked(
+    const clang::tooling::CompilationDatabase &db,
+    const std::vector<std::string> &sources,
+    clang::tooling::FrontendActionFactory *action, unsigned jobs,
+    size_t file_cache_limit,
+    const std::function<bool(const clang::tooling::CompilationDatabase &,
+                             const std::string &)> &skip,
+    MemoryAdmission *admission = nullptr);
+
+#endif
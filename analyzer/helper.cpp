@@ -1,90 +1,3617 @@
-#include "helper.hpp"
+#include "compile-db.hpp"
+#include "fact-cache.hpp"
+#include "fork-server.hpp"
 
 using namespace clang;
 using namespace clang::tooling;
 using json = nlohmann::json;
 
-std::mutex mutex;
-std::set<std::string> existing_filenames;
+DigestSet existing_filenames;
+std::unique_ptr<SharedFileCache> shared_file_cache;
+bool complete_batches = false;
 
-std::string get_decl_code(const NamedDecl *decl) {
+// Set of emitted fact identities, split into independently locked shards so
+// concurrent workers rarely contend on the same mutex.
+class ConcurrentDeclSet {
+public:
+  // Returns false when the key was already present
+  bool insert(const DeclKey &key) {
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    return shard.keys.insert(key).second;
+  }
+
+  bool contains(const DeclKey &key) {
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    return shard.keys.count(key) != 0;
+  }
+
+private:
+  static constexpr unsigned NUM_SHARDS = 64;
+
+  struct Shard {
+    std::mutex mtx;
+    std::unordered_set<DeclKey, DeclKeyHash> keys;
+  };
+
+  Shard &shard_for(const DeclKey &key) {
+    return shards[DeclKeyHash()(key) % NUM_SHARDS];
+  }
+
+  Shard shards[NUM_SHARDS];
+};
+
+ConcurrentDeclSet emitted_decls;
+
+std::mutex harvested_mutex;
+std::unordered_set<HeaderKey, HeaderKeyHash> harvested_headers;
+
+static bool get_decl_key(const NamedDecl *decl,
+                         const std::string &output_file_name,
+                         const std::string &alias_name, DeclKey &key) {
   SourceManager &srcMgr = decl->getASTContext().getSourceManager();
-  SourceLocation startLoc = decl->getBeginLoc();
-  SourceLocation endLoc = decl->getEndLoc();
+  SourceLocation beginLoc = decl->getBeginLoc();
+  if (beginLoc.isInvalid())
+    return false;
 
-  if (!startLoc.isInvalid() && !endLoc.isInvalid()) {
-    // Convert the source locations to file locations
-    startLoc = srcMgr.getSpellingLoc(startLoc);
-    endLoc = srcMgr.getSpellingLoc(endLoc);
+  auto expansion = srcMgr.getDecomposedExpansionLoc(beginLoc);
+  const FileEntry *fileEntry = srcMgr.getFileEntryForID(expansion.first);
+  if (!fileEntry)
+    return false;
 
-    // Get file path and line number
-    std::string filePath = srcMgr.getFilename(startLoc).str();
-    unsigned int lineNumber = srcMgr.getSpellingLineNumber(startLoc);
+  auto uid = fileEntry->getUniqueID();
+  key.device = uid.getDevice();
+  key.file = uid.getFile();
+  key.offsets = (uint64_t(expansion.second) << 32) |
+                srcMgr.getFileOffset(srcMgr.getSpellingLoc(beginLoc));
 
-    // Extract the source code text
-    bool invalid = false;
-    StringRef text =
-        Lexer::getSourceText(CharSourceRange::getTokenRange(startLoc, endLoc),
-                             srcMgr, LangOptions(), &invalid);
+  // Plain identifiers are hashed in place, without building a std::string
+  llvm::SmallString<128> kind(output_file_name);
+  kind += '\0';
+  if (const IdentifierInfo *ident = decl->getIdentifier())
+    kind += ident->getName();
+  else
+    kind += decl->getNameAsString();
+  kind += '\0';
+  kind += alias_name;
+  key.kind = llvm::xxHash64(kind.str());
+  return true;
+}
+
+template <typename T> static void append_raw(std::string &out, const T &value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void append_string(std::string &out, llvm::StringRef value) {
+  append_raw(out, uint32_t(value.size()));
+  out.append(value.data(), value.size());
+}
+
+// Spill a worker's buffer to its shard once it grows past this size
+constexpr size_t SHARD_BUFFER_SIZE = 8 << 20;
+// The writers are checkpointed at the end of a TU once this much time has
+// passed since the last checkpoint
+std::chrono::seconds checkpoint_interval(5);
+
+void set_checkpoint_interval(unsigned seconds) {
+  checkpoint_interval = std::chrono::seconds(seconds);
+}
+
+std::mutex journal_mutex;
+std::ofstream journal;
+
+// Facts produced by one worker thread. Shard lines are
+// "<output file name>\t<json>" so one shard can hold every output kind.
+// Next to the shard the writer keeps an index log of what its facts added to
+// the dedup state: 'D'ecl keys, 'K'ey digests (with the key itself when
+// verifying) and 'H'arvested headers.
+//
+// At a checkpoint both files are flushed, and a journal record names the
+// TUs completed since the last one along with the file sizes: everything up
+// to those sizes belongs to completed TUs, which is what a resumed run goes
+// back to.
+class ShardWriter {
+public:
+  ShardWriter(const std::string &dir, unsigned id, uint64_t shard_size = 0,
+              uint64_t index_size = 0)
+      : id(id), path(dir + "/shard-" + std::to_string(id) + ".jsonl"),
+        index_path(dir + "/index-" + std::to_string(id) + ".bin"),
+        shard_size(shard_size), index_size(index_size) {
+    buffer.reserve(SHARD_BUFFER_SIZE);
+  }
+
+  void write(const std::string &output_file_name, const std::string &line) {
+    buffer += output_file_name;
+    buffer += '\t';
+    buffer += line;
+    buffer += '\n';
+    if (buffer.size() >= SHARD_BUFFER_SIZE)
+      flush();
+  }
+
+  std::string &index_log() { return index_buffer; }
+
+  void flush() {
+    append_to(shard, path, buffer, shard_size);
+    append_to(index, index_path, index_buffer, index_size);
+  }
+
+  void finish_tu(const std::string &source) { completed.push_back(source); }
+  bool has_completed() const { return !completed.empty(); }
+
+  // Flushes both files and returns the journal record of the TUs completed
+  // since the last checkpoint
+  std::string checkpoint() {
+    flush();
+    std::string record = "checkpoint " + std::to_string(id) + " " +
+                         std::to_string(shard_size) + " " +
+                         std::to_string(index_size) + " " +
+                         std::to_string(completed.size()) + "\n";
+    for (const auto &source : completed)
+      record += source + "\n";
+    completed.clear();
+    return record;
+  }
+
+  void close() {
+    flush();
+    if (shard.is_open())
+      shard.close();
+    if (index.is_open())
+      index.close();
+  }
+
+  const std::string &get_path() const { return path; }
+  const std::string &get_index_path() const { return index_path; }
+
+private:
+  static void append_to(std::ofstream &file, const std::string &file_path,
+                        std::string &data, uint64_t &size) {
+    if (data.empty())
+      return;
+    if (!file.is_open())
+      file.open(file_path, std::ios_base::binary | std::ios_base::app);
+    file.write(data.data(), data.size());
+    file.flush();
+    size += data.size();
+    data.clear();
+  }
+
+  unsigned id;
+  std::string path;
+  std::string index_path;
+  uint64_t shard_size;
+  uint64_t index_size;
+  std::string buffer;
+  std::string index_buffer;
+  std::ofstream shard;
+  std::ofstream index;
+  std::vector<std::string> completed;
+};
+
+std::string shard_dir;
+std::mutex writers_mutex;
+std::vector<std::unique_ptr<ShardWriter>> writers;
+unsigned next_shard_id = 0;
+thread_local ShardWriter *thread_writer = nullptr;
+// TUs a resumed run finds in the journal
+std::unordered_set<std::string> completed_tus;
+
+static ShardWriter &get_thread_writer() {
+  if (!thread_writer) {
+    std::lock_guard<std::mutex> lock(writers_mutex);
+    writers.push_back(std::make_unique<ShardWriter>(shard_dir,
+                                                    next_shard_id++));
+    thread_writer = writers.back().get();
+  }
+  return *thread_writer;
+}
+
+// Commits hold it shared and checkpoints exclusively, so that a checkpoint
+// finds every writer between two commits
+std::shared_mutex commit_mutex;
+std::atomic<std::chrono::steady_clock::rep> last_checkpoint{
+    std::chrono::steady_clock::now().time_since_epoch().count()};
+
+static bool checkpoint_due() {
+  auto last = std::chrono::steady_clock::time_point(
+      std::chrono::steady_clock::duration(last_checkpoint));
+  return std::chrono::steady_clock::now() - last >= checkpoint_interval;
+}
+
+// Journals the TUs all writers completed since the last checkpoint, with
+// the sizes of every shard and index log, as one group of records closed
+// by an "end" line. A TU's facts may have been deduplicated against, and
+// its headers harvested by, what another writer committed, so a resumed
+// run can only go back to a cut through all writers at once. Unless
+// `force`d, does nothing when no checkpoint is due.
+static void checkpoint_writers(bool force) {
+  std::unique_lock<std::shared_mutex> commits(commit_mutex);
+  if (!force && !checkpoint_due())
+    return;
+  last_checkpoint = std::chrono::steady_clock::now().time_since_epoch().count();
+  std::lock_guard<std::mutex> lock(writers_mutex);
+  if (llvm::none_of(writers, [](const std::unique_ptr<ShardWriter> &writer) {
+        return writer->has_completed();
+      }))
+    return;
+  std::string group;
+  for (auto &writer : writers)
+    group += writer->checkpoint();
+  group += "end\n";
+
+  std::lock_guard<std::mutex> journal_lock(journal_mutex);
+  journal.write(group.data(), group.size());
+  journal.flush();
+}
+
+struct Checkpoint {
+  uint64_t shard_size = 0;
+  uint64_t index_size = 0;
+  std::vector<std::string> sources;
+};
 
-    if (!invalid) {
-      std::string sourceCode = text.str();
-      // Now you have filePath, lineNumber, and sourceCode
-      // Store or process them as needed
-      return sourceCode;
+// Reads the complete checkpoint groups of the journal, merged per shard. A
+// "merging" record, written before merge_output_shards() appends to the
+// outputs, gives their sizes before the merge.
+static std::map<unsigned, Checkpoint>
+read_journal(const std::string &path,
+             std::vector<std::pair<std::string, uint64_t>> &merging) {
+  std::map<unsigned, Checkpoint> checkpoints;
+  // The records of a group only count once its "end" is read
+  std::vector<std::pair<unsigned, Checkpoint>> group;
+  std::ifstream journal_file(path);
+  std::string line;
+  while (std::getline(journal_file, line) && !journal_file.eof()) {
+    std::istringstream header(line);
+    std::string tag;
+    unsigned id;
+    Checkpoint record;
+    size_t count;
+    if (!(header >> tag))
+      break;
+    if (tag == "end") {
+      for (auto &entry : group) {
+        Checkpoint &checkpoint = checkpoints[entry.first];
+        checkpoint.shard_size = entry.second.shard_size;
+        checkpoint.index_size = entry.second.index_size;
+        checkpoint.sources.insert(checkpoint.sources.end(),
+                                  entry.second.sources.begin(),
+                                  entry.second.sources.end());
+      }
+      group.clear();
+      continue;
     }
+    if (tag == "merging") {
+      std::vector<std::pair<std::string, uint64_t>> outputs;
+      if (!(header >> count))
+        break;
+      while (outputs.size() < count && std::getline(journal_file, line)) {
+        llvm::StringRef size, output;
+        std::tie(size, output) = llvm::StringRef(line).split('\t');
+        uint64_t bytes;
+        if (output.empty() || size.getAsInteger(10, bytes))
+          break;
+        outputs.emplace_back(output.str(), bytes);
+      }
+      if (outputs.size() < count || journal_file.eof())
+        break;
+      merging = std::move(outputs);
+      continue;
+    }
+    if (!(header >> id >> record.shard_size >> record.index_size >> count) ||
+        tag != "checkpoint")
+      break;
+    while (record.sources.size() < count && std::getline(journal_file, line))
+      record.sources.push_back(line);
+    // A record cut short by the interruption, and anything after it
+    if (record.sources.size() < count || journal_file.eof())
+      break;
+    group.emplace_back(id, std::move(record));
   }
-  return "";
+  return checkpoints;
 }
 
-void output_decl(const NamedDecl *decl, std::string output_file_name,
-                 bool is_typedef, std::string alias_name) {
-  // Add a lock
-  std::lock_guard<std::mutex> lock(mutex);
+// Replays an index log into the dedup sets and harvested headers
+static bool load_index_log(const std::string &path) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer)
+    return false;
+  const char *p = (*buffer)->getBufferStart();
+  const char *end = (*buffer)->getBufferEnd();
+  auto read_raw = [&](auto &value) {
+    if (size_t(end - p) < sizeof(value))
+      return false;
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+  };
 
-  auto name = decl->getNameAsString();
-  std::string sourceCode = get_decl_code(decl);
+  while (p < end) {
+    char type = *p++;
+    if (type == 'D') {
+      DeclKey key;
+      if (!read_raw(key))
+        return false;
+      emitted_decls.insert(key);
+    } else if (type == 'K') {
+      KeyDigest digest;
+      uint32_t size;
+      if (!read_raw(digest) || !read_raw(size) || size_t(end - p) < size)
+        return false;
+      existing_filenames.insert(digest, llvm::StringRef(p, size));
+      p += size;
+    } else if (type == 'H') {
+      HeaderKey key;
+      if (!read_raw(key))
+        return false;
+      harvested_headers.insert(key);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
 
-  std::ofstream output_file;
-  output_file.open(output_file_name, std::ios_base::app);
-  json j;
-  j["name"] = name;
-  j["source"] = sourceCode;
+// Brings the work directory back to its last checkpoint: shards and index
+// logs are cut to the journaled sizes, the index logs are replayed and the
+// journal is rewritten without a trailing partial record. Outputs a merge
+// was appending to are cut back to their sizes before it, the shards are
+// merged again.
+static void restore_checkpoint(const std::string &dir) {
+  std::string journal_path = dir + "/journal.txt";
+  std::vector<std::pair<std::string, uint64_t>> merging;
+  auto checkpoints = read_journal(journal_path, merging);
 
-  // Get the SourceLocation for the beginning of the declaration
-  SourceLocation beginLoc = decl->getBeginLoc();
+  std::error_code ec;
+  for (const auto &output : merging)
+    std::filesystem::resize_file(output.first, output.second, ec);
+  if (!merging.empty())
+    run_report().set("merge_restarted", true);
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    auto name = entry.path().filename().string();
+    unsigned id;
+    if (sscanf(name.c_str(), "shard-%u.jsonl", &id) != 1 &&
+        sscanf(name.c_str(), "index-%u.bin", &id) != 1)
+      continue;
+    if (!checkpoints.count(id))
+      std::filesystem::remove(entry.path(), ec);
+  }
 
-  // Retrieve the SourceManager from the AST context
-  SourceManager &sourceManager = decl->getASTContext().getSourceManager();
+  std::string compacted;
+  for (const auto &entry : checkpoints) {
+    unsigned id = entry.first;
+    const Checkpoint &checkpoint = entry.second;
+    auto writer = std::make_unique<ShardWriter>(
+        dir, id, checkpoint.shard_size, checkpoint.index_size);
+    std::filesystem::resize_file(writer->get_path(), checkpoint.shard_size,
+                                 ec);
+    std::filesystem::resize_file(writer->get_index_path(),
+                                 checkpoint.index_size, ec);
+    if (!load_index_log(writer->get_index_path()))
+      std::cerr << "Damaged index log " << writer->get_index_path()
+                << std::endl;
+    writers.push_back(std::move(writer));
+    next_shard_id = std::max(next_shard_id, id + 1);
+
+    compacted += "checkpoint " + std::to_string(id) + " " +
+                 std::to_string(checkpoint.shard_size) + " " +
+                 std::to_string(checkpoint.index_size) + " " +
+                 std::to_string(checkpoint.sources.size()) + "\n";
+    for (const auto &source : checkpoint.sources) {
+      compacted += source + "\n";
+      completed_tus.insert(source);
+    }
+  }
+  if (!compacted.empty())
+    compacted += "end\n";
+
+  std::ofstream(journal_path + ".tmp", std::ios_base::trunc) << compacted;
+  std::filesystem::rename(journal_path + ".tmp", journal_path, ec);
+  run_report().set("tus_resumed", completed_tus.size());
+}
+
+void open_output_shards(const std::string &dir, bool resume) {
+  shard_dir = dir;
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    auto name = entry.path().filename().string();
+    // TU batches never outlive their run; shards, index logs and the
+    // journal of an interrupted run only if it is resumed. tu-stats.txt
+    // stays for the schedule of the next run.
+    if ((name.rfind("tu-", 0) == 0 && entry.path().extension() == ".batch") ||
+        (!resume &&
+         (name.rfind("shard-", 0) == 0 || name.rfind("index-", 0) == 0 ||
+          name.rfind("merge-", 0) == 0 || name.rfind("journal.", 0) == 0)))
+      std::filesystem::remove(entry.path(), ec);
+  }
+  if (resume)
+    restore_checkpoint(dir);
+  journal.open(dir + "/journal.txt", std::ios_base::app);
+}
+
+// Reads one shard, passing each fact as (output file name, json)
+static void read_shard(
+    const std::string &path,
+    const std::function<void(llvm::StringRef, llvm::StringRef)> &fn) {
+  std::ifstream shard(path, std::ios_base::binary);
+  std::string line;
+  while (std::getline(shard, line)) {
+    auto tab = line.find('\t');
+    if (tab == std::string::npos)
+      continue;
+    llvm::StringRef fact(line);
+    fn(fact.take_front(tab), fact.drop_front(tab + 1));
+  }
+}
+
+struct TuDeps {
+  uint64_t command_hash = 0;
+  TuInputs inputs;
+};
+
+// Bump when the same sources start to yield different facts
+constexpr unsigned FACT_FORMAT_VERSION = 1;
+
+std::string incremental_dir;
+uint64_t incremental_config = 0;
+std::mutex deps_mutex;
+// TU -> its inputs when its facts were last extracted
+std::unordered_map<std::string, TuDeps> tu_deps;
+// Compile command hashes of this run's sources
+std::unordered_map<std::string, uint64_t> command_hashes;
+// TUs of the last run this run has to parse again
+std::unordered_set<std::string> dirty_tus;
+// Output file -> the output name its facts were produced under, e.g.
+// usage.jsonl <- usage.pending with `analyze -usage`
+std::map<std::string, std::string> output_kinds;
+// Key digest of every fact in the outputs -> the files it is located in,
+// as ids into fact_file_names; kept in fact-files.bin
+constexpr uint32_t NO_FILE = UINT32_MAX;
+std::mutex fact_files_mutex;
+std::unordered_map<KeyDigest, std::pair<uint32_t, uint32_t>, KeyDigestHash>
+    fact_files;
+std::vector<std::string> fact_file_names;
+llvm::StringMap<uint32_t> fact_file_ids;
+
+uint64_t fact_config_hash(llvm::StringRef config) {
+  return llvm::xxHash64(std::to_string(FACT_FORMAT_VERSION) + "\n" +
+                        config.str());
+}
+
+// The alias a fact is deduplicated under: a pending usage is told apart by
+// the definition of the variable it refers to, not only by its name
+static std::string key_alias(const std::string &alias_name,
+                             const std::string &target) {
+  return target.empty() ? alias_name : alias_name + "@" + target;
+}
+
+std::string fact_key_name(const json &fact, llvm::StringRef output_file_name) {
+  return fact.value("filename", std::string()) + "+" +
+         fact.value("name", std::string()) + "+" + output_file_name.str() +
+         "+" +
+         key_alias(fact.value("alias", std::string()),
+                   fact.value("target", std::string()));
+}
+
+void enable_incremental(const std::string &work_dir, llvm::StringRef config) {
+  incremental_dir = work_dir;
+  incremental_config = fact_config_hash(config);
+}
+
+// Called with fact_files_mutex held
+static uint32_t fact_file_id(llvm::StringRef file) {
+  if (file.empty())
+    return NO_FILE;
+  auto id = fact_file_ids.try_emplace(file, fact_file_names.size());
+  if (id.second)
+    fact_file_names.push_back(file.str());
+  return id.first->second;
+}
+
+// Remembers where the fact with key `digest` is located, for a later run
+// to retract it when `file` or `spelling_file` changes
+static void record_fact_files(const KeyDigest &digest, llvm::StringRef file,
+                              llvm::StringRef spelling_file) {
+  if (file.empty())
+    return;
+  std::lock_guard<std::mutex> lock(fact_files_mutex);
+  fact_files[digest] = {fact_file_id(file), fact_file_id(spelling_file)};
+}
+
+// fact-files.bin: the number of file names and the names, then a key
+// digest and two file ids per fact
+static void load_fact_files(const std::string &path) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer)
+    return;
+  const char *p = (*buffer)->getBufferStart();
+  const char *end = (*buffer)->getBufferEnd();
+  auto read_raw = [&](auto &value) {
+    if (size_t(end - p) < sizeof(value))
+      return false;
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+  };
+  uint32_t count;
+  if (!read_raw(count))
+    return;
+  std::vector<uint32_t> ids;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t size;
+    if (!read_raw(size) || size_t(end - p) < size)
+      return;
+    ids.push_back(fact_file_id(llvm::StringRef(p, size)));
+    p += size;
+  }
+  auto to_id = [&](uint32_t index) {
+    return index < ids.size() ? ids[index] : NO_FILE;
+  };
+  KeyDigest digest;
+  uint32_t file, spelling_file;
+  while (read_raw(digest) && read_raw(file) && read_raw(spelling_file))
+    fact_files[digest] = {to_id(file), to_id(spelling_file)};
+}
+
+static void save_fact_files(const std::string &path) {
+  std::lock_guard<std::mutex> lock(fact_files_mutex);
+  std::string out;
+  append_raw(out, uint32_t(fact_file_names.size()));
+  for (const auto &name : fact_file_names)
+    append_string(out, name);
+  for (const auto &entry : fact_files) {
+    append_raw(out, entry.first);
+    append_raw(out, entry.second.first);
+    append_raw(out, entry.second.second);
+  }
+  std::ofstream file(path + ".tmp",
+                     std::ios_base::binary | std::ios_base::trunc);
+  file.write(out.data(), out.size());
+  file.close();
+  std::error_code ec;
+  std::filesystem::rename(path + ".tmp", path, ec);
+}
+
+// Whether the fact with key `digest` is located in one of the `retracted`
+// files. Facts without recorded files go by the path in their filename,
+// "<path>:<line>".
+static bool in_retracted_file(const std::unordered_set<std::string> &retracted,
+                              const KeyDigest &digest,
+                              llvm::StringRef filename) {
+  std::lock_guard<std::mutex> lock(fact_files_mutex);
+  auto files = fact_files.find(digest);
+  if (files == fact_files.end())
+    return retracted.count(filename.rsplit(':').first.str());
+  for (uint32_t id : {files->second.first, files->second.second})
+    if (id != NO_FILE && retracted.count(fact_file_names[id]))
+      return true;
+  return false;
+}
+
+static uint64_t compile_command_hash(const CompileCommand &command) {
+  std::string text = command.Directory;
+  for (const auto &arg : command.CommandLine) {
+    text += '\0';
+    text += arg;
+  }
+  return llvm::xxHash64(text);
+}
+
+// deps.txt holds "F <hash> <path>" records, numbered in order, and for each
+// TU a "T <command hash> <source>" record followed by "I <file>..." with
+// the numbers of its inputs. Loads it into tu_deps; returns false when it
+// is missing, damaged or, unless `config` is null, of another configuration.
+static bool read_deps(const std::string &path, const uint64_t *config) {
+  std::ifstream deps(path);
+  std::string line;
+  if (!std::getline(deps, line) ||
+      !llvm::StringRef(line).startswith("config ") ||
+      (config && line != "config " + llvm::utohexstr(*config)))
+    return false;
+  TuInputs files;
+  std::string source;
+  uint64_t command_hash = 0;
+  while (std::getline(deps, line)) {
+    llvm::StringRef record(line);
+    uint64_t hash;
+    if (record.consume_front("F ")) {
+      auto fields = record.split(' ');
+      if (fields.first.getAsInteger(16, hash))
+        return false;
+      files.emplace_back(fields.second.str(), hash);
+    } else if (record.consume_front("T ")) {
+      auto fields = record.split(' ');
+      if (fields.first.getAsInteger(16, command_hash))
+        return false;
+      source = fields.second.str();
+    } else if (record.consume_front("I")) {
+      TuDeps &tu = tu_deps[source];
+      tu.command_hash = command_hash;
+      for (llvm::StringRef id : llvm::split(record.ltrim(), ' ')) {
+        size_t index;
+        if (id.getAsInteger(10, index) || index >= files.size())
+          return false;
+        tu.inputs.push_back(files[index]);
+      }
+    }
+  }
+  return true;
+}
+
+// Returns false when there is no state of the current configuration
+static bool load_incremental_state() {
+  std::ifstream outputs(incremental_dir + "/outputs.txt");
+  std::string line;
+  while (std::getline(outputs, line)) {
+    auto fields = llvm::StringRef(line).split('\t');
+    if (!fields.second.empty())
+      output_kinds[fields.first.str()] = fields.second.str();
+  }
+  if (!read_deps(incremental_dir + "/deps.txt", &incremental_config))
+    return false;
+  load_fact_files(incremental_dir + "/fact-files.bin");
+
+  auto harvested =
+      llvm::MemoryBuffer::getFile(incremental_dir + "/harvested.bin");
+  if (harvested) {
+    llvm::StringRef data = (*harvested)->getBuffer();
+    for (size_t i = 0; i + sizeof(HeaderKey) <= data.size();
+         i += sizeof(HeaderKey)) {
+      HeaderKey key;
+      std::memcpy(&key, data.data() + i, sizeof(key));
+      harvested_headers.insert(key);
+    }
+  }
+  return true;
+}
+
+// Writes the state the next run starts from. Only called once the outputs
+// hold every fact, an interrupted run leaves the previous state in place.
+static void save_incremental_state() {
+  std::lock_guard<std::mutex> lock(deps_mutex);
+  // Due TUs that were not parsed after all (skipped, dropped) have no
+  // inputs, the next run parses them again
+  for (const auto &source : dirty_tus)
+    tu_deps.erase(source);
+
+  std::string path = incremental_dir + "/deps.txt";
+  std::ofstream deps(path + ".tmp", std::ios_base::trunc);
+  deps << "config " << llvm::utohexstr(incremental_config) << '\n';
+  std::unordered_map<std::string, size_t> ids;
+  for (const auto &entry : tu_deps) {
+    std::string refs;
+    for (const auto &input : entry.second.inputs) {
+      std::string file = llvm::utohexstr(input.second) + " " + input.first;
+      auto id = ids.try_emplace(file, ids.size());
+      if (id.second)
+        deps << "F " << file << '\n';
+      refs += " " + std::to_string(id.first->second);
+    }
+    deps << "T " << llvm::utohexstr(entry.second.command_hash) << ' '
+         << entry.first << "\nI" << refs << '\n';
+  }
+  deps.close();
+  std::error_code ec;
+  std::filesystem::rename(path + ".tmp", path, ec);
+
+  path = incremental_dir + "/outputs.txt";
+  std::ofstream outputs(path + ".tmp", std::ios_base::trunc);
+  for (const auto &output : output_kinds)
+    outputs << output.first << '\t' << output.second << '\n';
+  outputs.close();
+  std::filesystem::rename(path + ".tmp", path, ec);
+  save_fact_files(incremental_dir + "/fact-files.bin");
+
+  path = incremental_dir + "/harvested.bin";
+  std::ofstream harvested(path + ".tmp",
+                          std::ios_base::binary | std::ios_base::trunc);
+  {
+    std::lock_guard<std::mutex> harvested_lock(harvested_mutex);
+    for (const auto &key : harvested_headers)
+      harvested.write(reinterpret_cast<const char *>(&key), sizeof(key));
+  }
+  harvested.close();
+  std::filesystem::rename(path + ".tmp", path, ec);
+}
+
+// Rewrites an output file without the facts located in `retracted` files,
+// or without any facts when it is null, and enters the facts it keeps into
+// the dedup index. Facts are located by the files commit_batch() recorded
+// for them, since the filename of a declaration a macro expands to holds
+// presumed paths and columns.
+static void retract_facts(const std::string &path, const std::string &kind,
+                          const std::unordered_set<std::string> *retracted,
+                          std::atomic<uint64_t> &kept,
+                          std::atomic<uint64_t> &dropped) {
+  auto buffer = llvm::MemoryBuffer::getFile(path, false, false);
+  if (!buffer)
+    return;
+  std::ofstream out(path + ".tmp", std::ios_base::trunc);
+  llvm::StringRef rest = (*buffer)->getBuffer();
+  while (!rest.empty()) {
+    llvm::StringRef line;
+    std::tie(line, rest) = rest.split('\n');
+    if (line.empty())
+      continue;
+    auto fact = json::parse(line.begin(), line.end(), nullptr, false);
+    std::string filename = fact.is_discarded()
+                               ? std::string()
+                               : fact.value("filename", std::string());
+    std::string key_name = fact_key_name(fact, kind);
+    KeyDigest digest = digest_key(key_name);
+    if (filename.empty() || !retracted ||
+        in_retracted_file(*retracted, digest, filename)) {
+      std::lock_guard<std::mutex> lock(fact_files_mutex);
+      fact_files.erase(digest);
+      dropped++;
+      continue;
+    }
+    existing_filenames.insert(digest, key_name);
+    out.write(line.data(), line.size());
+    out << '\n';
+    kept++;
+  }
+  out.close();
+  std::error_code ec;
+  std::filesystem::rename(path + ".tmp", path, ec);
+}
+
+// Decides which TUs an incremental run parses. TUs whose compile command
+// and inputs are unchanged count as completed. The facts of changed files,
+// of the main files of the TUs to parse and of TUs gone from the
+// compilation database are retracted from the outputs.
+static void prepare_incremental_run(const CompilationDatabase &db,
+                                    const std::vector<std::string> &sources,
+                                    WorkerPool &pool) {
+  bool have_state = load_incremental_state();
+  if (!have_state)
+    tu_deps.clear();
+  for (const auto &source : sources) {
+    auto commands = db.getCompileCommands(source);
+    if (!commands.empty())
+      command_hashes[source] = compile_command_hash(commands.front());
+  }
+
+  // Hash every input of the last run once, on the pool
+  std::vector<std::string> paths;
+  {
+    std::unordered_set<std::string> seen;
+    for (const auto &entry : tu_deps)
+      for (const auto &input : entry.second.inputs)
+        if (seen.insert(input.first).second)
+          paths.push_back(input.first);
+  }
+  std::vector<uint64_t> hashes(paths.size());
+  std::vector<char> present(paths.size());
+  constexpr size_t HASH_CHUNK = 256;
+  for (size_t begin = 0; begin < paths.size(); begin += HASH_CHUNK) {
+    pool.submit([&, begin](unsigned) {
+      size_t end = std::min(begin + HASH_CHUNK, paths.size());
+      for (size_t i = begin; i < end; ++i) {
+        auto buffer = llvm::MemoryBuffer::getFile(paths[i], false, false);
+        if (buffer) {
+          hashes[i] = llvm::xxHash64((*buffer)->getBuffer());
+          present[i] = true;
+        }
+      }
+    });
+  }
+  pool.wait();
+  std::unordered_map<std::string, uint64_t> current;
+  for (size_t i = 0; i < paths.size(); ++i)
+    if (present[i])
+      current.emplace(paths[i], hashes[i]);
+
+  std::unordered_set<std::string> retracted;
+  std::vector<std::string> removed_mains;
+  for (auto it = tu_deps.begin(); it != tu_deps.end();) {
+    const TuDeps &deps = it->second;
+    bool changed = false;
+    for (const auto &input : deps.inputs) {
+      auto hash = current.find(input.first);
+      if (hash == current.end() || hash->second != input.second) {
+        retracted.insert(input.first);
+        changed = true;
+      }
+    }
+    auto command = command_hashes.find(it->first);
+    if (command == command_hashes.end()) {
+      removed_mains.push_back(deps.inputs.front().first);
+      it = tu_deps.erase(it);
+      continue;
+    }
+    if (changed || command->second != deps.command_hash) {
+      retracted.insert(deps.inputs.front().first);
+      dirty_tus.insert(it->first);
+    } else {
+      completed_tus.insert(it->first);
+    }
+    ++it;
+  }
+  // The main file of a removed TU may still be included elsewhere
+  if (!removed_mains.empty()) {
+    std::unordered_set<std::string> inputs;
+    for (const auto &entry : tu_deps)
+      for (const auto &input : entry.second.inputs)
+        inputs.insert(input.first);
+    for (const auto &main_file : removed_mains)
+      if (!inputs.count(main_file))
+        retracted.insert(main_file);
+  }
+
+  std::atomic<uint64_t> kept{0};
+  std::atomic<uint64_t> dropped{0};
+  for (const auto &output : output_kinds) {
+    pool.submit([&, path = output.first, kind = output.second](unsigned) {
+      retract_facts(path, kind, have_state ? &retracted : nullptr, kept,
+                    dropped);
+    });
+  }
+  pool.wait();
+
+  RunReport &report = run_report();
+  report.set("tus_unchanged", completed_tus.size());
+  report.set("tus_removed", removed_mains.size());
+  report.set("files_retracted", retracted.size());
+  report.set("facts_kept", kept.load());
+  report.set("facts_retracted", dropped.load());
+}
+
+std::string changed_files_list;
+std::string include_graph_path;
+
+void enable_changed_files(const std::string &list_path,
+                          const std::string &work_dir) {
+  changed_files_list = list_path;
+  include_graph_path = work_dir + "/deps.txt";
+}
+
+// Marks every TU outside the closure of the changed files as completed.
+// The closure holds the TUs that entered a changed file according to the
+// include graph, the TUs whose compile command changed since the graph was
+// recorded, and the TUs the graph does not know whose main file changed.
+static void select_changed_tus(const CompilationDatabase &db,
+                               const std::vector<std::string> &sources) {
+  std::ifstream list_file;
+  if (changed_files_list != "-")
+    list_file.open(changed_files_list);
+  std::istream &list = changed_files_list == "-" ? std::cin : list_file;
+  // Relative paths, as git prints them from the top of the tree, match any
+  // input path that ends in them
+  std::unordered_set<std::string> changed;
+  std::string line;
+  while (std::getline(list, line)) {
+    llvm::SmallString<256> path(llvm::StringRef(line).trim());
+    if (path.empty())
+      continue;
+    // Input paths have their symlinks resolved
+    llvm::SmallString<256> real;
+    if (llvm::sys::path::is_absolute(path) &&
+        !llvm::sys::fs::real_path(path, real))
+      path = real;
+    changed.insert(path.str().str());
+  }
+
+  // validate_run_options() made sure there is one
+  if (!read_deps(include_graph_path, nullptr)) {
+    std::cerr << "The include graph in " << include_graph_path
+              << " is damaged, all TUs are parsed" << std::endl;
+    tu_deps.clear();
+    run_report().set("tus_affected", sources.size());
+    return;
+  }
+
+  std::unordered_map<std::string, bool> known;
+  std::unordered_set<std::string> matched;
+  auto is_changed = [&](const std::string &path) {
+    auto entry = known.find(path);
+    if (entry != known.end())
+      return entry->second;
+    bool result = changed.count(path);
+    if (result)
+      matched.insert(path);
+    for (size_t pos = path.find('/'); !result && pos != std::string::npos;
+         pos = path.find('/', pos + 1)) {
+      std::string suffix = path.substr(pos + 1);
+      if (changed.count(suffix)) {
+        matched.insert(suffix);
+        result = true;
+      }
+    }
+    known.emplace(path, result);
+    return result;
+  };
+
+  uint64_t affected = 0;
+  uint64_t command_changed = 0;
+  for (const auto &source : sources) {
+    auto deps = tu_deps.find(source);
+    bool hit = false;
+    if (deps == tu_deps.end()) {
+      hit = is_changed(source);
+    } else {
+      // Every input is looked at, for the report of unmatched files
+      for (const auto &input : deps->second.inputs)
+        hit |= is_changed(input.first);
+      // Its inputs in the graph may be out of date, as may its facts
+      auto commands = db.getCompileCommands(source);
+      if (!commands.empty() && compile_command_hash(commands.front()) !=
+                                   deps->second.command_hash) {
+        command_changed++;
+        hit = true;
+      }
+    }
+    if (hit)
+      affected++;
+    else
+      completed_tus.insert(source);
+  }
+  tu_deps.clear();
+
+  // Changed files no TU reads, or a graph that is out of date
+  nlohmann::json unmatched = nlohmann::json::array();
+  for (const auto &path : changed)
+    if (!matched.count(path))
+      unmatched.push_back(path);
+  RunReport &report = run_report();
+  report.set("tus_affected", affected);
+  report.set("tus_command_changed", command_changed);
+  report.set("changed_files_unmatched", unmatched);
+}
+
+void scan_output_shards(
+    const std::function<void(llvm::StringRef, llvm::StringRef)> &fn) {
+  std::lock_guard<std::mutex> lock(writers_mutex);
+  for (auto &writer : writers) {
+    writer->flush();
+    read_shard(writer->get_path(), fn);
+  }
+  // The facts kept from earlier runs are part of this run's outputs
+  if (incremental_dir.empty())
+    return;
+  for (const auto &output : output_kinds) {
+    std::ifstream store(output.first);
+    std::string line;
+    while (std::getline(store, line))
+      if (!line.empty())
+        fn(output.second, line);
+  }
+}
+
+unsigned db_shard_index = 0;
+unsigned db_shard_count = 0;
+std::string shard_costs_path;
+
+void enable_db_sharding(unsigned index, unsigned count,
+                        const std::string &costs_path) {
+  db_shard_index = index;
+  db_shard_count = count;
+  shard_costs_path = costs_path;
+}
+
+std::string segment_suffix(unsigned index, unsigned count) {
+  return ".shard-" + std::to_string(index) + "-of-" + std::to_string(count);
+}
+
+// A shard sorts this many bytes of facts in memory before spilling a run
+constexpr size_t SEGMENT_RUN_SIZE = 64 << 20;
+
+// Line of a fact segment: "<hex key digest>\t<json>". Sorting the lines
+// orders the facts by key, and the variants of a key by their json.
+static std::string segment_line(llvm::StringRef output_file_name,
+                                llvm::StringRef line) {
+  auto fact = json::parse(line.begin(), line.end(), nullptr, false);
+  std::string key = fact.is_discarded()
+                        ? line.str()
+                        : fact_key_name(fact, output_file_name);
+  return hex_digest(key) + "\t" + line.str();
+}
+
+uint64_t merge_fact_segments(const std::vector<std::string> &inputs,
+                             std::ostream &out, bool keep_digests,
+                             uint64_t &duplicates,
+                             const std::function<bool(llvm::StringRef)> &keep) {
+  struct Head {
+    std::string line;
+    size_t input;
+  };
+  auto later = [](const Head &a, const Head &b) {
+    return a.line != b.line ? a.line > b.line : a.input > b.input;
+  };
+  std::vector<std::unique_ptr<std::ifstream>> files;
+  std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+  auto advance = [&](size_t input) {
+    Head head{std::string(), input};
+    while (std::getline(*files[input], head.line))
+      if (!head.line.empty()) {
+        heads.push(std::move(head));
+        return;
+      }
+  };
+  for (const auto &path : inputs) {
+    files.push_back(
+        std::make_unique<std::ifstream>(path, std::ios_base::binary));
+    advance(files.size() - 1);
+  }
+
+  uint64_t written = 0;
+  std::string last_digest;
+  while (!heads.empty()) {
+    Head head = std::move(const_cast<Head &>(heads.top()));
+    heads.pop();
+    llvm::StringRef digest, fact;
+    std::tie(digest, fact) = llvm::StringRef(head.line).split('\t');
+    if (digest == last_digest) {
+      duplicates++;
+    } else {
+      last_digest = digest.str();
+      if (!keep || keep(fact)) {
+        llvm::StringRef line = keep_digests ? llvm::StringRef(head.line) : fact;
+        out.write(line.data(), line.size());
+        out << '\n';
+        written++;
+      }
+    }
+    advance(head.input);
+  }
+  return written;
+}
+
+// With -shard, writes the facts of each output as a segment in the work
+// directory, `<output>.shard-<i>-of-<N>`, sorted and without duplicate
+// keys, for fact-merge. The facts are sorted in runs of SEGMENT_RUN_SIZE
+// that are then merged. The manifest listing the segments is written last
+// and marks the shard as complete.
+static void write_fact_segments(
+    const std::function<std::string(llvm::StringRef, llvm::StringRef)>
+        &route) {
+  struct Runs {
+    std::vector<std::string> lines;
+    std::vector<std::string> paths;
+  };
+  std::map<std::string, Runs> targets;
+  size_t buffered = 0;
+  unsigned next_run = 0;
+  auto spill = [&]() {
+    for (auto &target : targets) {
+      Runs &runs = target.second;
+      if (runs.lines.empty())
+        continue;
+      std::sort(runs.lines.begin(), runs.lines.end());
+      runs.paths.push_back(shard_dir + "/run-" + std::to_string(next_run++) +
+                           ".seg");
+      std::ofstream run(runs.paths.back(),
+                        std::ios_base::binary | std::ios_base::trunc);
+      for (const auto &line : runs.lines)
+        run << line << '\n';
+      runs.lines.clear();
+    }
+    buffered = 0;
+  };
+  for (auto &writer : writers) {
+    read_shard(writer->get_path(), [&](llvm::StringRef output_file_name,
+                                       llvm::StringRef line) {
+      std::string target =
+          route ? route(output_file_name, line) : output_file_name.str();
+      if (target.empty())
+        return;
+      Runs &runs = targets[target];
+      runs.lines.push_back(segment_line(output_file_name, line));
+      buffered += runs.lines.back().size();
+      if (buffered >= SEGMENT_RUN_SIZE)
+        spill();
+    });
+  }
+  spill();
+
+  std::string suffix = segment_suffix(db_shard_index, db_shard_count);
+  std::string manifest;
+  uint64_t total = 0;
+  std::error_code ec;
+  for (auto &target : targets) {
+    std::string name = llvm::sys::path::filename(target.first).str();
+    std::string segment = shard_dir + "/" + name + suffix;
+    uint64_t duplicates = 0;
+    std::ofstream out(segment + ".tmp",
+                      std::ios_base::binary | std::ios_base::trunc);
+    uint64_t facts =
+        merge_fact_segments(target.second.paths, out, true, duplicates);
+    out.close();
+    std::filesystem::rename(segment + ".tmp", segment, ec);
+    for (const auto &path : target.second.paths)
+      std::filesystem::remove(path, ec);
+    manifest += std::to_string(facts) + "\t" + name + "\n";
+    total += facts;
+  }
+  std::string manifest_path = shard_dir + "/segments" + suffix;
+  std::ofstream(manifest_path + ".tmp", std::ios_base::trunc) << manifest;
+  std::filesystem::rename(manifest_path + ".tmp", manifest_path, ec);
+  RunReport &report = run_report();
+  report.set("segment_manifest", manifest_path);
+  report.set("segment_facts", total);
+}
+
+// Appends the facts of the shards to the outputs. The facts of each output
+// are collected in the work directory first, then appended to it.
+static void append_to_outputs(
+    const std::function<std::string(llvm::StringRef, llvm::StringRef)>
+        &route) {
+  std::map<std::string, std::ofstream> outputs;
+  auto staged_path = [](const std::string &target) {
+    return shard_dir + "/merge-" + llvm::sys::path::filename(target).str();
+  };
+  for (auto &writer : writers) {
+    read_shard(writer->get_path(), [&](llvm::StringRef output_file_name,
+                                       llvm::StringRef line) {
+      std::string target =
+          route ? route(output_file_name, line) : output_file_name.str();
+      if (target.empty())
+        return;
+      output_kinds.emplace(target, output_file_name.str());
+      auto &output_file = outputs[target];
+      if (!output_file.is_open())
+        output_file.open(staged_path(target),
+                         std::ios_base::binary | std::ios_base::trunc);
+      output_file.write(line.data(), line.size());
+      output_file << '\n';
+    });
+  }
+  for (auto &output : outputs)
+    output.second.close();
+
+  // What a resumed run cuts the outputs back to before merging again
+  std::string record = "merging " + std::to_string(outputs.size()) + "\n";
+  for (auto &output : outputs) {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(output.first, ec);
+    record += std::to_string(ec ? 0 : size) + "\t" + output.first + "\n";
+  }
+  {
+    std::lock_guard<std::mutex> journal_lock(journal_mutex);
+    journal.write(record.data(), record.size());
+    journal.flush();
+  }
+  for (auto &output : outputs) {
+    std::string staged = staged_path(output.first);
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(output.first, ec);
+    if (ec || size == 0) {
+      std::filesystem::rename(staged, output.first, ec);
+      if (!ec)
+        continue;
+    }
+    std::ifstream in(staged, std::ios_base::binary);
+    std::ofstream(output.first, std::ios_base::binary | std::ios_base::app)
+        << in.rdbuf();
+  }
+  std::error_code ec;
+  for (auto &output : outputs)
+    std::filesystem::remove(staged_path(output.first), ec);
+}
+
+void merge_output_shards(
+    const std::function<std::string(llvm::StringRef, llvm::StringRef)>
+        &route) {
+  // Every TU is journaled before anything is merged, and the shards stay
+  // until the journal is gone, so an interrupted merge can start over
+  checkpoint_writers(true);
+  std::lock_guard<std::mutex> lock(writers_mutex);
+  for (auto &writer : writers)
+    writer->close();
+
+  // Segments are written whole, a restarted merge just writes them again
+  if (db_shard_count)
+    write_fact_segments(route);
+  else
+    append_to_outputs(route);
 
+  // The run is complete, nothing is left to resume
+  journal.close();
+  std::error_code ec;
+  std::filesystem::remove(shard_dir + "/journal.txt", ec);
+  for (auto &writer : writers) {
+    std::filesystem::remove(writer->get_path(), ec);
+    std::filesystem::remove(writer->get_index_path(), ec);
+  }
+  if (!incremental_dir.empty())
+    save_incremental_state();
+}
+
+// The batch of the TU this thread is parsing
+thread_local FactBatch *current_batch = nullptr;
+
+// Adds a batch to the dedup sets and this thread's writer
+static void commit_to_writer(FactBatch &batch, const std::string &source) {
+  ShardWriter &writer = get_thread_writer();
+  std::string &index_log = writer.index_log();
+  for (const auto &fact : batch.facts) {
+    if (fact.has_key) {
+      if (!emitted_decls.insert(fact.key))
+        continue;
+      index_log += 'D';
+      append_raw(index_log, fact.key);
+    }
+    KeyDigest digest = digest_key(fact.key_name);
+    if (!existing_filenames.insert(digest, fact.key_name))
+      continue;
+    index_log += 'K';
+    append_raw(index_log, digest);
+    append_string(index_log, existing_filenames.verifying()
+                                 ? llvm::StringRef(fact.key_name)
+                                 : llvm::StringRef());
+    writer.write(fact.output_file_name, fact.json);
+    if (!incremental_dir.empty())
+      record_fact_files(digest, fact.file, fact.spelling_file);
+  }
+
+  size_t added = 0;
+  {
+    std::lock_guard<std::mutex> lock(harvested_mutex);
+    for (const auto &key : batch.headers) {
+      if (harvested_headers.insert(key).second) {
+        index_log += 'H';
+        append_raw(index_log, key);
+        added++;
+      }
+    }
+  }
+  run_report().add("headers_harvested", added);
+  run_report().add("header_decls_skipped", batch.header_decls_skipped);
+
+  if (!incremental_dir.empty() && !source.empty()) {
+    std::lock_guard<std::mutex> lock(deps_mutex);
+    dirty_tus.erase(source);
+    // A TU dropped without inputs is parsed again by the next run
+    if (batch.inputs.empty())
+      tu_deps.erase(source);
+    else
+      tu_deps[source] = {command_hashes[source], std::move(batch.inputs)};
+    run_report().add("tus_reparsed", 1);
+  }
+
+  if (!source.empty())
+    writer.finish_tu(source);
+}
+
+void commit_batch(FactBatch &batch, const std::string &source) {
+  {
+    std::shared_lock<std::shared_mutex> commits(commit_mutex);
+    commit_to_writer(batch, source);
+  }
+  if (!source.empty() && checkpoint_due())
+    checkpoint_writers(false);
+}
+
+bool write_batch(const FactBatch &batch, const std::string &path) {
+  std::string out;
+  for (const auto &fact : batch.facts) {
+    out += 'F';
+    append_raw(out, uint8_t(fact.has_key));
+    append_raw(out, fact.key);
+    append_string(out, fact.output_file_name);
+    append_string(out, fact.key_name);
+    append_string(out, fact.json);
+    append_string(out, fact.file);
+    append_string(out, fact.spelling_file);
+  }
+  for (const auto &header : batch.headers) {
+    out += 'H';
+    append_raw(out, header);
+  }
+  for (const auto &counter : batch.counters) {
+    out += 'C';
+    append_string(out, counter.first);
+    append_raw(out, counter.second);
+  }
+  for (const auto &input : batch.inputs) {
+    out += 'I';
+    append_raw(out, input.second);
+    append_string(out, input.first);
+  }
+  if (batch.from_token_cache)
+    out += 'T';
+  out += 'E';
+  append_raw(out, batch.header_decls_skipped);
+
+  std::ofstream file(path, std::ios_base::binary | std::ios_base::trunc);
+  file.write(out.data(), out.size());
+  file.close();
+  return !file.fail();
+}
+
+bool read_batch(const std::string &path, FactBatch &batch) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer)
+    return false;
+  const char *p = (*buffer)->getBufferStart();
+  const char *end = (*buffer)->getBufferEnd();
+
+  auto read_raw = [&](auto &value) {
+    if (size_t(end - p) < sizeof(value))
+      return false;
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+  };
+  auto read_string = [&](std::string &value) {
+    uint32_t size;
+    if (!read_raw(size) || size_t(end - p) < size)
+      return false;
+    value.assign(p, size);
+    p += size;
+    return true;
+  };
+
+  while (p < end) {
+    char type = *p++;
+    if (type == 'F') {
+      FactRecord fact;
+      uint8_t has_key;
+      if (!read_raw(has_key) || !read_raw(fact.key) ||
+          !read_string(fact.output_file_name) ||
+          !read_string(fact.key_name) || !read_string(fact.json) ||
+          !read_string(fact.file) || !read_string(fact.spelling_file))
+        return false;
+      fact.has_key = has_key;
+      batch.facts.push_back(std::move(fact));
+    } else if (type == 'H') {
+      HeaderKey header;
+      if (!read_raw(header))
+        return false;
+      batch.headers.push_back(header);
+    } else if (type == 'C') {
+      std::string name;
+      uint64_t value;
+      if (!read_string(name) || !read_raw(value))
+        return false;
+      batch.counters[name] += value;
+    } else if (type == 'I') {
+      std::pair<std::string, uint64_t> input;
+      if (!read_raw(input.second) || !read_string(input.first))
+        return false;
+      batch.inputs.push_back(std::move(input));
+    } else if (type == 'T') {
+      batch.from_token_cache = true;
+    } else if (type == 'E') {
+      return read_raw(batch.header_decls_skipped) && p == end;
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
+
+std::string real_file_path(const SourceManager &srcMgr,
+                           const FileEntry *entry) {
+  // Opening a file resolves its path
+  llvm::StringRef opened = entry->tryGetRealPathName();
+  if (!opened.empty())
+    return opened.str();
+  FileManager &files = srcMgr.getFileManager();
+  llvm::SmallString<256> path(entry->getName());
+  files.makeAbsolutePath(path);
+  llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+  thread_local llvm::StringMap<std::string> resolved;
+  auto cached = resolved.try_emplace(path);
+  if (cached.second) {
+    llvm::SmallString<256> real;
+    cached.first->second =
+        files.getVirtualFileSystem().getRealPath(path, real)
+            ? path.str().str()
+            : real.str().str();
+  }
+  return cached.first->second;
+}
+
+// Text from the token at `startLoc` to the one at `endLoc`, as spelled
+static std::string source_text(const SourceManager &srcMgr,
+                               SourceLocation startLoc,
+                               SourceLocation endLoc) {
+  if (startLoc.isInvalid() || endLoc.isInvalid())
+    return "";
+  // Convert the source locations to file locations
+  startLoc = srcMgr.getSpellingLoc(startLoc);
+  endLoc = srcMgr.getSpellingLoc(endLoc);
+
+  bool invalid = false;
+  StringRef text =
+      Lexer::getSourceText(CharSourceRange::getTokenRange(startLoc, endLoc),
+                           srcMgr, LangOptions(), &invalid);
+  return invalid ? "" : text.str();
+}
+
+std::string get_decl_code(const NamedDecl *decl) {
+  return source_text(decl->getASTContext().getSourceManager(),
+                     decl->getBeginLoc(), decl->getEndLoc());
+}
+
+bool sets_ioctl_function(llvm::StringRef source) {
+  static const llvm::Regex pattern(
+      "\\.(unlocked_)?ioctl[[:space:]]*=[[:space:]]*[[:alnum:]_]+[,\n]");
+  return pattern.match(source);
+}
+
+void IoctlHandlers::add(llvm::StringRef line) {
+  auto fact = json::parse(line.begin(), line.end(), nullptr, false);
+  if (fact.is_discarded() ||
+      !sets_ioctl_function(fact.value("source", std::string())))
+    return;
+  std::string name = fact.value("name", std::string());
+  names.insert(name);
+  decls.insert(fact.value("filename", std::string()) + '\0' + name);
+}
+
+bool IoctlHandlers::resolve(llvm::StringRef line) const {
+  auto fact = json::parse(line.begin(), line.end(), nullptr, false);
+  if (fact.is_discarded())
+    return false;
+  std::string name = fact.value("alias", std::string());
+  auto target = fact.find("target");
+  if (target == fact.end())
+    return names.count(name);
+  return target->is_string() &&
+         decls.count(target->get<std::string>() + '\0' + name);
+}
+
+// The "filename" of a fact at `loc`: the path of its file, or the location
+// as printed when it is in none, and its line
+static std::string fact_filename(const SourceManager &sourceManager,
+                                 SourceLocation loc) {
   std::stringstream filenameWithLine;
   if (const FileEntry *fileEntry =
-          sourceManager.getFileEntryForID(sourceManager.getFileID(beginLoc))) {
-    filenameWithLine << fileEntry->tryGetRealPathName().str();
+          sourceManager.getFileEntryForID(sourceManager.getFileID(loc))) {
+    filenameWithLine << real_file_path(sourceManager, fileEntry);
   } else {
-    filenameWithLine << decl->getBeginLoc().printToString(
-        decl->getASTContext().getSourceManager());
+    filenameWithLine << loc.printToString(sourceManager);
   }
   // Append line number
-  unsigned lineNumber = sourceManager.getSpellingLineNumber(beginLoc);
+  unsigned lineNumber = sourceManager.getSpellingLineNumber(loc);
   filenameWithLine << ":" << lineNumber;
+  return filenameWithLine.str();
+}
 
-  std::string filename = filenameWithLine.str();
-  std::string key_name =
-      filename + "+" + name + "+" + output_file_name + "+" + alias_name;
-  if (existing_filenames.find(key_name) == existing_filenames.end()) {
-    existing_filenames.insert(key_name);
-  } else {
+void locate_fact(const SourceManager &sourceManager, SourceLocation beginLoc,
+                 SourceLocation endLoc, SourceLocation targetLoc, json &fact,
+                 std::string &file, std::string &spelling_file) {
+  fact["source"] = source_text(sourceManager, beginLoc, endLoc);
+  fact["filename"] = fact_filename(sourceManager, beginLoc);
+  if (targetLoc.isValid())
+    fact["target"] = fact_filename(sourceManager, targetLoc);
+
+  // Where the declaration is, whatever its filename says
+  auto real_path = [&](SourceLocation loc) -> std::string {
+    const FileEntry *entry =
+        sourceManager.getFileEntryForID(sourceManager.getFileID(loc));
+    return entry ? real_file_path(sourceManager, entry) : "";
+  };
+  file = real_path(sourceManager.getExpansionLoc(beginLoc));
+  spelling_file =
+      beginLoc.isMacroID() ? real_path(sourceManager.getSpellingLoc(beginLoc))
+                           : "";
+  if (spelling_file == file)
+    spelling_file.clear();
+}
+
+bool decl_emitted(const NamedDecl *decl, const std::string &output_file_name,
+                  const std::string &alias_name) {
+  DeclKey key;
+  return !complete_batches &&
+         get_decl_key(decl, output_file_name, alias_name, key) &&
+         emitted_decls.contains(key);
+}
+
+void output_decl(const NamedDecl *decl, std::string output_file_name,
+                 bool is_typedef, std::string alias_name,
+                 const NamedDecl *target) {
+  // Outside of run_sources() a fact is committed on its own
+  FactBatch single;
+  FactBatch &batch = current_batch ? *current_batch : single;
+
+  // Retrieve the SourceManager from the AST context
+  SourceManager &sourceManager = decl->getASTContext().getSourceManager();
+  std::string target_filename =
+      target ? fact_filename(sourceManager, target->getBeginLoc()) : "";
+
+  // A hash probe is enough to reject facts another TU already emitted
+  DeclKey key;
+  bool has_key = get_decl_key(decl, output_file_name,
+                              key_alias(alias_name, target_filename), key);
+  if (has_key && ((!complete_batches && emitted_decls.contains(key)) ||
+                  !batch.keys.insert(key).second))
     return;
-  }
-  j["filename"] = filename;
 
-  if (is_typedef) {
-    j["alias"] = alias_name;
-  }
+  auto name = decl->getNameAsString();
 
-  auto json_str = j.dump();
-  output_file << json_str << std::endl;
-  output_file.flush();
-  output_file.close();
-}
\ No newline at end of file
+  json j;
+  j["name"] = name;
+  std::string file, spelling_file;
+  locate_fact(sourceManager, decl->getBeginLoc(), decl->getEndLoc(),
+              SourceLocation(), j, file, spelling_file);
+
+  std::string filename = j["filename"].get<std::string>();
+  std::string key_name = filename + "+" + name + "+" + output_file_name +
+                         "+" + key_alias(alias_name, target_filename);
+
+  if (is_typedef) {
+    j["alias"] = alias_name;
+  }
+  if (target)
+    j["target"] = target_filename;
+
+  uint32_t first_token = NO_TOKEN, last_token = NO_TOKEN;
+  uint32_t target_token = NO_TOKEN;
+  if (TokenStream *tokens = current_tokens) {
+    first_token = tokens->position(decl->getBeginLoc());
+    last_token = tokens->position(decl->getEndLoc());
+    if (target)
+      target_token = tokens->position(target->getBeginLoc());
+  }
+
+  batch.facts.push_back({has_key, key, std::move(output_file_name), key_name,
+                         j.dump(), std::move(file), std::move(spelling_file),
+                         first_token, last_token, target_token});
+  if (&batch == &single)
+    commit_batch(single, "");
+}
+
+KeyDigest digest_key(llvm::StringRef key) {
+  llvm::MD5 hash;
+  hash.update(key);
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+
+  KeyDigest digest;
+  digest.low = result.low();
+  digest.high = result.high();
+  // The all-zero digest marks empty slots
+  if (digest.empty())
+    digest.low = 1;
+  return digest;
+}
+
+KeyDigest &DigestSet::find_slot(Shard &shard, const KeyDigest &digest) {
+  size_t mask = shard.slots.size() - 1;
+  size_t index = digest.low & mask;
+  while (!shard.slots[index].empty() && !(shard.slots[index] == digest))
+    index = (index + 1) & mask;
+  return shard.slots[index];
+}
+
+void DigestSet::grow(Shard &shard) {
+  std::vector<KeyDigest> old_slots(std::max<size_t>(shard.slots.size() * 2,
+                                                    1024));
+  old_slots.swap(shard.slots);
+  for (const auto &digest : old_slots) {
+    if (!digest.empty())
+      find_slot(shard, digest) = digest;
+  }
+}
+
+bool DigestSet::insert(const KeyDigest &digest, llvm::StringRef key) {
+  Shard &shard = shards[digest.high % NUM_SHARDS];
+  std::lock_guard<std::mutex> lock(shard.mtx);
+
+  // Keep the load factor below 0.7
+  if ((shard.used + 1) * 10 > shard.slots.size() * 7)
+    grow(shard);
+
+  KeyDigest &slot = find_slot(shard, digest);
+  if (slot.empty()) {
+    slot = digest;
+    shard.used++;
+    if (verify) {
+      shard.keys.emplace(digest, key.str());
+      shard.key_bytes += key.size() + sizeof(std::string) + 32;
+    }
+    return true;
+  }
+
+  if (!verify)
+    return false;
+  auto known = shard.keys.find(digest);
+  if (known == shard.keys.end() || known->second == key)
+    return false;
+
+  // Same digest, different key: remember the key itself from now on
+  if (!shard.collided_keys.insert(key.str()).second)
+    return false;
+  collision_count++;
+  shard.key_bytes += key.size() + sizeof(std::string) + 32;
+  return true;
+}
+
+size_t DigestSet::size() {
+  size_t total = 0;
+  for (auto &shard : shards) {
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    total += shard.used + shard.collided_keys.size();
+  }
+  return total;
+}
+
+size_t DigestSet::memory_usage() {
+  size_t total = 0;
+  for (auto &shard : shards) {
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    total += shard.slots.capacity() * sizeof(KeyDigest) + shard.key_bytes;
+  }
+  return total;
+}
+
+void RunReport::add(const std::string &name, uint64_t value) {
+  std::lock_guard<std::mutex> lock(mtx);
+  values[name] = values.value(name, uint64_t(0)) + value;
+  if (collecting)
+    additions[name] += value;
+}
+
+void RunReport::set(const std::string &name, nlohmann::json value) {
+  std::lock_guard<std::mutex> lock(mtx);
+  values[name] = std::move(value);
+}
+
+void RunReport::append(const std::string &name, nlohmann::json entry) {
+  std::lock_guard<std::mutex> lock(mtx);
+  values[name].push_back(std::move(entry));
+}
+
+void RunReport::write(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mtx);
+  std::cout << "Run report:" << std::endl;
+  for (const auto &item : values.items()) {
+    // Lists of per-TU records only go to the file
+    if (!item.value().is_structured())
+      std::cout << "  " << item.key() << ": " << item.value() << std::endl;
+  }
+  std::ofstream report_file(path);
+  report_file << values.dump(2) << std::endl;
+}
+
+void RunReport::collect_additions() {
+  std::lock_guard<std::mutex> lock(mtx);
+  collecting = true;
+}
+
+std::map<std::string, uint64_t> RunReport::take_additions() {
+  std::lock_guard<std::mutex> lock(mtx);
+  return std::exchange(additions, {});
+}
+
+RunReport &run_report() {
+  static RunReport report;
+  return report;
+}
+
+void enable_dedup_verification() { existing_filenames.set_verify(true); }
+
+void count_shared_file_cache() {
+  if (!shared_file_cache)
+    return;
+  RunReport &report = run_report();
+  report.add("shared_vfs_hits", shared_file_cache->hits.exchange(0));
+  report.add("shared_vfs_misses", shared_file_cache->misses.exchange(0));
+  report.add("shared_vfs_bytes_served",
+             shared_file_cache->bytes_served.exchange(0));
+}
+
+void finish_run_report(const std::string &path) {
+  RunReport &report = run_report();
+  report.set("dedup_keys", existing_filenames.size());
+  report.set("dedup_index_bytes", existing_filenames.memory_usage());
+  report.set("dedup_collisions", existing_filenames.collisions());
+  if (shared_file_cache) {
+    count_shared_file_cache();
+    report.set("shared_vfs_bytes_cached",
+               shared_file_cache->bytes_cached.load());
+  }
+  report.write(path);
+}
+
+struct ContentHashEntry {
+  uint64_t size;
+  time_t mtime;
+  uint64_t hash;
+};
+
+std::mutex content_hash_mutex;
+std::map<llvm::sys::fs::UniqueID, ContentHashEntry> content_hashes;
+
+uint64_t file_content_hash(const SourceManager &srcMgr, FileID fid) {
+  const FileEntry *fileEntry = srcMgr.getFileEntryForID(fid);
+  if (fileEntry) {
+    std::lock_guard<std::mutex> lock(content_hash_mutex);
+    auto cached = content_hashes.find(fileEntry->getUniqueID());
+    if (cached != content_hashes.end() &&
+        cached->second.size == uint64_t(fileEntry->getSize()) &&
+        cached->second.mtime == fileEntry->getModificationTime())
+      return cached->second.hash;
+  }
+
+  auto data = srcMgr.getBufferDataOrNone(fid);
+  uint64_t hash = data ? llvm::xxHash64(*data) : 0;
+  if (fileEntry) {
+    std::lock_guard<std::mutex> lock(content_hash_mutex);
+    content_hashes[fileEntry->getUniqueID()] = {
+        uint64_t(fileEntry->getSize()), fileEntry->getModificationTime(),
+        hash};
+  }
+  return hash;
+}
+
+bool header_skipping = true;
+
+HeaderMacroStates::HeaderMacroStates(Preprocessor &pp)
+    : pp(pp), srcMgr(pp.getSourceManager()),
+      pch_state(llvm::xxHash64(pp.getPreprocessorOpts().ImplicitPCHInclude)) {
+}
+
+uint64_t HeaderMacroStates::state(FileID fid) const {
+  if (srcMgr.isLoadedFileID(fid))
+    return pch_state;
+  auto found = states.find(fid);
+  return found == states.end() ? 0 : found->second;
+}
+
+void HeaderMacroStates::mix(SourceLocation loc, llvm::StringRef name,
+                            uint64_t value) {
+  FileID fid = srcMgr.getFileID(srcMgr.getExpansionLoc(loc));
+  if (fid == srcMgr.getMainFileID())
+    return;
+  uint64_t &state = states[fid];
+  llvm::SmallString<64> data;
+  data.append(reinterpret_cast<const char *>(&state),
+              reinterpret_cast<const char *>(&state + 1));
+  data.append(reinterpret_cast<const char *>(&value),
+              reinterpret_cast<const char *>(&value + 1));
+  data += name;
+  state = llvm::xxHash64(data);
+}
+
+// Where a macro was defined, or for a macro from the command line or the
+// builtins, its parameters and body
+uint64_t
+HeaderMacroStates::definition_hash(const MacroDefinition &definition) {
+  const MacroInfo *info = definition.getMacroInfo();
+  if (!info)
+    return 0;
+  auto cached = definitions.find(info);
+  if (cached != definitions.end())
+    return cached->second;
+
+  std::string identity;
+  auto location = srcMgr.getDecomposedLoc(info->getDefinitionLoc());
+  const FileEntry *file = srcMgr.getFileEntryForID(location.first);
+  if (file) {
+    auto uid = file->getUniqueID();
+    identity = std::to_string(uid.getDevice()) + ":" +
+               std::to_string(uid.getFile()) + ":" +
+               std::to_string(file_content_hash(srcMgr, location.first)) +
+               ":" + std::to_string(location.second);
+  } else {
+    for (const IdentifierInfo *param : info->params())
+      identity += param->getName().str() + ",";
+    identity += info->isVariadic() ? ")... " : ") ";
+    for (const Token &token : info->tokens())
+      identity += pp.getSpelling(token) + " ";
+  }
+  uint64_t hash = llvm::xxHash64(identity) | 1;
+  definitions[info] = hash;
+  return hash;
+}
+
+void HeaderMacroStates::MacroExpands(const Token &name,
+                                     const MacroDefinition &definition,
+                                     SourceRange range, const MacroArgs *) {
+  if (const IdentifierInfo *id = name.getIdentifierInfo())
+    mix(range.getBegin(), id->getName(), definition_hash(definition));
+}
+
+void HeaderMacroStates::If(SourceLocation loc, SourceRange,
+                           ConditionValueKind value) {
+  mix(loc, "#if", value);
+}
+
+void HeaderMacroStates::Elif(SourceLocation loc, SourceRange,
+                             ConditionValueKind value, SourceLocation) {
+  mix(loc, "#elif", value);
+}
+
+void HeaderMacroStates::Ifdef(SourceLocation loc, const Token &,
+                              const MacroDefinition &definition) {
+  mix(loc, "#ifdef", bool(definition));
+}
+
+void HeaderMacroStates::Ifndef(SourceLocation loc, const Token &,
+                               const MacroDefinition &definition) {
+  mix(loc, "#ifndef", bool(definition));
+}
+
+HeaderMacroStates *watch_header_macros(Preprocessor &pp) {
+  if (!header_skipping || complete_batches)
+    return nullptr;
+  auto states = std::make_unique<HeaderMacroStates>(pp);
+  HeaderMacroStates *watched = states.get();
+  pp.addPPCallbacks(std::move(states));
+  return watched;
+}
+
+static HeaderKey get_header_key(const SourceManager &srcMgr, FileID fid,
+                                const FileEntry *fileEntry,
+                                const HeaderMacroStates *macros) {
+  auto uid = fileEntry->getUniqueID();
+  return {uid.getDevice(), uid.getFile(), file_content_hash(srcMgr, fid),
+          macros ? macros->state(fid) : 0};
+}
+
+void set_header_skipping(bool enable) { header_skipping = enable; }
+
+bool HeaderHarvest::should_visit(const Decl *decl) {
+  if (!header_skipping || complete_batches)
+    return true;
+  SourceLocation loc = decl->getBeginLoc();
+  if (loc.isInvalid())
+    return true;
+  FileID fid = srcMgr.getFileID(srcMgr.getExpansionLoc(loc));
+  if (fid == srcMgr.getMainFileID())
+    return true;
+
+  auto known = decisions.find(fid);
+  if (known == decisions.end()) {
+    bool visit = true;
+    const FileEntry *fileEntry = srcMgr.getFileEntryForID(fid);
+    // Headers meant for repeated inclusion (trace events, x-macros) can
+    // produce different declarations each time, never skip those
+    if (fileEntry && headers.isFileMultipleIncludeGuarded(fileEntry)) {
+      HeaderKey key = get_header_key(srcMgr, fid, fileEntry, macros);
+      {
+        std::lock_guard<std::mutex> lock(harvested_mutex);
+        visit = !harvested_headers.count(key);
+      }
+      if (visit)
+        visited.push_back(fid);
+    }
+    known = decisions.insert({fid, visit}).first;
+  }
+
+  if (!known->second)
+    skipped++;
+  return known->second;
+}
+
+void HeaderHarvest::commit() {
+  FactBatch single;
+  FactBatch &batch = current_batch ? *current_batch : single;
+  for (FileID fid : visited)
+    batch.headers.push_back(get_header_key(
+        srcMgr, fid, srcMgr.getFileEntryForID(fid), macros));
+  batch.header_decls_skipped += skipped;
+  if (&batch == &single)
+    commit_batch(single, "");
+}
+
+unsigned MultiPatternMatcher::char_class(unsigned char c) {
+  if (c >= 'a' && c <= 'z')
+    return 1 + (c - 'a');
+  if (c >= 'A' && c <= 'Z')
+    return 27 + (c - 'A');
+  if (c >= '0' && c <= '9')
+    return 53 + (c - '0');
+  if (c == '_')
+    return 63;
+  return 0;
+}
+
+MultiPatternMatcher::MultiPatternMatcher(
+    const std::vector<std::string> &patterns) {
+  // Trie of the patterns, 0 meaning "no edge" (the root is never a target)
+  next.assign(NUM_CLASSES, 0);
+  accepting.assign(1, false);
+  for (const auto &pattern : patterns) {
+    if (pattern.empty())
+      continue;
+    uint32_t node = 0;
+    for (unsigned char c : pattern) {
+      unsigned cls = char_class(c);
+      if (!next[node * NUM_CLASSES + cls]) {
+        next[node * NUM_CLASSES + cls] = accepting.size();
+        next.resize(next.size() + NUM_CLASSES, 0);
+        accepting.push_back(false);
+      }
+      node = next[node * NUM_CLASSES + cls];
+    }
+    accepting[node] = true;
+  }
+
+  // Breadth-first, fill missing edges from the failure links
+  std::vector<uint32_t> fail(accepting.size(), 0);
+  std::deque<uint32_t> queue;
+  for (unsigned cls = 0; cls < NUM_CLASSES; ++cls) {
+    if (uint32_t child = next[cls])
+      queue.push_back(child);
+  }
+  while (!queue.empty()) {
+    uint32_t node = queue.front();
+    queue.pop_front();
+    if (accepting[fail[node]])
+      accepting[node] = true;
+    for (unsigned cls = 0; cls < NUM_CLASSES; ++cls) {
+      uint32_t &edge = next[node * NUM_CLASSES + cls];
+      uint32_t fallback = next[fail[node] * NUM_CLASSES + cls];
+      if (edge) {
+        fail[edge] = fallback;
+        queue.push_back(edge);
+      } else {
+        edge = fallback;
+      }
+    }
+  }
+}
+
+bool MultiPatternMatcher::search(llvm::StringRef text) const {
+  uint32_t node = 0;
+  for (unsigned char c : text) {
+    node = next[node * NUM_CLASSES + char_class(c)];
+    if (accepting[node])
+      return true;
+  }
+  return false;
+}
+
+std::string main_file_path(const CompilationDatabase &db,
+                           const std::string &source) {
+  llvm::SmallString<256> path(source);
+  auto commands = db.getCompileCommands(source);
+  if (!commands.empty())
+    llvm::sys::fs::make_absolute(commands.front().Directory, path);
+  return std::string(path);
+}
+
+WorkerPool::WorkerPool(unsigned num_workers) {
+  if (num_workers == 0)
+    num_workers = 1;
+  for (unsigned i = 0; i < num_workers; ++i)
+    queues.push_back(std::make_unique<TaskQueue>());
+  for (unsigned i = 0; i < num_workers; ++i)
+    workers.emplace_back(&WorkerPool::worker_loop, this, i);
+}
+
+WorkerPool::~WorkerPool() {
+  wait();
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  work_cv.notify_all();
+  for (auto &worker : workers)
+    worker.join();
+}
+
+void WorkerPool::submit(Task task) {
+  {
+    // The task is in its queue before it is counted, so a worker woken by
+    // the count finds it; pop_task() takes it off both under `mtx`.
+    std::lock_guard<std::mutex> lock(mtx);
+    TaskQueue &target = *queues[next_queue++ % queues.size()];
+    {
+      std::lock_guard<std::mutex> queue_lock(target.mtx);
+      target.tasks.push_back(std::move(task));
+    }
+    queued++;
+    pending++;
+  }
+  work_cv.notify_one();
+}
+
+void WorkerPool::wait() {
+  std::unique_lock<std::mutex> lock(mtx);
+  idle_cv.wait(lock, [this] { return pending == 0; });
+}
+
+bool WorkerPool::pop_task(unsigned worker, Task &task) {
+  // The count drops together with the queue, so a worker that sees it
+  // above zero always finds a task instead of spinning
+  std::lock_guard<std::mutex> lock(mtx);
+  if (queued == 0)
+    return false;
+  // Own queue first, oldest task first
+  {
+    TaskQueue &own = *queues[worker];
+    std::lock_guard<std::mutex> queue_lock(own.mtx);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.front());
+      own.tasks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+  // Then steal from the back of the other queues
+  for (unsigned i = 1; i < queues.size(); ++i) {
+    TaskQueue &victim = *queues[(worker + i) % queues.size()];
+    std::lock_guard<std::mutex> queue_lock(victim.mtx);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.back());
+      victim.tasks.pop_back();
+      queued--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkerPool::worker_loop(unsigned worker) {
+  while (true) {
+    Task task;
+    if (pop_task(worker, task)) {
+      task(worker);
+      std::lock_guard<std::mutex> lock(mtx);
+      if (--pending == 0)
+        idle_cv.notify_all();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mtx);
+    work_cv.wait(lock, [this] { return stopping || queued > 0; });
+    if (stopping && queued == 0)
+      return;
+  }
+}
+
+llvm::ErrorOr<llvm::vfs::Status>
+CountingFileSystem::status(const llvm::Twine &path) {
+  status_calls++;
+  return ProxyFileSystem::status(path);
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+CountingFileSystem::openFileForRead(const llvm::Twine &path) {
+  open_calls++;
+  return ProxyFileSystem::openFileForRead(path);
+}
+
+llvm::ErrorOr<llvm::vfs::Status>
+SharedFileCache::status(llvm::StringRef path, llvm::vfs::FileSystem &fs) {
+  Shard &shard = shard_for(path);
+  {
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto cached = shard.stats.find(path);
+    if (cached != shard.stats.end()) {
+      hits++;
+      return cached->second;
+    }
+  }
+
+  misses++;
+  auto result = fs.status(path);
+  std::lock_guard<std::mutex> lock(shard.mtx);
+  shard.stats.try_emplace(path, result);
+  return result;
+}
+
+llvm::ErrorOr<const SharedFileCache::CachedFile *>
+SharedFileCache::open(llvm::StringRef path, llvm::vfs::FileSystem &fs) {
+  Shard &shard = shard_for(path);
+  {
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto cached = shard.files.find(path);
+    if (cached != shard.files.end()) {
+      hits++;
+      bytes_served += cached->second->contents->getBufferSize();
+      return cached->second.get();
+    }
+  }
+
+  misses++;
+  auto file = fs.openFileForRead(path);
+  if (!file)
+    return file.getError();
+  auto status = (*file)->status();
+  if (!status)
+    return status.getError();
+  auto name = (*file)->getName();
+  auto contents = (*file)->getBuffer(path, status->getSize());
+  if (!contents)
+    return contents.getError();
+
+  auto entry = std::make_unique<CachedFile>();
+  entry->status = *status;
+  entry->real_name = name ? *name : path.str();
+  entry->contents = std::move(*contents);
+
+  std::lock_guard<std::mutex> lock(shard.mtx);
+  auto inserted = shard.files.try_emplace(path, std::move(entry));
+  if (inserted.second)
+    bytes_cached += inserted.first->second->contents->getBufferSize();
+  return inserted.first->second.get();
+}
+
+// A file served from the SharedFileCache
+class SharedCachedFile : public llvm::vfs::File {
+public:
+  SharedCachedFile(const SharedFileCache::CachedFile &file,
+                   const llvm::Twine &path)
+      : file(file),
+        stat(llvm::vfs::Status::copyWithNewName(file.status, path)) {}
+
+  llvm::ErrorOr<llvm::vfs::Status> status() override { return stat; }
+  llvm::ErrorOr<std::string> getName() override { return file.real_name; }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+  getBuffer(const llvm::Twine &name, int64_t, bool requiresNullTerminator,
+            bool) override {
+    return llvm::MemoryBuffer::getMemBuffer(file.contents->getBuffer(),
+                                            name.str(),
+                                            requiresNullTerminator);
+  }
+
+  std::error_code close() override { return {}; }
+
+private:
+  const SharedFileCache::CachedFile &file;
+  llvm::vfs::Status stat;
+};
+
+SharedCacheFileSystem::SharedCacheFileSystem(
+    SharedFileCache &cache, llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs)
+    : ProxyFileSystem(std::move(fs)), cache(cache) {
+  if (auto dir = getUnderlyingFS().getCurrentWorkingDirectory())
+    cwd = *dir;
+}
+
+llvm::SmallString<256>
+SharedCacheFileSystem::make_absolute(const llvm::Twine &path) const {
+  llvm::SmallString<256> absolute;
+  path.toVector(absolute);
+  if (!llvm::sys::path::is_absolute(absolute)) {
+    llvm::SmallString<256> relative(absolute);
+    absolute = cwd;
+    llvm::sys::path::append(absolute, relative);
+  }
+  // ".." has to stay, it may cross a symlink
+  llvm::sys::path::remove_dots(absolute, /*remove_dot_dot=*/false);
+  return absolute;
+}
+
+llvm::ErrorOr<llvm::vfs::Status>
+SharedCacheFileSystem::status(const llvm::Twine &path) {
+  auto result = cache.status(make_absolute(path), getUnderlyingFS());
+  if (!result)
+    return result;
+  // FileManager compares the name of the status with the one it asked for
+  return llvm::vfs::Status::copyWithNewName(*result, path);
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+SharedCacheFileSystem::openFileForRead(const llvm::Twine &path) {
+  auto absolute = make_absolute(path);
+  if (llvm::sys::path::extension(absolute) == ".c")
+    return getUnderlyingFS().openFileForRead(absolute);
+
+  auto file = cache.open(absolute, getUnderlyingFS());
+  if (!file)
+    return file.getError();
+  return std::unique_ptr<llvm::vfs::File>(new SharedCachedFile(**file, path));
+}
+
+std::error_code
+SharedCacheFileSystem::setCurrentWorkingDirectory(const llvm::Twine &path) {
+  if (auto ec = getUnderlyingFS().setCurrentWorkingDirectory(path))
+    return ec;
+  if (auto dir = getUnderlyingFS().getCurrentWorkingDirectory())
+    cwd = *dir;
+  return {};
+}
+
+void enable_shared_file_cache() {
+  shared_file_cache = std::make_unique<SharedFileCache>();
+}
+
+// A compile command, as ClangTool's default adjusters leave it, split into
+// what decides whether TUs can share a PCH of their forced includes
+struct SplitCommand {
+  std::string key;
+  std::vector<std::string> args;     // without the source, -include, -D, -U
+  std::vector<std::string> includes; // -include operands, in order
+  std::vector<std::string> macros;   // -D and -U flags, joined with operand
+};
+
+static bool is_source_argument(llvm::StringRef arg, llvm::StringRef directory,
+                               llvm::StringRef filename) {
+  llvm::SmallString<256> path(arg), source(filename);
+  llvm::sys::fs::make_absolute(directory, path);
+  llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+  llvm::sys::path::remove_dots(source, /*remove_dot_dot=*/true);
+  return path == source;
+}
+
+static SplitCommand split_command(const CommandLineArguments &command_line,
+                                  llvm::StringRef directory,
+                                  llvm::StringRef filename) {
+  SplitCommand split;
+  for (size_t i = 0; i < command_line.size(); ++i) {
+    llvm::StringRef arg = command_line[i];
+    bool has_operand = i + 1 < command_line.size();
+    if (arg == "-include" && has_operand) {
+      split.includes.push_back(command_line[++i]);
+    } else if ((arg == "-D" || arg == "-U") && has_operand) {
+      split.macros.push_back(arg.str() + command_line[++i]);
+    } else if (arg.startswith("-D") || arg.startswith("-U")) {
+      split.macros.push_back(arg.str());
+    } else if (arg.startswith("-Wp,-MD,") || arg.startswith("-Wp,-MMD,")) {
+      // Dependency files are per TU and not wanted for the PCH either
+    } else if (i > 0 && !arg.startswith("-") &&
+               is_source_argument(arg, directory, filename)) {
+      // The source itself
+    } else {
+      split.args.push_back(arg.str());
+    }
+  }
+
+  split.key = directory.str();
+  for (const auto &arg : split.args)
+    split.key += '\0' + arg;
+  split.key += '\1';
+  for (const auto &include : split.includes)
+    split.key += '\0' + include;
+  return split;
+}
+
+static llvm::StringRef macro_name(llvm::StringRef flag) {
+  return flag.drop_front(2).split('=').first;
+}
+
+// Collects every identifier the preprocessor may have taken for a macro
+// name while building a PCH: macro uses and definitions, the bodies of
+// definitions, #if conditions and the identifiers that reach the parser,
+// which would have been expanded had a -D defined them.
+class MacroNameRecorder : public PPCallbacks {
+public:
+  MacroNameRecorder(const SourceManager &srcMgr, llvm::StringSet<> &names)
+      : srcMgr(srcMgr), names(names) {}
+
+  void MacroExpands(const Token &name, const MacroDefinition &, SourceRange,
+                    const MacroArgs *) override {
+    record(name);
+  }
+
+  void MacroDefined(const Token &name,
+                    const MacroDirective *directive) override {
+    record(name);
+    for (const Token &token : directive->getMacroInfo()->tokens())
+      record(token);
+  }
+
+  void MacroUndefined(const Token &name, const MacroDefinition &,
+                      const MacroDirective *) override {
+    record(name);
+  }
+
+  void Defined(const Token &name, const MacroDefinition &,
+               SourceRange) override {
+    record(name);
+  }
+
+  void Ifdef(SourceLocation, const Token &name,
+             const MacroDefinition &) override {
+    record(name);
+  }
+
+  void Ifndef(SourceLocation, const Token &name,
+              const MacroDefinition &) override {
+    record(name);
+  }
+
+  // Undefined identifiers in a condition are 0 without any callback
+  void If(SourceLocation, SourceRange condition, ConditionValueKind) override {
+    record_line(condition.getBegin());
+  }
+
+  void Elif(SourceLocation, SourceRange condition, ConditionValueKind,
+            SourceLocation) override {
+    record_line(condition.getBegin());
+  }
+
+  void record(const Token &token) {
+    if (const IdentifierInfo *ident = token.getIdentifierInfo())
+      names.insert(ident->getName());
+  }
+
+private:
+  // Records all identifiers from `loc` to the end of the logical line
+  void record_line(SourceLocation loc) {
+    bool invalid = false;
+    const char *text = srcMgr.getCharacterData(srcMgr.getSpellingLoc(loc),
+                                               &invalid);
+    if (invalid)
+      return;
+
+    auto is_ident = [](unsigned char c) { return std::isalnum(c) || c == '_'; };
+    const char *start = nullptr;
+    for (const char *p = text;; ++p) {
+      if (start && !is_ident(*p)) {
+        names.insert(llvm::StringRef(start, p - start));
+        start = nullptr;
+      } else if (!start && is_ident(*p) && !std::isdigit((unsigned char)*p)) {
+        start = p;
+      }
+      if (*p == '\0' || (*p == '\n' && (p == text || p[-1] != '\\')))
+        break;
+    }
+  }
+
+  const SourceManager &srcMgr;
+  llvm::StringSet<> &names;
+};
+
+class ForcedIncludePchAction : public GeneratePCHAction {
+public:
+  ForcedIncludePchAction(std::string output, llvm::StringSet<> &names)
+      : output(std::move(output)), names(names) {}
+
+protected:
+  bool BeginInvocation(CompilerInstance &compiler) override {
+    compiler.getFrontendOpts().OutputFile = output;
+    return GeneratePCHAction::BeginInvocation(compiler);
+  }
+
+  bool BeginSourceFileAction(CompilerInstance &compiler) override {
+    Preprocessor &pp = compiler.getPreprocessor();
+    auto recorder = std::make_unique<MacroNameRecorder>(
+        compiler.getSourceManager(), names);
+    MacroNameRecorder *tokens = recorder.get();
+    pp.addPPCallbacks(std::move(recorder));
+    pp.setTokenWatcher([tokens](const Token &token) {
+      if (token.is(tok::identifier))
+        tokens->record(token);
+    });
+    return GeneratePCHAction::BeginSourceFileAction(compiler);
+  }
+
+private:
+  std::string output;
+  llvm::StringSet<> &names;
+};
+
+std::string pch_dir;
+// Group key -> PCH, filled before any worker starts
+std::unordered_map<std::string, std::string> forced_include_pchs;
+
+void enable_forced_include_pch(const std::string &work_dir) {
+  pch_dir = work_dir + "/pch";
+}
+
+struct PchGroup {
+  SplitCommand command;
+  std::string directory;
+  std::vector<std::string> common_macros;
+  std::set<std::string> all_macros;
+  size_t tus = 0;
+  std::string pch;
+};
+
+static CommandLineArguments default_adjusted(const CompileCommand &command) {
+  // The adjusters ClangTool installs by default, in the same order
+  auto adjust = combineAdjusters(
+      getClangStripOutputAdjuster(),
+      combineAdjusters(getClangSyntaxOnlyAdjuster(),
+                       getClangStripDependencyFileAdjuster()));
+  return adjust(command.CommandLine, command.Filename);
+}
+
+// Returns false when the PCH cannot stand in for the forced includes
+static bool build_forced_include_pch(PchGroup &group, unsigned index) {
+  std::string base = pch_dir + "/group-" + std::to_string(index);
+  std::string header = base + ".h";
+  std::string pch = base + ".pch";
+  std::ofstream(header) << "// Forced includes of " << group.tus << " TUs\n";
+
+  std::vector<std::string> args = group.command.args;
+  args.insert(args.end(), group.common_macros.begin(),
+              group.common_macros.end());
+  for (const auto &include : group.command.includes) {
+    args.push_back("-include");
+    args.push_back(include);
+  }
+  args.insert(args.end(), {"-x", "c-header", header});
+  // ClangTool points TUs at the resource directory of this binary
+  args.push_back("-resource-dir=" +
+                 CompilerInvocation::GetResourcesPath(
+                     "clang_tool", (void *)&enable_forced_include_pch));
+
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
+      llvm::vfs::createPhysicalFileSystem();
+  fs->setCurrentWorkingDirectory(group.directory);
+  llvm::IntrusiveRefCntPtr<FileManager> files(
+      new FileManager(FileSystemOptions(), fs));
+  llvm::StringSet<> names;
+  ToolInvocation invocation(
+      args, std::make_unique<ForcedIncludePchAction>(pch, names),
+      files.get());
+  if (!invocation.run()) {
+    run_report().add("pch_failed", 1);
+    return false;
+  }
+
+  // Macros only some TUs define come after the PCH instead of before the
+  // forced includes, the PCH is only equivalent when they never look at them
+  std::set<std::string> common(group.common_macros.begin(),
+                               group.common_macros.end());
+  bool depends = names.count("__BASE_FILE__");
+  for (const auto &flag : group.all_macros) {
+    if (!common.count(flag) && names.count(macro_name(flag)))
+      depends = true;
+  }
+  if (depends) {
+    run_report().add("pch_rejected", 1);
+    return false;
+  }
+
+  group.pch = pch;
+  run_report().add("pch_built", 1);
+  run_report().add("pch_tus", group.tus);
+  return true;
+}
+
+static void build_forced_include_pchs(const CompilationDatabase &db,
+                                      const std::vector<std::string> &sources,
+                                      WorkerPool &pool) {
+  std::error_code ec;
+  std::filesystem::create_directories(pch_dir, ec);
+  if (ec) {
+    std::cerr << "Cannot create " << pch_dir << ": " << ec.message()
+              << std::endl;
+    return;
+  }
+
+  std::map<std::string, PchGroup> groups;
+  for (const auto &source : sources) {
+    auto commands = db.getCompileCommands(source);
+    if (commands.empty())
+      continue;
+    const auto &command = commands.front();
+    auto split = split_command(default_adjusted(command), command.Directory,
+                               command.Filename);
+    if (split.includes.empty())
+      continue;
+
+    PchGroup &group = groups[split.key];
+    if (group.tus++ == 0) {
+      group.common_macros = split.macros;
+      group.directory = command.Directory;
+    } else {
+      std::set<std::string> macros(split.macros.begin(), split.macros.end());
+      llvm::erase_if(group.common_macros, [&](const std::string &flag) {
+        return !macros.count(flag);
+      });
+    }
+    group.all_macros.insert(split.macros.begin(), split.macros.end());
+    if (group.command.args.empty())
+      group.command = std::move(split);
+  }
+
+  unsigned index = 0;
+  for (auto &entry : groups) {
+    PchGroup &group = entry.second;
+    if (group.tus < 2)
+      continue;
+    run_report().add("pch_groups", 1);
+    pool.submit([&group, index](unsigned) {
+      build_forced_include_pch(group, index);
+    });
+    index++;
+  }
+  pool.wait();
+
+  for (const auto &entry : groups) {
+    if (!entry.second.pch.empty())
+      forced_include_pchs[entry.first] = entry.second.pch;
+  }
+}
+
+// Swaps the forced includes of a TU for the PCH of its group
+static CommandLineArguments use_forced_include_pch(
+    const CommandLineArguments &args, llvm::StringRef directory,
+    llvm::StringRef filename) {
+  auto pch = forced_include_pchs.find(
+      split_command(args, directory, filename).key);
+  if (pch == forced_include_pchs.end())
+    return args;
+
+  CommandLineArguments adjusted = {args.front(), "-include-pch", pch->second};
+  for (size_t i = 1; i < args.size(); ++i) {
+    if (args[i] == "-include" && i + 1 < args.size())
+      i++;
+    else
+      adjusted.push_back(args[i]);
+  }
+  run_report().add("tus_with_pch", 1);
+  return adjusted;
+}
+
+// Whether `arg` asks for debug info: -g, -g<level> or a -g flag naming a
+// debug info option. -gcc-toolchain= and the like are not.
+static bool is_debug_flag(llvm::StringRef arg) {
+  static const llvm::StringRef debug_options[] = {
+      "dwarf", "gdb", "z", "split-dwarf", "line-", "column-info", "no-"};
+  if (!arg.consume_front("-g"))
+    return false;
+  return arg.empty() || llvm::isDigit(arg.front()) ||
+         llvm::any_of(debug_options, [&](llvm::StringRef option) {
+           return arg.startswith(option);
+         });
+}
+
+CommandLineArguments reduce_flags(const CommandLineArguments &args,
+                                  llvm::StringRef) {
+  static const llvm::StringRef dropped[] = {"-W", "-fplugin", "--param=",
+                                            "-pg"};
+  // Taken by clang as -Xclang <flag> -Xclang <operand>
+  static const llvm::StringRef plugin_flags[] = {"-load", "-plugin",
+                                                 "-add-plugin"};
+
+  CommandLineArguments reduced = {args.front(), "-w"};
+  for (size_t i = 1; i < args.size(); ++i) {
+    llvm::StringRef arg = args[i];
+    if (arg == "--param") {
+      i++;
+    } else if (arg == "-Xclang" && i + 3 < args.size() &&
+               (llvm::is_contained(plugin_flags, args[i + 1]) ||
+                llvm::StringRef(args[i + 1]).startswith("-plugin-arg-"))) {
+      i += 3;
+    } else if (arg.startswith("-Wp,") ||
+               (!is_debug_flag(arg) &&
+                llvm::none_of(dropped, [&](llvm::StringRef prefix) {
+                  return arg.startswith(prefix);
+                }))) {
+      reduced.push_back(args[i]);
+    }
+  }
+  return reduced;
+}
+
+// Adds every file the preprocessor enters to the inputs of the TU's batch
+class InputRecorder : public PPCallbacks {
+public:
+  explicit InputRecorder(SourceManager &srcMgr) : srcMgr(srcMgr) {}
+
+  void FileChanged(SourceLocation loc, FileChangeReason reason,
+                   SrcMgr::CharacteristicKind, FileID) override {
+    if (reason != EnterFile || !current_batch)
+      return;
+    FileID fid = srcMgr.getFileID(loc);
+    const FileEntry *entry = srcMgr.getFileEntryForID(fid);
+    if (!entry || !entered.insert(entry).second)
+      return;
+    // The same name output_decl() gives the facts of this file
+    current_batch->inputs.emplace_back(real_file_path(srcMgr, entry),
+                                       file_content_hash(srcMgr, fid));
+  }
+
+private:
+  SourceManager &srcMgr;
+  llvm::SmallPtrSet<const FileEntry *, 32> entered;
+};
+
+class InputRecordingAction : public WrapperFrontendAction {
+public:
+  using WrapperFrontendAction::WrapperFrontendAction;
+
+protected:
+  bool BeginSourceFileAction(CompilerInstance &compiler) override {
+    compiler.getPreprocessor().addPPCallbacks(
+        std::make_unique<InputRecorder>(compiler.getSourceManager()));
+    return WrapperFrontendAction::BeginSourceFileAction(compiler);
+  }
+};
+
+class InputRecordingActionFactory : public FrontendActionFactory {
+public:
+  explicit InputRecordingActionFactory(FrontendActionFactory &tool_action)
+      : tool_action(tool_action) {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<InputRecordingAction>(tool_action.create());
+  }
+
+private:
+  FrontendActionFactory &tool_action;
+};
+
+WorkerToolContext::WorkerToolContext(size_t file_cache_limit)
+    : file_cache_limit(file_cache_limit),
+      fs(new CountingFileSystem(llvm::vfs::createPhysicalFileSystem())) {
+  if (shared_file_cache)
+    view = new SharedCacheFileSystem(*shared_file_cache, fs);
+  else
+    view = fs;
+}
+
+void WorkerToolContext::reset() {
+  if (files)
+    run_report().add("file_manager_resets", 1);
+  files = new FileManager(FileSystemOptions(), view);
+}
+
+int WorkerToolContext::run(const CompilationDatabase &db,
+                           const std::string &source,
+                           FrontendActionFactory *action, bool reduced_flags) {
+  auto commands = db.getCompileCommands(source);
+  if (!commands.empty() && commands.front().Directory != directory) {
+    directory = commands.front().Directory;
+    files = nullptr;
+  }
+  if (files && files->getNumUniqueRealFiles() > file_cache_limit)
+    reset();
+  bool cold = !files;
+  if (cold)
+    reset();
+
+  uint64_t calls_before = fs->status_calls + fs->open_calls;
+  uint64_t status_before = fs->status_calls;
+  uint64_t open_before = fs->open_calls;
+
+  std::vector<std::string> currentSource = {source};
+  ClangTool tool(db, currentSource, std::make_shared<PCHContainerOperations>(),
+                 view, files);
+  // A PCH built from the full flags does not match reduced ones
+  if (reduced_flags) {
+    tool.appendArgumentsAdjuster(reduce_flags);
+  } else if (!forced_include_pchs.empty()) {
+    tool.appendArgumentsAdjuster(
+        [this](const CommandLineArguments &args, llvm::StringRef filename) {
+          return use_forced_include_pch(args, directory, filename);
+        });
+  }
+  InputRecordingActionFactory recording(*action);
+  bool record_inputs = !incremental_dir.empty() || !fact_cache_dir.empty();
+  int result = tool.run(record_inputs ? &recording
+                                      : static_cast<ToolAction *>(action));
+
+  uint64_t calls = fs->status_calls + fs->open_calls - calls_before;
+  RunReport &report = run_report();
+  report.add("vfs_status_calls", fs->status_calls - status_before);
+  report.add("vfs_open_calls", fs->open_calls - open_before);
+  if (cold) {
+    cold_calls += calls;
+    cold_tus++;
+  } else {
+    // Estimated against the average TU of this worker with a fresh cache
+    uint64_t baseline = cold_calls / cold_tus;
+    report.add("fs_calls_saved_estimate",
+               baseline > calls ? baseline - calls : 0);
+  }
+  return result;
+}
+
+unsigned tu_timeout = 0;
+uint64_t tu_memory_limit = 0;
+
+void set_tu_limits(unsigned seconds, uint64_t memory_mib) {
+  tu_timeout = seconds;
+  tu_memory_limit = memory_mib << 20;
+}
+
+// Budget of the TU a worker thread is parsing
+struct TuWatchdog {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  // HandleTopLevelDecl() calls so far
+  uint64_t checks = 0;
+  // Also read by the admission control of other workers
+  std::atomic<uint64_t> peak_memory{0};
+  std::string abort_reason;
+};
+
+thread_local TuWatchdog *current_watchdog = nullptr;
+
+// The parts of a TU's memory that grow with its size: the AST, Sema's side
+// tables and the source buffers
+static uint64_t tu_memory(const ASTContext &context) {
+  const SourceManager &srcMgr = context.getSourceManager();
+  auto buffers = srcMgr.getMemoryBufferSizes();
+  return context.getASTAllocatedMemory() +
+         context.getSideTableAllocatedMemory() + buffers.malloc_bytes +
+         buffers.mmap_bytes + srcMgr.getDataStructureSizes();
+}
+
+// Sets the abort reason of a TU that has run longer than -tu-timeout
+static bool out_of_time(TuWatchdog &watchdog) {
+  if (!tu_timeout || std::chrono::steady_clock::now() - watchdog.start <=
+                         std::chrono::seconds(tu_timeout))
+    return false;
+  watchdog.abort_reason = "timeout after " + std::to_string(tu_timeout) + "s";
+  return true;
+}
+
+bool tu_over_budget(const ASTContext &context) {
+  TuWatchdog *watchdog = current_watchdog;
+  if (!watchdog)
+    return false;
+  if (!watchdog->abort_reason.empty())
+    return true;
+
+  // Sizing the allocators walks their slabs, so only every so often. The
+  // AST only grows, the last sample is close to the TU's peak.
+  if (watchdog->checks++ % 64 == 0) {
+    watchdog->peak_memory = tu_memory(context);
+    // Other threads share the process, so the estimate stands in for the
+    // resident memory a forked worker is measured by
+    if (tu_memory_limit && watchdog->peak_memory > tu_memory_limit) {
+      watchdog->abort_reason =
+          "memory over " + std::to_string(tu_memory_limit >> 20) + " MiB";
+      return true;
+    }
+  }
+  if (!out_of_time(*watchdog))
+    return false;
+  watchdog->peak_memory = tu_memory(context);
+  return true;
+}
+
+void watch_tu_tokens(Preprocessor &pp) {
+  TuWatchdog *watchdog = tu_timeout ? current_watchdog : nullptr;
+  TokenStream *stream = current_tokens;
+  if (!watchdog && !stream)
+    return;
+  uint64_t tokens = 0;
+  pp.setTokenWatcher([&pp, watchdog, stream,
+                      tokens](const Token &token) mutable {
+    if (stream)
+      stream->add(pp, token);
+    if (!watchdog)
+      return;
+    if (watchdog->abort_reason.empty()) {
+      if (++tokens % 4096 != 0 || !out_of_time(*watchdog))
+        return;
+      // The parser's complaints about the cut-off code are of no use
+      pp.getDiagnostics().setSuppressAllDiagnostics(true);
+    }
+    // Each file lexer the parse gets back to ends at once, so the parse
+    // runs to the end of the TU within a few tokens
+    if (PreprocessorLexer *lexer = pp.getCurrentLexer())
+      static_cast<Lexer *>(lexer)->cutOffLexing();
+  });
+}
+
+uint64_t milliseconds_since(std::chrono::steady_clock::time_point start) {
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed)
+      .count();
+}
+
+// Records a TU stopped by its watchdog and marks it as done, without facts
+static void drop_aborted_tu(const std::string &source,
+                            const TuWatchdog &watchdog) {
+  double seconds = milliseconds_since(watchdog.start) / 1000.0;
+  std::cerr << source << ": dropped (" << watchdog.abort_reason << ")"
+            << std::endl;
+  RunReport &report = run_report();
+  report.add("tus_aborted", 1);
+  report.append("aborted_tus", {{"source", source},
+                                {"reason", watchdog.abort_reason},
+                                {"seconds", seconds},
+                                {"memory_mib", watchdog.peak_memory >> 20}});
+  FactBatch none;
+  commit_batch(none, source);
+}
+
+void parse_tu(WorkerToolContext &context, const CompilationDatabase &db,
+              const std::string &source, FrontendActionFactory *action,
+              bool reduced_flags, FactBatch &batch) {
+  current_batch = &batch;
+  // Facts from reduced flags may differ from what the full command yields
+  bool cacheable = !fact_cache_dir.empty() && !reduced_flags;
+  RunReport &report = run_report();
+  if (cacheable && token_hashing) {
+    auto start = std::chrono::steady_clock::now();
+    int64_t parse_ms = reuse_by_token_digest(context, db, source, batch);
+    uint64_t pp_ms = milliseconds_since(start);
+    report.add("pp_hash_ms", pp_ms);
+    if (parse_ms >= 0) {
+      batch.from_token_cache = true;
+      report.add("pp_hash_hits", 1);
+      report.add("pp_hash_time_saved_ms",
+                 std::max<int64_t>(parse_ms - int64_t(pp_ms), 0));
+      current_batch = nullptr;
+      return;
+    }
+    report.add("pp_hash_misses", 1);
+    report.add("pp_hash_miss_ms", pp_ms);
+  }
+
+  TokenStream tokens;
+  if (cacheable && token_hashing)
+    current_tokens = &tokens;
+  auto start = std::chrono::steady_clock::now();
+  context.run(db, source, action, reduced_flags);
+  current_batch = nullptr;
+  current_tokens = nullptr;
+  TuWatchdog *watchdog = current_watchdog;
+  if (!cacheable || (watchdog && !watchdog->abort_reason.empty()))
+    return;
+  // Only a stream every fact was found in can locate them again
+  std::string digest;
+  if (token_hashing && tokens.complete && tokens.digest.finished())
+    digest = tokens.digest.digest();
+  store_in_fact_cache(db, source, batch, digest, milliseconds_since(start));
+}
+
+// Parse time and peak memory of every TU, measured by earlier runs and kept
+// in tu-stats.txt in the work directory: "<ms>\t<peak MiB>\t<source>"
+struct TuCost {
+  uint64_t ms = 0;
+  uint64_t peak_mib = 0;
+};
+
+bool cost_scheduling = true;
+std::mutex tu_costs_mutex;
+std::unordered_map<std::string, TuCost> tu_costs;
+
+void set_cost_scheduling(bool enable) { cost_scheduling = enable; }
+
+static std::string tu_costs_path() { return shard_dir + "/tu-stats.txt"; }
+
+static void read_tu_costs(const std::string &path,
+                          std::unordered_map<std::string, TuCost> &costs) {
+  std::ifstream stats(path);
+  std::string line;
+  while (std::getline(stats, line)) {
+    llvm::StringRef ms, peak, source;
+    std::tie(ms, source) = llvm::StringRef(line).split('\t');
+    std::tie(peak, source) = source.split('\t');
+    TuCost cost;
+    if (!source.empty() && !ms.getAsInteger(10, cost.ms) &&
+        !peak.getAsInteger(10, cost.peak_mib))
+      costs[source.str()] = cost;
+  }
+}
+
+static void load_tu_costs() {
+  std::lock_guard<std::mutex> lock(tu_costs_mutex);
+  read_tu_costs(tu_costs_path(), tu_costs);
+}
+
+void record_tu_cost(const std::string &source, uint64_t ms,
+                    uint64_t peak_bytes) {
+  std::lock_guard<std::mutex> lock(tu_costs_mutex);
+  tu_costs[source] = {ms, peak_bytes >> 20};
+}
+
+// Keeps the costs of the TUs still in the compilation database, including
+// those this run did not parse
+static void save_tu_costs(const std::vector<std::string> &sources) {
+  std::string path = tu_costs_path();
+  std::ofstream stats(path + ".tmp", std::ios_base::trunc);
+  std::lock_guard<std::mutex> lock(tu_costs_mutex);
+  for (const auto &source : sources) {
+    auto cost = tu_costs.find(source);
+    if (cost != tu_costs.end())
+      stats << cost->second.ms << '\t' << cost->second.peak_mib << '\t'
+            << source << '\n';
+  }
+  stats.close();
+  std::error_code ec;
+  std::filesystem::rename(path + ".tmp", path, ec);
+}
+
+// Size of the main file of a TU, 0 when it cannot be read
+static uint64_t main_file_size(const CompilationDatabase &db,
+                               const std::string &source) {
+  uint64_t size = 0;
+  llvm::sys::fs::file_size(main_file_path(db, source), size);
+  return size;
+}
+
+// Expected parse time of each of `sources`, into `costs`: the one
+// `measured` has, or for a TU without a measurement the size of its main
+// file at the parse rate of the measured ones, which is returned. Without
+// any measurement the costs are the sizes and the rate is 0. `estimated`
+// counts the TUs without a measurement.
+static double expected_costs(
+    const CompilationDatabase &db, const std::vector<std::string> &sources,
+    const std::unordered_map<std::string, TuCost> &measured,
+    std::vector<double> &costs, uint64_t &estimated) {
+  std::vector<uint64_t> sizes(sources.size());
+  costs.assign(sources.size(), -1);
+  uint64_t measured_ms = 0, measured_bytes = 0;
+  for (size_t i = 0; i < sources.size(); ++i) {
+    sizes[i] = main_file_size(db, sources[i]);
+    auto cost = measured.find(sources[i]);
+    if (cost == measured.end())
+      continue;
+    costs[i] = cost->second.ms;
+    measured_ms += cost->second.ms;
+    measured_bytes += sizes[i];
+  }
+  double rate = measured_bytes ? double(measured_ms) / measured_bytes : 0;
+  estimated = 0;
+  for (size_t i = 0; i < sources.size(); ++i) {
+    if (costs[i] < 0) {
+      costs[i] = rate ? rate * sizes[i] : sizes[i];
+      estimated++;
+    }
+  }
+  return rate;
+}
+
+// The part of `sources` this process parses with -shard. Every process
+// computes the same partition: the TUs are taken most expensive first (by
+// name among equal costs) and each goes to the shard with the least cost
+// so far, the lowest index among equal ones. The cost of a TU is the size
+// of its main file, unless -shard-costs gives parse times; those are not
+// measured here, as each machine would measure different ones and the
+// shards would disagree.
+static std::vector<std::string>
+select_db_shard(const CompilationDatabase &db,
+                const std::vector<std::string> &sources) {
+  if (!db_shard_count)
+    return sources;
+  std::set<std::string> names(sources.begin(), sources.end());
+  std::vector<std::string> sorted(names.begin(), names.end());
+  std::unordered_map<std::string, TuCost> measured;
+  if (!shard_costs_path.empty())
+    read_tu_costs(shard_costs_path, measured);
+  std::vector<double> costs;
+  uint64_t estimated;
+  expected_costs(db, sorted, measured, costs, estimated);
+  std::vector<size_t> ranks(sorted.size());
+  for (size_t i = 0; i < ranks.size(); ++i)
+    ranks[i] = i;
+  std::stable_sort(ranks.begin(), ranks.end(),
+                   [&](size_t a, size_t b) { return costs[a] > costs[b]; });
+
+  std::vector<double> loads(db_shard_count, 0);
+  std::unordered_set<std::string> mine;
+  for (size_t i : ranks) {
+    unsigned shard =
+        std::min_element(loads.begin(), loads.end()) - loads.begin();
+    loads[shard] += costs[i];
+    if (shard == db_shard_index)
+      mine.insert(sorted[i]);
+  }
+  std::vector<std::string> selected;
+  for (const auto &source : sources)
+    if (mine.count(source))
+      selected.push_back(source);
+
+  RunReport &report = run_report();
+  report.set("shard", std::to_string(db_shard_index) + "/" +
+                          std::to_string(db_shard_count));
+  report.set("tus_in_shard", mine.size());
+  // Parse times when -shard-costs is given, bytes otherwise
+  report.set("shard_balanced_by", shard_costs_path.empty() ? "size" : "cost");
+  report.set("shard_load", uint64_t(loads[db_shard_index]));
+  report.set("shard_load_max",
+             uint64_t(*std::max_element(loads.begin(), loads.end())));
+  if (!shard_costs_path.empty())
+    report.set("shard_tus_cost_estimated", estimated);
+  return selected;
+}
+
+// Orders the TUs still to parse longest expected parse first, so that the
+// biggest ones do not start last and leave the other workers idle at the
+// end of the run. A TU no earlier run measured is estimated from the size
+// of its main file, at the parse rate of the measured ones.
+static std::vector<std::string>
+schedule_sources(const CompilationDatabase &db,
+                 const std::vector<std::string> &sources, unsigned workers) {
+  std::vector<std::string> order;
+  for (const auto &source : sources)
+    if (!completed_tus.count(source))
+      order.push_back(source);
+  if (!cost_scheduling)
+    return order;
+
+  std::vector<double> costs;
+  uint64_t estimated;
+  double rate;
+  {
+    std::lock_guard<std::mutex> lock(tu_costs_mutex);
+    // Without any measurement the sizes still give the order
+    rate = expected_costs(db, order, tu_costs, costs, estimated);
+  }
+
+  std::vector<size_t> ranks(order.size());
+  for (size_t i = 0; i < ranks.size(); ++i)
+    ranks[i] = i;
+  std::stable_sort(ranks.begin(), ranks.end(),
+                   [&](size_t a, size_t b) { return costs[a] > costs[b]; });
+  std::vector<std::string> sorted;
+  for (size_t i : ranks)
+    sorted.push_back(std::move(order[i]));
+
+  RunReport &report = run_report();
+  report.set("tus_cost_estimated", estimated);
+  if (rate || estimated == 0) {
+    // Each TU goes to the worker that becomes free first
+    std::vector<double> finish(std::max(workers, 1u), 0);
+    for (size_t i : ranks) {
+      auto first_free = std::min_element(finish.begin(), finish.end());
+      *first_free += costs[i];
+    }
+    report.set("predicted_makespan_ms",
+               uint64_t(*std::max_element(finish.begin(), finish.end())));
+  }
+  return sorted;
+}
+
+uint64_t memory_budget = 0;
+
+void set_memory_budget(uint64_t mib) { memory_budget = mib << 20; }
+
+uint64_t resident_memory(pid_t pid) {
+  std::ifstream statm("/proc/" + std::to_string(pid) + "/statm");
+  uint64_t size = 0, resident = 0;
+  if (!(statm >> size >> resident))
+    return 0;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+MemoryAdmission::MemoryAdmission(const CompilationDatabase &db,
+                                 const std::vector<std::string> &sources,
+                                 unsigned workers) {
+  std::vector<std::pair<std::string, uint64_t>> unmeasured;
+  uint64_t measured_bytes = 0, measured_size = 0;
+  {
+    std::lock_guard<std::mutex> lock(tu_costs_mutex);
+    for (const auto &source : sources) {
+      uint64_t size = main_file_size(db, source);
+      auto cost = tu_costs.find(source);
+      if (cost == tu_costs.end()) {
+        unmeasured.emplace_back(source, size);
+        continue;
+      }
+      predictions[source] = cost->second.peak_mib << 20;
+      measured_bytes += cost->second.peak_mib << 20;
+      measured_size += size;
+    }
+  }
+  // Without any measurement, each worker gets an even share
+  double rate = measured_size ? double(measured_bytes) / measured_size : 0;
+  fallback = memory_budget / std::max(workers, 1u);
+  for (const auto &entry : unmeasured)
+    predictions[entry.first] = rate ? uint64_t(rate * entry.second) : fallback;
+}
+
+uint64_t MemoryAdmission::expected(const std::string &source) const {
+  auto prediction = predictions.find(source);
+  uint64_t base = fallback;
+  if (prediction != predictions.end()) {
+    base = prediction->second;
+  } else {
+    // A TU the database had not yet read when the run started
+    std::lock_guard<std::mutex> lock(tu_costs_mutex);
+    auto cost = tu_costs.find(source);
+    if (cost != tu_costs.end())
+      base = cost->second.peak_mib << 20;
+  }
+  double scale = predicted_total > 0 ? observed_total / predicted_total : 1;
+  return uint64_t(base * std::min(std::max(scale, 0.25), 4.0));
+}
+
+bool MemoryAdmission::fits(uint64_t predicted, uint64_t live,
+                           uint64_t outstanding, size_t running) {
+  peak_live = std::max(peak_live, live);
+  if (running && live + outstanding + predicted > memory_budget)
+    return false;
+  most_running = std::max(most_running, running + 1);
+  return true;
+}
+
+void MemoryAdmission::record_stall(uint64_t ms, size_t running) {
+  stalls++;
+  stall_ms += ms;
+  fewest_running = std::min(fewest_running, running);
+}
+
+void MemoryAdmission::record_finish(const std::string &source,
+                                    uint64_t peak) {
+  auto prediction = predictions.find(source);
+  if (prediction == predictions.end() || !prediction->second)
+    return;
+  predicted_total += prediction->second;
+  observed_total += peak;
+}
+
+uint64_t MemoryAdmission::predict(const std::string &source) {
+  std::lock_guard<std::mutex> lock(mtx);
+  return expected(source);
+}
+
+bool MemoryAdmission::admit(uint64_t predicted, uint64_t live,
+                            uint64_t outstanding, size_t running) {
+  std::lock_guard<std::mutex> lock(mtx);
+  return fits(predicted, live, outstanding, running);
+}
+
+void MemoryAdmission::stalled(uint64_t ms, size_t running) {
+  std::lock_guard<std::mutex> lock(mtx);
+  record_stall(ms, running);
+}
+
+void MemoryAdmission::finished(const std::string &source, uint64_t peak) {
+  std::lock_guard<std::mutex> lock(mtx);
+  record_finish(source, peak);
+}
+
+void MemoryAdmission::enter(const std::string &source,
+                            TuWatchdog &watchdog) {
+  std::unique_lock<std::mutex> lock(mtx);
+  uint64_t predicted = expected(source);
+  auto start = std::chrono::steady_clock::now();
+  size_t stalled_running = SIZE_MAX;
+  bool trimmed = false;
+  while (true) {
+    uint64_t outstanding = 0;
+    for (const auto &entry : running_tus) {
+      uint64_t grown = entry.first->peak_memory;
+      outstanding += entry.second > grown ? entry.second - grown : 0;
+    }
+    if (fits(predicted, resident_memory(getpid()), outstanding,
+             running_tus.size()))
+      break;
+    // The TUs that finished may have left their memory to malloc
+    if (!trimmed) {
+      malloc_trim(0);
+      trimmed = true;
+      continue;
+    }
+    stalled_running = std::min(stalled_running, running_tus.size());
+    // The running TUs grow and finish, look again every now and then
+    memory_cv.wait_for(lock, std::chrono::milliseconds(50));
+  }
+  if (stalled_running != SIZE_MAX)
+    record_stall(milliseconds_since(start), stalled_running);
+  running_tus[&watchdog] = predicted;
+}
+
+void MemoryAdmission::leave(const std::string &source,
+                            const TuWatchdog &watchdog, bool parsed) {
+  std::lock_guard<std::mutex> lock(mtx);
+  running_tus.erase(&watchdog);
+  if (parsed)
+    record_finish(source, watchdog.peak_memory);
+  memory_cv.notify_all();
+}
+
+void MemoryAdmission::report() {
+  std::lock_guard<std::mutex> lock(mtx);
+  RunReport &report = run_report();
+  report.set("memory_budget_mib", memory_budget >> 20);
+  report.set("admission_stalls", stalls);
+  report.set("admission_stall_ms", stall_ms);
+  report.set("admission_peak_live_mib", peak_live >> 20);
+  report.set("admission_max_running", most_running);
+  if (stalls)
+    report.set("admission_min_running", fewest_running);
+  if (predicted_total > 0)
+    report.set("memory_prediction_scale", observed_total / predicted_total);
+}
+
+// Peak resident memory of the process and, with -fork-server, of its
+// largest child
+static void report_peak_memory() {
+  struct rusage usage;
+  RunReport &report = run_report();
+  // ru_maxrss is in KiB
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    report.set("peak_rss_mib", uint64_t(usage.ru_maxrss) >> 10);
+  if (fork_server && getrusage(RUSAGE_CHILDREN, &usage) == 0)
+    report.set("peak_child_rss_mib", uint64_t(usage.ru_maxrss) >> 10);
+}
+
+// What a worker thread does with a TU: takes its facts from the fact cache
+// or parses it, once the memory budget admits it, and commits them
+static void process_source(WorkerToolContext &context,
+                           const CompilationDatabase &db,
+                           const std::string &source,
+                           FrontendActionFactory *action,
+                           MemoryAdmission *admission) {
+  std::cout << source << std::endl;
+  if (!fact_cache_dir.empty() && serve_from_fact_cache(db, source))
+    return;
+  FactBatch batch;
+  TuWatchdog watchdog;
+  if (admission) {
+    admission->enter(source, watchdog);
+    // The wait does not count against -tu-timeout
+    watchdog.start = std::chrono::steady_clock::now();
+  }
+  current_watchdog = &watchdog;
+  parse_tu(context, db, source, action, false, batch);
+  current_watchdog = nullptr;
+  // Only preprocessed, a TU served by -pp-hash keeps the cost of its last
+  // parse
+  bool parsed = !batch.from_token_cache;
+  if (admission)
+    admission->leave(source, watchdog, parsed);
+  if (parsed)
+    record_tu_cost(source, milliseconds_since(watchdog.start),
+                   watchdog.peak_memory);
+  // A TU stopped halfway leaves none of its facts behind
+  if (watchdog.abort_reason.empty())
+    commit_batch(batch, source);
+  else
+    drop_aborted_tu(source, watchdog);
+}
+
+// Work done on the pool before the first TU is parsed
+static void prepare_sources(const CompilationDatabase &db,
+                            const std::vector<std::string> &sources,
+                            WorkerPool &pool) {
+  if (!changed_files_list.empty())
+    select_changed_tus(db, sources);
+  if (!incremental_dir.empty())
+    prepare_incremental_run(db, sources, pool);
+  if (!pch_dir.empty())
+    build_forced_include_pchs(db, sources, pool);
+}
+
+void run_sources(const CompilationDatabase &db,
+                 const std::vector<std::string> &all_sources,
+                 FrontendActionFactory *action, unsigned jobs,
+                 size_t file_cache_limit,
+                 const std::function<bool(const CompilationDatabase &,
+                                          const std::string &)> &skip) {
+  auto sources = select_db_shard(db, all_sources);
+  load_tu_costs();
+  if (fork_server) {
+    // Only this thread may exist when forking
+    if (!incremental_dir.empty() || !changed_files_list.empty() ||
+        !pch_dir.empty()) {
+      WorkerPool pool(jobs);
+      prepare_sources(db, sources, pool);
+    }
+    auto order = schedule_sources(db, sources, jobs);
+    std::unique_ptr<MemoryAdmission> admission;
+    if (memory_budget)
+      admission = std::make_unique<MemoryAdmission>(db, order, jobs);
+    auto start = std::chrono::steady_clock::now();
+    run_sources_forked(db, order, action, jobs, file_cache_limit, skip,
+                       admission.get());
+    run_report().set("makespan_ms", milliseconds_since(start));
+    save_tu_costs(all_sources);
+    if (admission)
+      admission->report();
+    report_peak_memory();
+    report_fact_cache();
+    return;
+  }
+
+  WorkerPool pool(jobs);
+  prepare_sources(db, sources, pool);
+
+  std::vector<std::unique_ptr<WorkerToolContext>> contexts;
+  for (unsigned i = 0; i < pool.size(); ++i)
+    contexts.push_back(std::make_unique<WorkerToolContext>(file_cache_limit));
+
+  auto order = schedule_sources(db, sources, pool.size());
+  std::unique_ptr<MemoryAdmission> admission;
+  if (memory_budget)
+    admission = std::make_unique<MemoryAdmission>(db, order, pool.size());
+  auto start = std::chrono::steady_clock::now();
+  for (const auto &sourcePath : order) {
+    pool.submit([&](unsigned worker) {
+      if (!skip || !skip(db, sourcePath))
+        process_source(*contexts[worker], db, sourcePath, action,
+                       admission.get());
+    });
+  }
+  pool.wait();
+  run_report().set("makespan_ms", milliseconds_since(start));
+  save_tu_costs(all_sources);
+  if (admission)
+    admission->report();
+  report_peak_memory();
+  report_fact_cache();
+}
+
+void run_sources(StreamingCompilationDatabase &db,
+                 FrontendActionFactory *action, unsigned jobs,
+                 size_t file_cache_limit,
+                 const std::function<bool(const CompilationDatabase &,
+                                          const std::string &)> &skip) {
+  load_tu_costs();
+  WorkerPool pool(jobs);
+  std::vector<std::unique_ptr<WorkerToolContext>> contexts;
+  for (unsigned i = 0; i < pool.size(); ++i)
+    contexts.push_back(std::make_unique<WorkerToolContext>(file_cache_limit));
+  // Predicted from tu-stats.txt alone, the sizes of TUs not read yet are
+  // unknown
+  std::unique_ptr<MemoryAdmission> admission;
+  if (memory_budget)
+    admission = std::make_unique<MemoryAdmission>(
+        db, std::vector<std::string>(), pool.size());
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::string> sources;
+  std::string source;
+  while (db.next_source(source)) {
+    sources.push_back(source);
+    if (completed_tus.count(source))
+      continue;
+    pool.submit([&, source](unsigned worker) {
+      if (!skip || !skip(db, source))
+        process_source(*contexts[worker], db, source, action,
+                       admission.get());
+    });
+  }
+  pool.wait();
+  run_report().set("makespan_ms", milliseconds_since(start));
+  save_tu_costs(sources);
+  if (admission)
+    admission->report();
+  report_peak_memory();
+  report_fact_cache();
+}
+
+// Reads the CPU quota of the cgroup we run in, 0 when there is none.
+static unsigned cgroup_cpu_limit() {
+  long quota = -1, period = 0;
+
+  // cgroup v2: "<quota|max> <period>"
+  std::ifstream cpu_max("/sys/fs/cgroup/cpu.max");
+  std::string quota_str;
+  if (cpu_max >> quota_str >> period) {
+    if (quota_str != "max")
+      quota = std::atol(quota_str.c_str());
+  } else {
+    // cgroup v1
+    std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    if (!(quota_file >> quota) || !(period_file >> period))
+      quota = -1;
+  }
+
+  if (quota <= 0 || period <= 0)
+    return 0;
+  return std::max<long>(1, (quota + period - 1) / period);
+}
+
+unsigned default_worker_count() {
+  unsigned count = std::thread::hardware_concurrency();
+
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+    count = CPU_COUNT(&cpus);
+
+  if (unsigned limit = cgroup_cpu_limit())
+    count = std::min(count, limit);
+  return std::max(count, 1u);
+}
+
+RunOptions::RunOptions(const char *default_work_dir,
+                       const char *default_report)
+    : category("my-tool options"),
+      compile_commands("p",
+                       llvm::cl::desc("Specify path compile_commands.json"),
+                       llvm::cl::Required, llvm::cl::cat(category)),
+      num_jobs("j",
+               llvm::cl::desc("Number of worker threads (default: CPUs "
+                              "available to this process)"),
+               llvm::cl::init(0), llvm::cl::cat(category)),
+      file_cache_limit(
+          "file-cache-limit",
+          llvm::cl::desc("Files a worker's FileManager may cache before it "
+                         "is reset (bounds its memory, which grows with "
+                         "the files it caches)"),
+          llvm::cl::init(200000), llvm::cl::cat(category)),
+      work_dir("work-dir",
+               llvm::cl::desc("Directory for per-worker output shards"),
+               llvm::cl::init(default_work_dir), llvm::cl::cat(category)),
+      report("report", llvm::cl::desc("Where to write the JSON run report"),
+             llvm::cl::init(default_report), llvm::cl::cat(category)),
+      verify_dedup(
+          "verify-dedup-keys",
+          llvm::cl::desc("Keep full dedup keys to detect digest collisions"),
+          llvm::cl::cat(category)),
+      skip_headers(
+          "skip-harvested-headers",
+          llvm::cl::desc("Do not revisit declarations of include-guarded "
+                         "headers another TU already visited"),
+          llvm::cl::init(true), llvm::cl::cat(category)),
+      shared_vfs("shared-vfs",
+                 llvm::cl::desc("Read headers from disk once and share them "
+                                "between workers"),
+                 llvm::cl::cat(category)),
+      pch("pch",
+          llvm::cl::desc("Parse the forced includes (-include) once per "
+                         "group of TUs with the same flags, into a "
+                         "precompiled header"),
+          llvm::cl::cat(category)),
+      fork_server("fork-server",
+                  llvm::cl::desc("Parse each TU in a child process forked "
+                                 "from a warm template process; only then "
+                                 "does a TU that crashes not end the run"),
+                  llvm::cl::cat(category)),
+      tu_timeout("tu-timeout",
+                 llvm::cl::desc("Seconds a TU may take before it is "
+                                "dropped, 0 for no limit"),
+                 llvm::cl::init(0), llvm::cl::cat(category)),
+      tu_rss_limit("tu-rss-limit",
+                   llvm::cl::desc("MiB of memory a TU may use before it is "
+                                  "stopped, 0 for no limit: the resident "
+                                  "memory of a forked TU, the AST and "
+                                  "source buffers of one on a thread"),
+                   llvm::cl::init(0), llvm::cl::cat(category)),
+      memory_budget(
+          "memory-budget",
+          llvm::cl::desc("MiB of resident memory the TUs parsed at once may "
+                         "take together; TUs wait to start while they "
+                         "would not fit. 0 for no limit"),
+          llvm::cl::init(0), llvm::cl::cat(category)),
+      schedule_by_cost(
+          "schedule-by-cost",
+          llvm::cl::desc("Start the TUs that took longest in earlier runs "
+                         "first"),
+          llvm::cl::init(true), llvm::cl::cat(category)),
+      retry_quarantined(
+          "retry-quarantined",
+          llvm::cl::desc("Parse TUs quarantined by an earlier -fork-server "
+                         "run"),
+          llvm::cl::cat(category)),
+      resume("resume",
+             llvm::cl::desc("Continue the interrupted run journaled in "
+                            "-work-dir"),
+             llvm::cl::cat(category)),
+      checkpoint_interval(
+          "checkpoint-interval",
+          llvm::cl::desc("Seconds between two journal checkpoints, 0 to "
+                         "checkpoint after every TU"),
+          llvm::cl::init(5), llvm::cl::cat(category)),
+      incremental(
+          "incremental",
+          llvm::cl::desc("Parse only the TUs whose inputs changed since the "
+                         "last -incremental run and update the outputs in "
+                         "place"),
+          llvm::cl::cat(category)),
+      fact_cache("fact-cache",
+                 llvm::cl::desc("Directory of a fact cache shared with other "
+                                "runs and checkouts"),
+                 llvm::cl::cat(category)),
+      pp_hash("pp-hash",
+              llvm::cl::desc("Preprocess TUs the fact cache misses and reuse "
+                             "the facts of an earlier parse of the same "
+                             "token stream"),
+              llvm::cl::cat(category)),
+      shard("shard",
+            llvm::cl::desc("Parse only part i of N (0-based) of the "
+                           "compilation database, given as i/N, and write "
+                           "sorted segments for fact-merge to the work "
+                           "directory instead of the .jsonl files"),
+            llvm::cl::cat(category)),
+      shard_costs("shard-costs",
+                  llvm::cl::desc("Split the TUs for -shard by the parse "
+                                 "times in this tu-stats.txt of an earlier "
+                                 "run instead of by size; every shard must "
+                                 "be given the same file"),
+                  llvm::cl::cat(category)),
+      stream_db("stream-db",
+                llvm::cl::desc("Read the compilation database (- for stdin) "
+                               "while the first TUs are already parsed"),
+                llvm::cl::cat(category)),
+      changed_files(
+          "changed-files",
+          llvm::cl::desc("Parse only the TUs that include a file listed in "
+                         "this file (- for stdin), per the include graph of "
+                         "the last -incremental run"),
+          llvm::cl::cat(category)) {}
+
+unsigned RunOptions::jobs() const {
+  return num_jobs ? num_jobs.getValue() : default_worker_count();
+}
+
+// Parses -shard's "i/N"
+static bool parse_shard(llvm::StringRef shard, unsigned &index,
+                        unsigned &count) {
+  llvm::StringRef first, second;
+  std::tie(first, second) = shard.split('/');
+  return !first.getAsInteger(10, index) && !second.getAsInteger(10, count) &&
+         index < count;
+}
+
+bool validate_run_options(const RunOptions &options) {
+  unsigned index, count;
+  if (!options.shard.empty() && !parse_shard(options.shard, index, count)) {
+    llvm::errs() << "-shard must be i/N with i < N\n";
+    return false;
+  }
+  // An incremental run updates the .jsonl files a shard does not write
+  if (!options.shard.empty() && options.incremental) {
+    llvm::errs() << "-shard cannot be combined with -incremental\n";
+    return false;
+  }
+  if (!options.shard_costs.empty() && options.shard.empty()) {
+    llvm::errs() << "-shard-costs needs -shard\n";
+    return false;
+  }
+  // Shards falling back to sizes on their own would split differently
+  if (!options.shard_costs.empty() &&
+      !std::filesystem::exists(options.shard_costs)) {
+    llvm::errs() << "-shard-costs: no such file " << options.shard_costs
+                 << "\n";
+    return false;
+  }
+  // All of these look at every source before the first TU is parsed
+  if (options.stream_db &&
+      (options.fork_server || options.incremental || options.pch ||
+       !options.shard.empty() || !options.changed_files.empty())) {
+    llvm::errs() << "-stream-db cannot be combined with -fork-server, "
+                    "-incremental, -pch, -shard or -changed-files\n";
+    return false;
+  }
+  // A packed database is mapped, there is nothing to stream
+  if (options.stream_db &&
+      PackedCompilationDatabase::is_packed(options.compile_commands)) {
+    llvm::errs() << "-stream-db reads compile_commands.json, not a packed "
+                    "database\n";
+    return false;
+  }
+  if (options.resume && options.incremental) {
+    llvm::errs() << "-resume cannot be combined with -incremental\n";
+    return false;
+  }
+  if (options.incremental && !options.changed_files.empty()) {
+    llvm::errs() << "-changed-files cannot be combined with -incremental\n";
+    return false;
+  }
+  if (!options.changed_files.empty() && options.changed_files != "-" &&
+      !std::filesystem::exists(options.changed_files)) {
+    llvm::errs() << "-changed-files: no such file "
+                 << options.changed_files << "\n";
+    return false;
+  }
+  // Without the graph, the TUs including a changed header would silently
+  // be left out
+  if (!options.changed_files.empty() &&
+      !std::filesystem::exists(options.work_dir + "/deps.txt")) {
+    llvm::errs() << "-changed-files needs the include graph of an "
+                    "-incremental run, but there is no "
+                 << options.work_dir << "/deps.txt\n";
+    return false;
+  }
+  // The headers a TU reads from a PCH are not entered by its preprocessor,
+  // so its inputs could not be recorded
+  const char *records_inputs = options.incremental ? "-incremental"
+                               : !options.fact_cache.empty() ? "-fact-cache"
+                               : options.pp_hash             ? "-pp-hash"
+                                                             : nullptr;
+  if (options.pch && records_inputs) {
+    llvm::errs() << "-pch cannot be combined with " << records_inputs << "\n";
+    return false;
+  }
+  return true;
+}
+
+void apply_run_options(const RunOptions &options, llvm::StringRef config) {
+  if (options.verify_dedup)
+    enable_dedup_verification();
+  set_header_skipping(options.skip_headers);
+  if (options.shared_vfs)
+    enable_shared_file_cache();
+  if (options.pch)
+    enable_forced_include_pch(options.work_dir);
+  if (options.fork_server)
+    enable_fork_server(options.retry_quarantined);
+  set_tu_limits(options.tu_timeout, options.tu_rss_limit);
+  set_memory_budget(options.memory_budget);
+  set_cost_scheduling(options.schedule_by_cost);
+  set_checkpoint_interval(options.checkpoint_interval);
+  if (options.incremental)
+    enable_incremental(options.work_dir, config);
+  if (!options.fact_cache.empty())
+    enable_fact_cache(options.fact_cache, config);
+  else if (options.pp_hash)
+    enable_fact_cache(options.work_dir + "/fact-cache", config);
+  if (options.pp_hash)
+    enable_token_hashing();
+  if (!options.changed_files.empty())
+    enable_changed_files(options.changed_files, options.work_dir);
+  unsigned index, count;
+  if (parse_shard(options.shard, index, count))
+    enable_db_sharding(index, count, options.shard_costs);
+
+  open_output_shards(options.work_dir, options.resume);
+}
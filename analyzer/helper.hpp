@@ -6,55 +6,829 @@
 #include "clang/AST/TemplateName.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/Rewrite/Core/Rewriter.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/xxhash.h"
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/ASTContext.h>
 #include <clang/AST/Expr.h>
 #include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendActions.h>
+#include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/Preprocessor.h>
 #include <clang/Tooling/CommonOptionsParser.h>
 #include <clang/Tooling/JSONCompilationDatabase.h>
 #include <clang/Tooling/Tooling.h>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
-#include <future>
+#include <functional>
 #include <iostream>
+#include <malloc.h>
 #include <map>
 #include <mutex>
+#include <queue>
+#include <sched.h>
 #include <set>
+#include <shared_mutex>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <tuple>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-class Semaphore {
+// Fixed-size pool of long-lived workers. Every worker owns a task deque and
+// steals from the others once its own runs dry, so a worker stuck on a huge
+// translation unit never holds back the sources queued behind it.
+class WorkerPool {
 public:
-  Semaphore(int count) : count(count) {}
+  using Task = std::function<void(unsigned worker)>;
 
-  inline void notify() {
-    std::unique_lock<std::mutex> lock(mtx);
-    count++;
-    cv.notify_one();
+  explicit WorkerPool(unsigned num_workers);
+  ~WorkerPool();
+
+  void submit(Task task);
+  // Blocks until every submitted task has finished.
+  void wait();
+  unsigned size() const { return workers.size(); }
+
+private:
+  struct TaskQueue {
+    std::mutex mtx;
+    std::deque<Task> tasks;
+  };
+
+  bool pop_task(unsigned worker, Task &task);
+  void worker_loop(unsigned worker);
+
+  std::vector<std::unique_ptr<TaskQueue>> queues;
+  std::vector<std::thread> workers;
+  std::mutex mtx;
+  std::condition_variable work_cv;
+  std::condition_variable idle_cv;
+  size_t queued = 0;
+  size_t pending = 0;
+  unsigned next_queue = 0;
+  bool stopping = false;
+};
+
+// Forwards to another file system, counting the stat and open calls that
+// reach it.
+class CountingFileSystem : public llvm::vfs::ProxyFileSystem {
+public:
+  explicit CountingFileSystem(
+      llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs)
+      : ProxyFileSystem(std::move(fs)) {}
+
+  llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override;
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+  openFileForRead(const llvm::Twine &path) override;
+
+  uint64_t status_calls = 0;
+  uint64_t open_calls = 0;
+};
+
+// Stat results and file contents, read from disk once per run and then
+// served to every worker (in the spirit of clang-scan-deps' dependency
+// scanning file system). Keys are absolute paths; negative stat results are
+// cached too, since include path searches mostly miss. Entries are never
+// evicted, the tree is assumed not to change during a run.
+class SharedFileCache {
+public:
+  struct CachedFile {
+    llvm::vfs::Status status;
+    std::string real_name;
+    std::unique_ptr<llvm::MemoryBuffer> contents;
+  };
+
+  llvm::ErrorOr<llvm::vfs::Status> status(llvm::StringRef path,
+                                          llvm::vfs::FileSystem &fs);
+  // The returned entry stays valid for the lifetime of the cache
+  llvm::ErrorOr<const CachedFile *> open(llvm::StringRef path,
+                                         llvm::vfs::FileSystem &fs);
+
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> bytes_served{0};
+  std::atomic<uint64_t> bytes_cached{0};
+
+private:
+  static constexpr unsigned NUM_SHARDS = 64;
+
+  struct Shard {
+    std::mutex mtx;
+    llvm::StringMap<llvm::ErrorOr<llvm::vfs::Status>> stats;
+    llvm::StringMap<std::unique_ptr<CachedFile>> files;
+  };
+
+  Shard &shard_for(llvm::StringRef path) {
+    return shards[llvm::xxHash64(path) % NUM_SHARDS];
   }
 
-  inline void wait() {
-    std::unique_lock<std::mutex> lock(mtx);
-    while (count == 0) {
-      cv.wait(lock);
-    }
-    count--;
+  Shard shards[NUM_SHARDS];
+};
+
+// A worker's view of the SharedFileCache. It keeps its own working
+// directory to resolve relative paths and reads through `fs` on a miss.
+// Main source files (.c) are read only once per run and bypass the cache.
+class SharedCacheFileSystem : public llvm::vfs::ProxyFileSystem {
+public:
+  SharedCacheFileSystem(SharedFileCache &cache,
+                        llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs);
+
+  llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override;
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+  openFileForRead(const llvm::Twine &path) override;
+  std::error_code setCurrentWorkingDirectory(const llvm::Twine &path) override;
+
+private:
+  llvm::SmallString<256> make_absolute(const llvm::Twine &path) const;
+
+  SharedFileCache &cache;
+  std::string cwd;
+};
+
+// Layers a SharedCacheFileSystem shared by all workers over their file
+// systems; must be called before run_sources()
+void enable_shared_file_cache();
+
+// Before the run, builds one precompiled header of the forced includes
+// (-include ...) for every group of at least two TUs that agree on all
+// flags but the source, the output and their -D/-U macros, and makes those
+// TUs load it with -include-pch. A group whose forced includes look at any
+// macro that is not defined the same way in all of its TUs keeps parsing
+// them. PCHs are written to `<work_dir>/pch`; must be called before
+// run_sources()
+void enable_forced_include_pch(const std::string &work_dir);
+
+// What is left of a command for the retry of a TU that took clang down:
+// the command without debug info, warning and plugin flags (-Wp, passes
+// preprocessor flags and stays), with warnings off. It is a deny-list:
+// everything else stays, -O too, since it defines __OPTIMIZE__, and so do
+// flags such as -funsigned-char or -march= that change types and layouts,
+// for the facts to match the real build.
+clang::tooling::CommandLineArguments
+reduce_flags(const clang::tooling::CommandLineArguments &args,
+             llvm::StringRef filename);
+
+// Makes the output files a store that later runs update in place. Every
+// run records in `<work_dir>/deps.txt` the files each TU entered, with
+// their content hashes, and the hash of its compile command. The next run
+// parses only the TUs for which one of those changed, after retracting the
+// facts located in changed files and in the main files of those TUs from
+// the outputs. `config` describes whatever else decides the facts (tool,
+// options, handler names); when it changes, all facts are retracted. The
+// headers a TU reads from a PCH are not entered, so it cannot be combined
+// with enable_forced_include_pch(); must be called before run_sources()
+void enable_incremental(const std::string &work_dir, llvm::StringRef config);
+
+// Hash of what decides the facts of a TU besides its inputs and command:
+// the version of the extractor and `config`, as for enable_incremental()
+uint64_t fact_config_hash(llvm::StringRef config);
+// The dedup key output_decl() builds for `fact`, of kind `output_file_name`
+std::string fact_key_name(const nlohmann::json &fact,
+                          llvm::StringRef output_file_name);
+// Set when every TU must produce all of its facts, even those another TU
+// already emitted, see enable_fact_cache()
+extern bool complete_batches;
+
+// Parses only the TUs affected by the files listed one per line in
+// `list_path` ("-" for stdin), such as the output of `git diff
+// --name-only`: those that entered a listed file according to the include
+// graph the last -incremental run left in `<work_dir>/deps.txt`, those
+// whose compile command changed since, and new TUs whose main file is
+// listed. Relative paths match any input path ending in them. Must be
+// called before run_sources()
+void enable_changed_files(const std::string &list_path,
+                          const std::string &work_dir);
+
+// Makes run_sources() parse only part `index` of `count` of the sources,
+// and merge_output_shards() write the facts of each output as a segment,
+// `<work_dir>/<output><segment_suffix()>`, for fact-merge. Once all
+// segments are written, `<work_dir>/segments<segment_suffix()>` lists them
+// with their fact counts. The TUs are split by the size of their main
+// file, or by the parse times `costs_path` (a tu-stats.txt of an earlier
+// run) records when it is given, so every process sharing the tree and
+// that file agrees on the parts without talking to the others. Must be
+// called before run_sources()
+void enable_db_sharding(unsigned index, unsigned count,
+                        const std::string &costs_path);
+std::string segment_suffix(unsigned index, unsigned count);
+
+// Merges fact segments, files of "<hex key digest>\t<json>" lines sorted by
+// key, into `out` without reading them into memory. Of the facts sharing a
+// key, the one whose json sorts first is kept and the others are counted
+// in `duplicates`, so the result does not depend on how the facts were
+// split. `keep` may drop facts. Writes segment lines with `keep_digests`,
+// the json alone without. Returns the number of facts written.
+uint64_t merge_fact_segments(
+    const std::vector<std::string> &inputs, std::ostream &out,
+    bool keep_digests, uint64_t &duplicates,
+    const std::function<bool(llvm::StringRef)> &keep = nullptr);
+
+// Per-worker state that outlives a single TU: a file system view with its
+// own working directory (ClangTool changes it for every compile command,
+// the process-wide real file system would chdir() under the other workers)
+// and a FileManager whose stat cache is shared by all TUs of the worker.
+// The FileManager is dropped when the compile directory changes, since its
+// cache holds relative paths, and when it caches more than
+// `file_cache_limit` files. That count bounds its memory: it keeps an entry
+// per file and directory looked up, while the file contents belong to each
+// TU's SourceManager.
+class WorkerToolContext {
+public:
+  explicit WorkerToolContext(size_t file_cache_limit);
+
+  // Runs `action` on one source, like ClangTool(db, {source}).run(action).
+  // `reduced_flags` applies reduce_flags().
+  int run(const clang::tooling::CompilationDatabase &db,
+          const std::string &source,
+          clang::tooling::FrontendActionFactory *action,
+          bool reduced_flags = false);
+
+private:
+  void reset();
+
+  size_t file_cache_limit;
+  llvm::IntrusiveRefCntPtr<CountingFileSystem> fs;
+  // What the FileManager reads through: `fs`, or the shared cache over it
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> view;
+  llvm::IntrusiveRefCntPtr<clang::FileManager> files;
+  std::string directory;
+  // stat/open calls made by the first TU of each FileManager, i.e. what a
+  // TU costs without the cache
+  uint64_t cold_calls = 0;
+  uint64_t cold_tus = 0;
+};
+
+// Budget of one TU in wall-clock seconds and MiB of memory, 0 for no limit.
+// A forked worker that exceeds it is killed; its memory is its resident
+// memory. A worker thread drops all of the TU's facts when it exceeds it.
+// It is stopped within a few thousand tokens of running out of time, and
+// within 64 top-level declarations of its estimated memory (the AST, Sema's
+// side tables and the source buffers, see tu_over_budget()) going over.
+void set_tu_limits(unsigned seconds, uint64_t memory_mib);
+// What set_tu_limits() set, the memory in bytes
+extern unsigned tu_timeout;
+extern uint64_t tu_memory_limit;
+
+// Whether run_sources() starts the TUs with the longest parse time recorded
+// in `<work_dir>/tu-stats.txt` first (on by default). Parse times and peak
+// memory are recorded in any case, with record_tu_cost().
+void set_cost_scheduling(bool enable);
+void record_tu_cost(const std::string &source, uint64_t ms,
+                    uint64_t peak_bytes);
+
+// MiB of resident memory all TUs being parsed may take together, 0 for no
+// limit. run_sources() starts a TU only when what is resident, what the
+// running TUs are still expected to take and the TU's own expected peak
+// (from `<work_dir>/tu-stats.txt`) fit, so fewer TUs run at once while
+// large ones do. One TU always runs.
+void set_memory_budget(uint64_t mib);
+// What set_memory_budget() set, in bytes
+extern uint64_t memory_budget;
+
+// Resident set size of a process, from /proc
+uint64_t resident_memory(pid_t pid);
+
+struct TuWatchdog;
+
+// Admits a TU only while what is resident now, plus what the running TUs
+// are still expected to grow by, leaves room for its own expected peak
+// within the memory budget. The expected peak of a TU is the one
+// tu-stats.txt records, or for a TU without a record the size of its main
+// file at the rate of the measured ones. It is scaled by how far the TUs
+// finished so far in this run exceeded or fell short of their predictions.
+// A TU is always admitted when none runs, so a budget too small for one TU
+// only serializes the run.
+class MemoryAdmission {
+public:
+  MemoryAdmission(const clang::tooling::CompilationDatabase &db,
+                  const std::vector<std::string> &sources, unsigned workers);
+
+  // For the fork server, which measures its children itself: the expected
+  // peak of `source`
+  uint64_t predict(const std::string &source);
+  // Whether a TU expected to take `predicted` bytes may start next to
+  // `running` TUs, with `live` bytes resident and `outstanding` more
+  // expected of the running ones
+  bool admit(uint64_t predicted, uint64_t live, uint64_t outstanding,
+             size_t running);
+  // Records a TU that waited `ms` for memory while `running` TUs ran
+  void stalled(uint64_t ms, size_t running);
+  // Corrects later predictions by the actual peak of a finished TU
+  void finished(const std::string &source, uint64_t peak);
+
+  // Worker threads: blocks until the TU of `watchdog` may start, and counts
+  // it as running until leave(). `parsed` is false for a TU served by
+  // -pp-hash, whose peak says nothing about the memory of its parse.
+  void enter(const std::string &source, TuWatchdog &watchdog);
+  void leave(const std::string &source, const TuWatchdog &watchdog,
+             bool parsed);
+
+  void report();
+
+private:
+  uint64_t expected(const std::string &source) const;
+  bool fits(uint64_t predicted, uint64_t live, uint64_t outstanding,
+            size_t running);
+  void record_stall(uint64_t ms, size_t running);
+  void record_finish(const std::string &source, uint64_t peak);
+
+  std::mutex mtx;
+  std::condition_variable memory_cv;
+  // Peak bytes per TU, from tu-stats.txt and the main file sizes
+  std::unordered_map<std::string, uint64_t> predictions;
+  // For a TU no earlier run measured
+  uint64_t fallback = 0;
+  double observed_total = 0;
+  double predicted_total = 0;
+  // The TUs worker threads run, with their predictions
+  std::map<const TuWatchdog *, uint64_t> running_tus;
+  uint64_t peak_live = 0;
+  uint64_t stalls = 0;
+  uint64_t stall_ms = 0;
+  size_t fewest_running = SIZE_MAX;
+  size_t most_running = 0;
+};
+
+// Whether the TU this thread is parsing has run out of time or memory. Its
+// memory is estimated from the AST and the source buffers of `context`,
+// and goes to the report. Consumers call it from HandleTopLevelDecl() to cut
+// the parse short.
+bool tu_over_budget(const clang::ASTContext &context);
+// Watches the tokens of the TU this thread is about to parse. It can then
+// be stopped in the middle of a declaration too: once it is out of time its
+// lexers are cut off. With -pp-hash, its token stream is digested for the
+// fact cache. Consumers call it when they are created.
+void watch_tu_tokens(clang::Preprocessor &pp);
+
+// Runs `action` over every source on `jobs` workers, each reusing its own
+// WorkerToolContext. A source for which `skip(db, source)` returns true is
+// not parsed. The facts of a TU are committed together once it has been
+// parsed.
+void run_sources(const clang::tooling::CompilationDatabase &db,
+                 const std::vector<std::string> &sources,
+                 clang::tooling::FrontendActionFactory *action, unsigned jobs,
+                 size_t file_cache_limit,
+                 const std::function<bool(
+                     const clang::tooling::CompilationDatabase &,
+                     const std::string &)> &skip = nullptr);
+
+class StreamingCompilationDatabase;
+
+// Like run_sources(), over the selected files of a streaming database in
+// the order they are read, so the first TUs are parsed while the rest of
+// the database is still coming in. Nothing that needs all sources before
+// the first TU (-fork-server, -incremental, -changed-files, -pch, -shard,
+// ordering by cost) is supported.
+void run_sources(StreamingCompilationDatabase &db,
+                 clang::tooling::FrontendActionFactory *action, unsigned jobs,
+                 size_t file_cache_limit,
+                 const std::function<bool(
+                     const clang::tooling::CompilationDatabase &,
+                     const std::string &)> &skip = nullptr);
+
+// Number of CPUs this process may actually use: the affinity mask, further
+// capped by a cgroup (v1 or v2) CPU quota when one is set.
+unsigned default_worker_count();
+
+// 128-bit digest of a dedup key string
+struct KeyDigest {
+  uint64_t low = 0;
+  uint64_t high = 0;
+
+  bool operator==(const KeyDigest &other) const {
+    return low == other.low && high == other.high;
   }
+  bool empty() const { return low == 0 && high == 0; }
+};
+
+struct KeyDigestHash {
+  size_t operator()(const KeyDigest &digest) const { return digest.low; }
+};
+
+KeyDigest digest_key(llvm::StringRef key);
+
+// Set of key digests in open-addressing tables (linear probing, 16 bytes per
+// slot), sharded by the high word so inserts from different workers rarely
+// share a lock. With verification enabled the full key strings are kept as
+// well, and two different keys sharing a digest are told apart and counted.
+class DigestSet {
+public:
+  // Returns false when the key was already present
+  bool insert(const KeyDigest &digest, llvm::StringRef key);
+
+  void set_verify(bool enable) { verify = enable; }
+  bool verifying() const { return verify; }
+  size_t size();
+  // Bytes held by the tables and, if enabled, the verification strings
+  size_t memory_usage();
+  uint64_t collisions() const { return collision_count; }
+
+private:
+  static constexpr unsigned NUM_SHARDS = 64;
+
+  struct Shard {
+    std::mutex mtx;
+    std::vector<KeyDigest> slots;
+    size_t used = 0;
+    std::unordered_map<KeyDigest, std::string, KeyDigestHash> keys;
+    std::unordered_set<std::string> collided_keys;
+    size_t key_bytes = 0;
+  };
+
+  // Returns the slot holding `digest`, or the empty slot it belongs in
+  static KeyDigest &find_slot(Shard &shard, const KeyDigest &digest);
+  static void grow(Shard &shard);
+
+  Shard shards[NUM_SHARDS];
+  bool verify = false;
+  std::atomic<uint64_t> collision_count{0};
+};
+
+// Counters and records collected over a run, written out as JSON at the end.
+class RunReport {
+public:
+  void add(const std::string &name, uint64_t value);
+  void set(const std::string &name, nlohmann::json value);
+  void append(const std::string &name, nlohmann::json entry);
+  void write(const std::string &path);
+  // From now on, add() also keeps what it adds apart, for
+  // take_additions() to return and clear
+  void collect_additions();
+  std::map<std::string, uint64_t> take_additions();
 
 private:
   std::mutex mtx;
-  std::condition_variable cv;
-  int count;
+  nlohmann::json values = nlohmann::json::object();
+  bool collecting = false;
+  std::map<std::string, uint64_t> additions;
+};
+
+RunReport &run_report();
+// Moves what the shared VFS served since the last call into the run report
+void count_shared_file_cache();
+// Adds the state of the shared helper structures (dedup index, ...) to the
+// run report, prints it and writes it to `path`
+void finish_run_report(const std::string &path);
+void enable_dedup_verification();
+
+// xxHash64 of a file's contents, cached per inode, size and mtime
+uint64_t file_content_hash(const clang::SourceManager &srcMgr,
+                           clang::FileID fid);
+
+// The path facts name a file by: absolute, with its symlinks resolved, also
+// for a header a PCH refers to but the TU never opened
+std::string real_file_path(const clang::SourceManager &srcMgr,
+                           const clang::FileEntry *entry);
+
+// Digests, per header of a TU, the macro state the header was read under:
+// the outcome of each of its conditional directives and the definition of
+// each macro expanded in it. A header read under the same state in two TUs
+// yields the same declarations in both. Headers loaded from a PCH get the
+// state of the PCH.
+class HeaderMacroStates : public clang::PPCallbacks {
+public:
+  explicit HeaderMacroStates(clang::Preprocessor &pp);
+
+  uint64_t state(clang::FileID fid) const;
+
+  void MacroExpands(const clang::Token &name,
+                    const clang::MacroDefinition &definition,
+                    clang::SourceRange range,
+                    const clang::MacroArgs *) override;
+  void If(clang::SourceLocation loc, clang::SourceRange,
+          ConditionValueKind value) override;
+  void Elif(clang::SourceLocation loc, clang::SourceRange,
+            ConditionValueKind value, clang::SourceLocation) override;
+  void Ifdef(clang::SourceLocation loc, const clang::Token &name,
+             const clang::MacroDefinition &definition) override;
+  void Ifndef(clang::SourceLocation loc, const clang::Token &name,
+              const clang::MacroDefinition &definition) override;
+
+private:
+  void mix(clang::SourceLocation loc, llvm::StringRef name, uint64_t value);
+  uint64_t definition_hash(const clang::MacroDefinition &definition);
+
+  clang::Preprocessor &pp;
+  clang::SourceManager &srcMgr;
+  uint64_t pch_state;
+  llvm::DenseMap<clang::FileID, uint64_t> states;
+  llvm::DenseMap<const clang::MacroInfo *, uint64_t> definitions;
+};
+
+// Starts digesting the macro state of the headers `pp` reads, for
+// traverse_unharvested_decls(); null when harvested headers are not
+// skipped. Must be called before the main file is entered.
+HeaderMacroStates *watch_header_macros(clang::Preprocessor &pp);
+
+// Decides which top-level declarations of a TU need visiting. Declarations
+// in an include-guarded header whose (file, content hash, macro state)
+// another TU already harvested are skipped; main-file declarations are
+// always visited. commit() hands the visited headers to the TU's batch;
+// they count as harvested once the TU's facts are committed.
+class HeaderHarvest {
+public:
+  HeaderHarvest(clang::SourceManager &srcMgr, clang::HeaderSearch &headers,
+                const HeaderMacroStates *macros)
+      : srcMgr(srcMgr), headers(headers), macros(macros) {}
+
+  bool should_visit(const clang::Decl *decl);
+  void commit();
+
+private:
+  clang::SourceManager &srcMgr;
+  clang::HeaderSearch &headers;
+  const HeaderMacroStates *macros;
+  llvm::DenseMap<clang::FileID, bool> decisions;
+  std::vector<clang::FileID> visited;
+  uint64_t skipped = 0;
+};
+
+void set_header_skipping(bool enable);
+
+// Traverses a TU like visitor.TraverseDecl(TranslationUnitDecl), leaving out
+// the top-level declarations of already harvested headers
+template <typename Visitor>
+void traverse_unharvested_decls(Visitor &visitor, clang::ASTContext &context,
+                                clang::HeaderSearch &headers,
+                                const HeaderMacroStates *macros) {
+  HeaderHarvest harvest(context.getSourceManager(), headers, macros);
+  for (clang::Decl *decl : context.getTranslationUnitDecl()->decls()) {
+    if (tu_over_budget(context))
+      return;
+    if (harvest.should_visit(decl))
+      visitor.TraverseDecl(decl);
+  }
+  harvest.commit();
+}
+
+// Aho-Corasick automaton over a fixed set of identifiers. The goto and
+// failure functions are folded into one dense DFA over identifier
+// characters, so a scan is a single table lookup per input byte.
+class MultiPatternMatcher {
+public:
+  explicit MultiPatternMatcher(const std::vector<std::string> &patterns);
+  // True if any pattern occurs as a substring of `text`
+  bool search(llvm::StringRef text) const;
+
+private:
+  // 0 stands for every byte that cannot appear in an identifier
+  static constexpr unsigned NUM_CLASSES = 64;
+  static unsigned char_class(unsigned char c);
+
+  std::vector<uint32_t> next;
+  std::vector<bool> accepting;
+};
+
+// Path of the main file of `source`, made absolute against the directory of
+// its first compile command when it is relative
+std::string main_file_path(const clang::tooling::CompilationDatabase &db,
+                           const std::string &source);
+
+// Whether a file_operations initializer, as "source" of an ioctl.jsonl
+// fact, sets an ioctl function, as extract_ioctl_function_name() in
+// process_output.py checks
+bool sets_ioctl_function(llvm::StringRef source);
+
+// The ioctl handlers among the facts of ioctl.jsonl, the entries
+// process_output.py would put into handler_names.txt, against which the
+// "usage.pending" facts of `analyze -usage` are resolved. A pending usage
+// with a "target", the "filename" of the variable's definition, refers to
+// the handler defined there, so same-named static handlers of different
+// TUs stay apart; one without (the variable is only declared in its TU) to
+// any handler of that name.
+class IoctlHandlers {
+public:
+  // Takes note of a fact of ioctl.jsonl
+  void add(llvm::StringRef line);
+  // Whether the pending usage `line` refers to a handler
+  bool resolve(llvm::StringRef line) const;
+  size_t size() const { return decls.size(); }
+
+private:
+  std::set<std::string> names;
+  // "<filename>\0<name>" of every handler
+  std::set<std::string> decls;
 };
 
 std::string get_decl_code(const clang::NamedDecl *);
+// Cheap check whether output_decl() already emitted this fact, meant to be
+// asked before paying for get_decl_code()
+bool decl_emitted(const clang::NamedDecl *decl,
+                  const std::string &output_file_name,
+                  const std::string &alias_name = "");
+// `target` is the declaration a fact that is resolved later refers to; its
+// "filename" goes into the fact as "target"
 void output_decl(const clang::NamedDecl *decl, std::string output_file_name,
-                 bool is_typedef = false, std::string alias_name = "");
+                 bool is_typedef = false, std::string alias_name = "",
+                 const clang::NamedDecl *target = nullptr);
+// Sets the "source" and "filename" of the fact of a declaration from its
+// first to its last token, its "target" when `targetLoc` is valid, and the
+// real paths of the files it is in
+void locate_fact(const clang::SourceManager &sourceManager,
+                 clang::SourceLocation beginLoc, clang::SourceLocation endLoc,
+                 clang::SourceLocation targetLoc, nlohmann::json &fact,
+                 std::string &file, std::string &spelling_file);
+
+// Identity of a fact that can be computed without touching the source text:
+// the file the declaration is expanded in (by inode, so it is stable across
+// the FileManagers of different TUs), its expansion and spelling offsets,
+// and a hash of the fact kind, the declaration name and the alias.
+struct DeclKey {
+  uint64_t device;
+  uint64_t file;
+  uint64_t offsets;
+  uint64_t kind;
+
+  bool operator==(const DeclKey &other) const {
+    return device == other.device && file == other.file &&
+           offsets == other.offsets && kind == other.kind;
+  }
+};
+
+struct DeclKeyHash {
+  size_t operator()(const DeclKey &key) const {
+    uint64_t h = key.file * 0x9e3779b97f4a7c15ULL;
+    h ^= key.offsets + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= key.kind + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h ^ key.device;
+  }
+};
+
+// Identity of a header's contents and the macro state it was read under,
+// see HeaderHarvest
+struct HeaderKey {
+  uint64_t device;
+  uint64_t file;
+  uint64_t content;
+  uint64_t macros;
+
+  bool operator==(const HeaderKey &other) const {
+    return device == other.device && file == other.file &&
+           content == other.content && macros == other.macros;
+  }
+};
+
+struct HeaderKeyHash {
+  size_t operator()(const HeaderKey &key) const {
+    return key.file * 0x9e3779b97f4a7c15ULL ^ key.content ^ key.macros;
+  }
+};
+
+// Token position of a fact without a location
+constexpr uint32_t NO_TOKEN = UINT32_MAX;
+
+// A fact as output_decl() produced it, before deduplication
+struct FactRecord {
+  bool has_key;
+  DeclKey key;
+  std::string output_file_name;
+  std::string key_name;
+  std::string json;
+  // Real paths of the file the declaration is in and, when a macro wrote
+  // it, of the file the macro is spelled in if that is another one
+  std::string file;
+  std::string spelling_file;
+  // With -pp-hash, the positions in the TU's token stream of the first and
+  // last token of the declaration and of the first token of the target
+  uint32_t first_token = NO_TOKEN;
+  uint32_t last_token = NO_TOKEN;
+  uint32_t target_token = NO_TOKEN;
+};
+
+// Files a TU entered, main file first, with their content hashes
+using TuInputs = std::vector<std::pair<std::string, uint64_t>>;
+
+// Everything one TU contributes: its facts, the headers it harvested and,
+// in an incremental run, its inputs. None of it reaches the dedup sets or
+// the shards before commit_batch(), so a TU either counts as a whole or
+// not at all, wherever it was parsed.
+struct FactBatch {
+  std::vector<FactRecord> facts;
+  std::unordered_set<DeclKey, DeclKeyHash> keys;
+  std::vector<HeaderKey> headers;
+  TuInputs inputs;
+  uint64_t header_decls_skipped = 0;
+  // Run report counters a forked child added while parsing the TU
+  std::map<std::string, uint64_t> counters;
+  // Whether -pp-hash took the facts from the cache instead of a parse
+  bool from_token_cache = false;
+};
+
+// The batch of the TU this thread is parsing, if any; output_decl() and
+// HeaderHarvest add to it instead of committing right away
+extern thread_local FactBatch *current_batch;
+// Writes the facts of `batch` that are not duplicates to this thread's
+// shard, marks its headers harvested and journals `source` as done. An
+// empty batch just marks it as done; an empty `source` is not journaled.
+void commit_batch(FactBatch &batch, const std::string &source);
+// Batches travel between processes as a file of 'F'act, 'H'eader,
+// 'C'ounter and 'I'nput records and a 'T'oken cache flag, closed by an
+// 'E'nd record that tells a complete file from one whose writer died
+bool write_batch(const FactBatch &batch, const std::string &path);
+bool read_batch(const std::string &path, FactBatch &batch);
+
+// Parses `source` into `batch` as the current batch, and adds its facts to
+// the fact cache unless the TU's watchdog stopped it. With -pp-hash the TU
+// is preprocessed first, and its facts are taken from the cache instead
+// when an earlier parse saw the same token stream. Used by the worker
+// threads and the children of the fork server alike.
+void parse_tu(WorkerToolContext &context,
+              const clang::tooling::CompilationDatabase &db,
+              const std::string &source,
+              clang::tooling::FrontendActionFactory *action, bool reduced_flags,
+              FactBatch &batch);
+// Wall-clock milliseconds since `start`
+uint64_t milliseconds_since(std::chrono::steady_clock::time_point start);
+
+// Facts are not written to the output files directly: every worker thread
+// buffers them in memory and spills to its own shard file under `dir`.
+// merge_output_shards() appends all shards to the final .jsonl files once
+// the workers are done.
+//
+// The TUs the workers complete are journaled to `dir`/journal.txt, with
+// the shard and dedup index state they left behind, for all workers at
+// once. `resume` picks up an interrupted run from there: TUs in the journal
+// are not parsed again, and the facts still to come are deduplicated
+// against the ones already in the shards, so the outputs match those of an
+// uninterrupted run.
+void open_output_shards(const std::string &dir, bool resume = false);
+// How often the journal is written, at the end of a TU; 0 for after every
+// TU
+void set_checkpoint_interval(unsigned seconds);
+// The `dir` of open_output_shards(), which also holds the batch files
+extern std::string shard_dir;
+// TUs a resumed run finds in the journal
+extern std::unordered_set<std::string> completed_tus;
+// Calls `fn(output_file_name, json)` for every fact in the shards and, in
+// an incremental run, every fact kept from earlier runs
+void scan_output_shards(
+    const std::function<void(llvm::StringRef, llvm::StringRef)> &fn);
+// `route` may send a fact to another output file, or drop it by returning
+// an empty name
+void merge_output_shards(
+    const std::function<std::string(llvm::StringRef, llvm::StringRef)>
+        &route = nullptr);
+
+// The options analyze and usage share, in `category`. A tool constructs
+// them in main() before llvm::cl::ParseCommandLineOptions(), with its own
+// defaults for -work-dir and -report, and adds its own options to
+// `category`.
+struct RunOptions {
+  RunOptions(const char *work_dir, const char *report);
+  // -j, or the CPUs available when it is not given
+  unsigned jobs() const;
+
+  llvm::cl::OptionCategory category;
+  llvm::cl::opt<std::string> compile_commands;
+  llvm::cl::opt<unsigned> num_jobs;
+  llvm::cl::opt<size_t> file_cache_limit;
+  llvm::cl::opt<std::string> work_dir;
+  llvm::cl::opt<std::string> report;
+  llvm::cl::opt<bool> verify_dedup;
+  llvm::cl::opt<bool> skip_headers;
+  llvm::cl::opt<bool> shared_vfs;
+  llvm::cl::opt<bool> pch;
+  llvm::cl::opt<bool> fork_server;
+  llvm::cl::opt<unsigned> tu_timeout;
+  llvm::cl::opt<uint64_t> tu_rss_limit;
+  llvm::cl::opt<uint64_t> memory_budget;
+  llvm::cl::opt<bool> schedule_by_cost;
+  llvm::cl::opt<bool> retry_quarantined;
+  llvm::cl::opt<bool> resume;
+  llvm::cl::opt<unsigned> checkpoint_interval;
+  llvm::cl::opt<bool> incremental;
+  llvm::cl::opt<std::string> fact_cache;
+  llvm::cl::opt<bool> pp_hash;
+  llvm::cl::opt<std::string> shard;
+  llvm::cl::opt<std::string> shard_costs;
+  llvm::cl::opt<bool> stream_db;
+  llvm::cl::opt<std::string> changed_files;
+};
+
+// Checks the parsed `options` for combinations that cannot work. Prints the
+// first problem and returns false if there is one.
+bool validate_run_options(const RunOptions &options);
+// Turns on what `options` ask for and opens the output shards. `config` is
+// as for enable_incremental().
+void apply_run_options(const RunOptions &options, llvm::StringRef config);
 
 #endif
@@ -0,0 +1,637 @@
+#!/bin/bash
+# End-to-end tests of analyze, fact-merge and compile-db-pack on small
+# trees written to a temporary directory, run by `make test` once the tools
+# are built. Each test runs in a process of its own and stops at the first
+# command that fails.
+
+BIN=$(cd "$(dirname "$0")/.." && pwd)
+
+# A tree of C files with a compilation database: headers several TUs
+# include (one of them depends on -DMODULE, one declares a struct through
+# a macro) and TUs that include nothing
+make_tree() {
+  local dir=$1
+  mkdir -p "$dir/include"
+  cat > "$dir/include/types.h" <<'EOF'
+#ifndef TYPES_H
+#define TYPES_H
+#define DECLARE_LIST(name) struct name##_list { struct name *first; }
+struct point { int x, y; };
+DECLARE_LIST(point);
+enum color { RED, GREEN };
+typedef unsigned long size_type;
+#endif
+EOF
+  cat > "$dir/include/variant.h" <<'EOF'
+#ifndef VARIANT_H
+#define VARIANT_H
+#ifdef MODULE
+struct built_as_module { int a; };
+#else
+struct built_in { int b; };
+#endif
+#endif
+EOF
+  cat > "$dir/a.c" <<'EOF'
+#include "types.h"
+#include "variant.h"
+int area(struct point *p) { return p->x * p->y; }
+EOF
+  cat > "$dir/b.c" <<'EOF'
+#include "types.h"
+#include "variant.h"
+static enum color pick(void) { return GREEN; }
+int use_b(void) { return pick(); }
+EOF
+  cat > "$dir/c.c" <<'EOF'
+struct local { int v; };
+int use_c(struct local *l) { return l->v; }
+EOF
+  cat > "$dir/d.c" <<'EOF'
+#include "types.h"
+size_type total(struct point_list *list) { return list->first != 0; }
+EOF
+  cat > "$dir/e.c" <<'EOF'
+int keep_e(void) { return 1; }
+EOF
+  write_db "$dir" "a.c -DMODULE" b.c c.c d.c e.c
+}
+
+# Adds slow.c to the tree in `dir`, a TU that takes clang far longer than
+# a second: its header expands to a few hundred million tokens. A function
+# is declared before it. Not added to the compilation database.
+write_slow_tu() {
+  local dir=$1 i
+  {
+    echo '#define X1 ; ; ; ; ; ; ; ; ; ;'
+    for i in 2 3 4 5 6; do
+      echo "#define X$i$(printf " X$((i - 1))%.0s" {1..10})"
+    done
+    for i in $(seq 300); do
+      echo X6
+    done
+  } > "$dir/include/slow.h"
+  printf 'int before_slow(void) { return 0; }\n#include "slow.h"\n' \
+    > "$dir/slow.c"
+}
+
+# Writes the compilation database of `dir` for the TUs given as "file
+# flags...", each also with $FLAGS
+write_db() {
+  local dir=$1 sep=
+  shift
+  {
+    echo "["
+    for tu in "$@"; do
+      printf '%s  {"directory": "%s", "file": "%s",\n' "$sep" "$dir" \
+        "${tu%% *}"
+      printf '   "command": "cc -c -I%s/include %s %s"}' "$dir" \
+        "${FLAGS:-}" "$tu"
+      sep=$',\n'
+    done
+    echo
+    echo "]"
+  } > "$dir/compile_commands.json"
+}
+
+# Two drivers with same-named static file_operations, only the first of
+# which sets an ioctl function
+make_drivers() {
+  local dir=$1
+  mkdir -p "$dir/include"
+  cat > "$dir/include/fs.h" <<'EOF'
+struct file;
+struct file_operations {
+  long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+  int (*open)(struct file *);
+};
+EOF
+  cat > "$dir/drv_a.c" <<'EOF'
+#include "fs.h"
+static long a_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
+  return 0;
+}
+static const struct file_operations fops = {
+  .unlocked_ioctl = a_ioctl,
+};
+int register_a(void) { return fops.unlocked_ioctl != 0; }
+EOF
+  cat > "$dir/drv_b.c" <<'EOF'
+#include "fs.h"
+static int b_open(struct file *f) { return 0; }
+static const struct file_operations fops = {
+  .open = b_open,
+};
+int register_b(void) { return fops.open != 0; }
+EOF
+  write_db "$dir" drv_a.c drv_b.c
+}
+
+# Runs analyze in `dir`, which then holds its outputs, work directory and
+# report
+analyze() {
+  local dir=$1
+  shift
+  mkdir -p "$dir"
+  (cd "$dir" && "$BIN/analyze" "$@" >> analyze.log 2>&1)
+}
+
+# The .jsonl files of `dir`, each sorted
+outputs() {
+  for file in "$1"/*.jsonl; do
+    echo "== ${file##*/}"
+    sort "$file"
+  done
+}
+
+same_outputs() {
+  if ! diff <(outputs "$1") <(outputs "$2") > "$TMP/diff"; then
+    echo "outputs of $1 and $2 differ:" >&2
+    head -20 "$TMP/diff" >&2
+    return 1
+  fi
+}
+
+# A counter of the run report in `dir`, 0 when it is not set
+report_value() {
+  python3 -c 'import json, sys
+print(json.load(open(sys.argv[1])).get(sys.argv[2], 0))' \
+    "$1/analyze-report.json" "$2"
+}
+
+# Fails if `file` has a line matching `pattern`
+absent() {
+  if grep -q "$1" "$2"; then
+    echo "$2 has $1" >&2
+    return 1
+  fi
+}
+
+expect() {
+  if [ "$1" != "$2" ]; then
+    echo "$3: expected $2, got $1" >&2
+    return 1
+  fi
+}
+
+# Each variant of a header that TUs include with different macros is
+# harvested
+test_header_variants() {
+  make_tree "$TMP/src"
+  for jobs in 1 2; do
+    analyze "$TMP/run-$jobs" -p "$TMP/src/compile_commands.json" -j $jobs
+    grep -q '"built_as_module"' "$TMP/run-$jobs/struct.jsonl"
+    grep -q '"built_in"' "$TMP/run-$jobs/struct.jsonl"
+  done
+}
+
+# Usages of same-named static handlers of two TUs stay apart: only those of
+# the one that sets an ioctl function are kept, with the definition of the
+# handler they refer to
+test_usage_handlers() {
+  make_drivers "$TMP/drv"
+  analyze "$TMP/run" -p "$TMP/drv/compile_commands.json" -usage -j 2
+  [ "$(wc -l < "$TMP/run/usage.jsonl")" -eq 1 ]
+  grep -q '"name":"register_a"' "$TMP/run/usage.jsonl"
+  grep -q '"target":"[^"]*/drv_a.c:5"' "$TMP/run/usage.jsonl"
+}
+
+# A PCH of the forced includes yields the facts the includes themselves
+# do, even when they are reached through a symlink
+test_pch() {
+  make_tree "$TMP/src"
+  mv "$TMP/src/include" "$TMP/src/real-include"
+  ln -s real-include "$TMP/src/include"
+  cat > "$TMP/src/include/config.h" <<'EOF'
+struct config { int enabled; };
+typedef struct config config_t;
+EOF
+  FLAGS="-include include/config.h" write_db "$TMP/src" a.c b.c d.c
+  analyze "$TMP/plain" -p "$TMP/src/compile_commands.json"
+  analyze "$TMP/pch" -p "$TMP/src/compile_commands.json" -pch
+  expect "$(report_value "$TMP/pch" tus_with_pch)" 3 tus_with_pch
+  grep -q '"config"' "$TMP/pch/struct.jsonl"
+  same_outputs "$TMP/plain" "$TMP/pch"
+}
+
+# Children forked per TU yield the facts of a run on threads
+test_fork_server() {
+  make_tree "$TMP/src"
+  local db=$TMP/src/compile_commands.json
+  analyze "$TMP/run" -p "$db" -fork-server -j 2
+  expect "$(report_value "$TMP/run" tus_forked)" 5 tus_forked
+  expect "$(report_value "$TMP/run" tus_crashed)" 0 tus_crashed
+  analyze "$TMP/plain" -p "$db"
+  same_outputs "$TMP/plain" "$TMP/run"
+}
+
+# What children count reaches the report. The template preprocesses e.c,
+# which is in no PCH group, so only children load the PCH, and only
+# children drop the FileManager they inherit, which holds more files than
+# the limit.
+test_fork_server_counters() {
+  make_tree "$TMP/src"
+  cat > "$TMP/src/include/config.h" <<'EOF'
+struct config { int enabled; };
+EOF
+  FLAGS="-include include/config.h" write_db "$TMP/src" "e.c -O2" a.c b.c d.c
+  analyze "$TMP/run" -p "$TMP/src/compile_commands.json" -fork-server -j 2 \
+    -pch -shared-vfs -file-cache-limit 1
+  expect "$(report_value "$TMP/run" tus_with_pch)" 3 tus_with_pch
+  expect "$(report_value "$TMP/run" file_manager_resets)" 4 \
+    file_manager_resets
+  [ "$(report_value "$TMP/run" shared_vfs_hits)" -gt 0 ]
+}
+
+# A child that runs out of time is killed, retried once with reduced flags,
+# killed again and quarantined. The other TUs keep their facts.
+test_fork_server_kill() {
+  make_tree "$TMP/src"
+  cp "$TMP/src/compile_commands.json" "$TMP/five.json"
+  write_slow_tu "$TMP/src"
+  write_db "$TMP/src" "a.c -DMODULE" b.c c.c d.c e.c slow.c
+  analyze "$TMP/run" -p "$TMP/src/compile_commands.json" -fork-server -j 2 \
+    -tu-timeout 1
+  expect "$(report_value "$TMP/run" tus_forked)" 7 tus_forked
+  expect "$(report_value "$TMP/run" tus_crashed)" 2 tus_crashed
+  grep -qx $'slow.c\ttimeout after 1s' "$TMP/run/.analyze-work/quarantine.txt"
+  absent before_slow "$TMP/run/func.jsonl"
+  analyze "$TMP/plain" -p "$TMP/five.json"
+  same_outputs "$TMP/plain" "$TMP/run"
+}
+
+# A worker thread drops a TU that runs out of time or memory, and only that
+# TU
+test_tu_limits() {
+  make_tree "$TMP/src"
+  cp "$TMP/src/compile_commands.json" "$TMP/five.json"
+  write_slow_tu "$TMP/src"
+  seq 30000 | sed 's/.*/struct big& { int a, b, c, d; };/' > "$TMP/src/big.c"
+  write_db "$TMP/src" "a.c -DMODULE" b.c c.c d.c e.c slow.c big.c
+  analyze "$TMP/run" -p "$TMP/src/compile_commands.json" -j 2 \
+    -tu-timeout 1 -tu-rss-limit 2
+  expect "$(report_value "$TMP/run" tus_aborted)" 2 tus_aborted
+  grep -q '^slow.c: dropped (timeout after 1s)$' "$TMP/run/analyze.log"
+  grep -q '^big.c: dropped (memory over 2 MiB)$' "$TMP/run/analyze.log"
+  absent before_slow "$TMP/run/func.jsonl"
+  absent big1 "$TMP/run/struct.jsonl"
+  analyze "$TMP/plain" -p "$TMP/five.json"
+  same_outputs "$TMP/plain" "$TMP/run"
+}
+
+# A TU that crashes clang is retried with reduced flags and quarantined when
+# it crashes again. The next run skips it, -retry-quarantined tries again.
+test_crash_quarantine() {
+  make_tree "$TMP/src"
+  cp "$TMP/src/compile_commands.json" "$TMP/five.json"
+  printf '#pragma clang __debug crash\n' > "$TMP/src/crash.c"
+  write_db "$TMP/src" "a.c -DMODULE" b.c c.c d.c e.c "crash.c -O2 -g"
+  local db=$TMP/src/compile_commands.json
+  analyze "$TMP/run" -p "$db" -fork-server -j 2
+  expect "$(python3 -c 'import json, sys
+print(" ".join("%s:%s" % (tu["source"], tu["reduced_flags"])
+               for tu in json.load(open(sys.argv[1]))["crashed_tus"]))' \
+    "$TMP/run/analyze-report.json")" "crash.c:False crash.c:True" crashed_tus
+  grep -q $'^crash.c\t' "$TMP/run/.analyze-work/quarantine.txt"
+  analyze "$TMP/plain" -p "$TMP/five.json"
+  same_outputs "$TMP/plain" "$TMP/run"
+
+  rm "$TMP/run"/*.jsonl
+  analyze "$TMP/run" -p "$db" -fork-server -j 2
+  expect "$(report_value "$TMP/run" tus_quarantined)" 1 tus_quarantined
+  expect "$(report_value "$TMP/run" tus_forked)" 5 tus_forked
+  same_outputs "$TMP/plain" "$TMP/run"
+
+  rm "$TMP/run"/*.jsonl
+  analyze "$TMP/run" -p "$db" -fork-server -j 2 -retry-quarantined
+  expect "$(report_value "$TMP/run" tus_quarantined)" 0 tus_quarantined
+  expect "$(report_value "$TMP/run" tus_crashed)" 2 tus_crashed
+}
+
+# A run resumed from any point of its journal, or from a merge cut short,
+# writes the outputs of an uninterrupted run
+test_resume() {
+  make_tree "$TMP/src"
+  local db=$TMP/src/compile_commands.json
+  analyze "$TMP/ref" -p "$db" -j 2
+
+  # The merge cannot stage struct.jsonl, so the run fails after every TU
+  # has been journaled
+  mkdir -p "$TMP/run/.analyze-work/merge-struct.jsonl/obstacle"
+  if analyze "$TMP/run" -p "$db" -j 2; then
+    echo "the merge did not fail" >&2
+    return 1
+  fi
+  local journal=$TMP/run/.analyze-work/journal.txt
+  local size cuts
+  size=$(stat -c %s "$journal")
+  cuts=$(grep -b '^checkpoint' "$journal" | cut -d: -f1)
+  for cut in 0 $cuts $(for c in $cuts; do echo $((c + 5)); done) $size; do
+    rm -rf "$TMP/cut"
+    cp -a "$TMP/run" "$TMP/cut"
+    truncate -s "$cut" "$TMP/cut/.analyze-work/journal.txt"
+    rm -r "$TMP/cut/.analyze-work/merge-struct.jsonl"
+    analyze "$TMP/cut" -p "$db" -j 2 -resume
+    same_outputs "$TMP/ref" "$TMP/cut"
+  done
+
+  # Appending to struct.jsonl fails after the outputs before it were
+  # written
+  rm -r "$TMP/run/.analyze-work/merge-struct.jsonl"
+  mkdir "$TMP/run/struct.jsonl"
+  if analyze "$TMP/run" -p "$db" -j 2 -resume; then
+    echo "the merge did not fail" >&2
+    return 1
+  fi
+  grep -q '^merging ' "$journal"
+  rmdir "$TMP/run/struct.jsonl"
+  analyze "$TMP/run" -p "$db" -j 2 -resume
+  same_outputs "$TMP/ref" "$TMP/run"
+  [ ! -e "$journal" ]
+}
+
+# Two workers whose TUs share types.h, checkpointed after every TU: a run
+# resumed from the end of any checkpoint group, or from the middle of one,
+# still has the facts of the header, whichever worker harvested it
+test_resume_shared_header() {
+  make_tree "$TMP/src"
+  local db=$TMP/src/compile_commands.json
+  analyze "$TMP/ref" -p "$db" -j 2
+
+  mkdir -p "$TMP/run/.analyze-work/merge-struct.jsonl/obstacle"
+  if analyze "$TMP/run" -p "$db" -j 2 -checkpoint-interval 0; then
+    echo "the merge did not fail" >&2
+    return 1
+  fi
+  local journal=$TMP/run/.analyze-work/journal.txt
+  grep -q '^checkpoint 0 ' "$journal"
+  grep -q '^checkpoint 1 ' "$journal"
+  local ends records
+  ends=$(grep -b '^end$' "$journal" | cut -d: -f1)
+  records=$(grep -b '^checkpoint' "$journal" | cut -d: -f1)
+  for cut in $(for c in $ends; do echo $((c + 4)); done) \
+    $(for c in $records; do echo $((c + 5)); done); do
+    rm -rf "$TMP/cut"
+    cp -a "$TMP/run" "$TMP/cut"
+    truncate -s "$cut" "$TMP/cut/.analyze-work/journal.txt"
+    rm -r "$TMP/cut/.analyze-work/merge-struct.jsonl"
+    analyze "$TMP/cut" -p "$db" -j 2 -resume -checkpoint-interval 0
+    same_outputs "$TMP/ref" "$TMP/cut"
+  done
+}
+
+# An incremental run replaces the facts of TUs whose inputs changed and
+# retracts those of removed TUs
+test_incremental() {
+  make_tree "$TMP/src"
+  if analyze "$TMP/pch" -p "$TMP/src/compile_commands.json" -incremental \
+    -pch; then
+    echo "-pch was accepted with -incremental" >&2
+    return 1
+  fi
+  analyze "$TMP/run" -p "$TMP/src/compile_commands.json" -incremental
+  echo "struct added { int z; };" >> "$TMP/src/include/variant.h"
+  sed -i 's/use_c/use_c_again/' "$TMP/src/c.c"
+  rm "$TMP/src/d.c"
+  write_db "$TMP/src" "a.c -DMODULE" b.c c.c e.c
+  analyze "$TMP/run" -p "$TMP/src/compile_commands.json" -incremental
+  expect "$(report_value "$TMP/run" tus_reparsed)" 3 tus_reparsed
+  expect "$(report_value "$TMP/run" tus_removed)" 1 tus_removed
+  analyze "$TMP/fresh" -p "$TMP/src/compile_commands.json"
+  same_outputs "$TMP/fresh" "$TMP/run"
+  grep -q '"added"' "$TMP/run/struct.jsonl"
+  absent '"use_c"' "$TMP/run/func.jsonl"
+  absent '"total"' "$TMP/run/func.jsonl"
+}
+
+# An incremental -usage run that parses one of two TUs again keeps a single
+# usage of the handler in the header both include
+test_incremental_usage() {
+  make_drivers "$TMP/drv"
+  cat > "$TMP/drv/include/reg.h" <<'EOF'
+static long h_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
+  return 0;
+}
+static const struct file_operations h_fops = {
+  .unlocked_ioctl = h_ioctl,
+};
+static inline int register_h(void) { return h_fops.unlocked_ioctl != 0; }
+EOF
+  sed -i '1a #include "reg.h"' "$TMP/drv/drv_a.c" "$TMP/drv/drv_b.c"
+  local db=$TMP/drv/compile_commands.json
+  analyze "$TMP/run" -p "$db" -usage -incremental
+  echo "int more_b(void) { return 2; }" >> "$TMP/drv/drv_b.c"
+  analyze "$TMP/run" -p "$db" -usage -incremental
+  expect "$(report_value "$TMP/run" tus_reparsed)" 1 tus_reparsed
+  expect "$(grep -c '"name":"register_h"' "$TMP/run/usage.jsonl")" 1 \
+    register_h
+  analyze "$TMP/fresh" -p "$db" -usage
+  same_outputs "$TMP/fresh" "$TMP/run"
+}
+
+# A checkout reached through a symlink takes every TU from the cache
+# another checkout filled, with its own paths in the facts
+test_fact_cache() {
+  make_tree "$TMP/one"
+  make_tree "$TMP/real-two"
+  ln -s real-two "$TMP/two"
+  write_db "$TMP/two" "a.c -DMODULE" b.c c.c d.c e.c
+  analyze "$TMP/run-one" -p "$TMP/one/compile_commands.json" \
+    -fact-cache "$TMP/cache"
+  expect "$(report_value "$TMP/run-one" fact_cache_misses)" 5 \
+    fact_cache_misses
+  analyze "$TMP/run-two" -p "$TMP/two/compile_commands.json" \
+    -fact-cache "$TMP/cache"
+  expect "$(report_value "$TMP/run-two" fact_cache_hits)" 5 fact_cache_hits
+  analyze "$TMP/plain-two" -p "$TMP/two/compile_commands.json"
+  same_outputs "$TMP/plain-two" "$TMP/run-two"
+}
+
+# Two checkouts of a TU in one run share its cached block, and each keeps
+# the facts at its own paths
+test_fact_cache_checkouts() {
+  make_tree "$TMP/one"
+  make_tree "$TMP/two"
+  local db=$TMP/db.json
+  printf '[{"directory": "%s", "file": "%s/c.c", "command": "cc -c c.c"},
+ {"directory": "%s", "file": "%s/c.c", "command": "cc -c c.c"}]\n' \
+    "$TMP/one" "$TMP/one" "$TMP/two" "$TMP/two" > "$db"
+  if analyze "$TMP/pch" -p "$db" -fact-cache "$TMP/cache" -pch; then
+    echo "-pch was accepted with -fact-cache" >&2
+    return 1
+  fi
+  analyze "$TMP/run" -p "$db" -j 1 -fact-cache "$TMP/cache"
+  expect "$(report_value "$TMP/run" fact_cache_hits)" 1 fact_cache_hits
+  expect "$(grep -c '"name":"use_c"' "$TMP/run/func.jsonl")" 2 use_c
+  analyze "$TMP/plain" -p "$db"
+  same_outputs "$TMP/plain" "$TMP/run"
+}
+
+# -changed-files parses the TUs that read a listed file according to the
+# include graph of the last -incremental run, and those whose command
+# changed since. A relative path matches by suffix, and a file no TU read
+# is reported. Without a graph it fails.
+test_changed_files() {
+  make_tree "$TMP/src"
+  local db=$TMP/src/compile_commands.json
+  if echo c.c | analyze "$TMP/nograph" -p "$db" -changed-files -; then
+    echo "-changed-files ran without an include graph" >&2
+    return 1
+  fi
+  grep -q 'deps.txt' "$TMP/nograph/analyze.log"
+  analyze "$TMP/inc" -p "$db" -incremental
+  echo '/* edited */' >> "$TMP/src/include/variant.h"
+  write_db "$TMP/src" "a.c -DMODULE" b.c c.c d.c "e.c -DEXTRA"
+  printf 'include/variant.h\n%s\nnot/there.h\n' "$TMP/src/c.c" |
+    analyze "$TMP/review" -p "$db" -work-dir "$TMP/inc/.analyze-work" \
+      -changed-files -
+  expect "$(report_value "$TMP/review" tus_affected)" 4 tus_affected
+  expect "$(report_value "$TMP/review" tus_command_changed)" 1 \
+    tus_command_changed
+  expect "$(report_value "$TMP/review" changed_files_unmatched)" \
+    "['not/there.h']" changed_files_unmatched
+  grep -q '"name":"area"' "$TMP/review/func.jsonl"
+  grep -q '"name":"use_b"' "$TMP/review/func.jsonl"
+  grep -q '"name":"use_c"' "$TMP/review/func.jsonl"
+  grep -q '"name":"keep_e"' "$TMP/review/func.jsonl"
+  absent '"name":"total"' "$TMP/review/func.jsonl"
+}
+
+# With -pp-hash, TUs whose headers only changed in comments and blank
+# lines reuse their facts, at the positions of the edited headers. Forked
+# children send their counters back with their batch.
+test_pp_hash() {
+  make_tree "$TMP/src"
+  local db=$TMP/src/compile_commands.json
+  if analyze "$TMP/pch" -p "$db" -pp-hash -pch; then
+    echo "-pch was accepted with -pp-hash" >&2
+    return 1
+  fi
+  analyze "$TMP/first" -p "$db" -fact-cache "$TMP/cache" -pp-hash
+  # Hits add manifest entries, the forked run below starts from this cache
+  cp -r "$TMP/cache" "$TMP/cache-first"
+  sed -i '1i /* Types shared by the TUs */\n' "$TMP/src/include/types.h"
+  sed -i 's/^struct point/\n  struct point/' "$TMP/src/include/types.h"
+  analyze "$TMP/second" -p "$db" -fact-cache "$TMP/cache" -pp-hash
+  expect "$(report_value "$TMP/second" pp_hash_hits)" 3 pp_hash_hits
+  analyze "$TMP/plain" -p "$db"
+  same_outputs "$TMP/plain" "$TMP/second"
+  analyze "$TMP/forked" -p "$db" -fact-cache "$TMP/cache-first" -pp-hash \
+    -fork-server
+  expect "$(report_value "$TMP/forked" pp_hash_hits)" 3 forked_pp_hash_hits
+  same_outputs "$TMP/plain" "$TMP/forked"
+  # Only preprocessed, the hits measured no parse cost
+  local run
+  for run in second forked; do
+    expect "$(wc -l < "$TMP/$run/.analyze-work/tu-stats.txt")" 0 tu-stats.txt
+  done
+}
+
+# The costs measured by an earlier run start the longest TUs first and
+# predict the makespan, whatever the order of the compilation database
+test_cost_schedule() {
+  make_tree "$TMP/src"
+  local db=$TMP/src/compile_commands.json jobs
+  for jobs in 1 2; do
+    mkdir -p "$TMP/run$jobs/.analyze-work"
+    printf '%s\t1\t%s\n' 100 c.c 400 e.c 300 a.c 200 b.c 50 d.c \
+      > "$TMP/run$jobs/.analyze-work/tu-stats.txt"
+    analyze "$TMP/run$jobs" -p "$db" -j $jobs
+    expect "$(report_value "$TMP/run$jobs" tus_cost_estimated)" 0 \
+      tus_cost_estimated
+  done
+  expect "$(grep -x '[a-e]\.c' "$TMP/run1/analyze.log" | tr '\n' ' ')" \
+    "e.c a.c b.c c.c d.c " order
+  expect "$(report_value "$TMP/run1" predicted_makespan_ms)" 1050 \
+    predicted_makespan_ms
+  expect "$(report_value "$TMP/run2" predicted_makespan_ms)" 550 \
+    predicted_makespan_ms
+}
+
+# A database streamed through a pipe yields the facts of a loaded one
+test_stream_db() {
+  make_tree "$TMP/src"
+  local db=$TMP/src/compile_commands.json
+  mkdir -p "$TMP/run"
+  (cd "$TMP/run" && "$BIN/analyze" -p - -stream-db -j 2 < "$db" \
+    >> analyze.log 2>&1)
+  expect "$(report_value "$TMP/run" db_commands)" 5 db_commands
+  analyze "$TMP/plain" -p "$db"
+  same_outputs "$TMP/plain" "$TMP/run"
+}
+
+# A budget too small for two TUs parses them one at a time, with the
+# same facts
+test_memory_budget() {
+  make_tree "$TMP/src"
+  analyze "$TMP/run" -p "$TMP/src/compile_commands.json" -j 2 \
+    -memory-budget 1
+  expect "$(report_value "$TMP/run" admission_max_running)" 1 \
+    admission_max_running
+  analyze "$TMP/plain" -p "$TMP/src/compile_commands.json"
+  same_outputs "$TMP/plain" "$TMP/run"
+}
+
+# Two shards of a run, merged by fact-merge, have the facts of the whole
+# run, with or without -usage, split by size or by the parse times of an
+# earlier run
+test_shards() {
+  make_tree "$TMP/src"
+  local db=$TMP/src/compile_commands.json
+  for usage in "" -usage; do
+    analyze "$TMP/plain$usage" -p "$db" $usage
+    local costs=$TMP/plain$usage/.analyze-work/tu-stats.txt
+    for split in size cost; do
+      local run=$TMP/$split$usage
+      local options=
+      [ $split = cost ] && options=-shard-costs=$costs
+      analyze "$run/0" -p "$db" -shard=0/2 $usage $options
+      analyze "$run/1" -p "$db" -shard=1/2 $usage $options
+      expect "$(ls "$run/0" | grep -c '\.jsonl$')" 0 jsonl_files
+      expect "$(report_value "$run/0" shard_balanced_by)" $split \
+        shard_balanced_by
+      expect $(($(report_value "$run/0" tus_in_shard) +
+        $(report_value "$run/1" tus_in_shard))) 5 tus_in_shard
+      "$BIN/fact-merge" -o "$run/merged" "$run/0/.analyze-work" \
+        "$run/1/.analyze-work" -report "$run/merge.json" > /dev/null
+      same_outputs "$TMP/plain$usage" "$run/merged"
+    done
+  done
+  # A missing shard is an error
+  ! "$BIN/fact-merge" -o "$TMP/partial" "$TMP/size/0/.analyze-work" \
+    > /dev/null 2>&1
+}
+
+# A packed database yields the facts of the JSON one, and -stream-db
+# refuses it
+test_packed_db() {
+  make_tree "$TMP/src"
+  local db=$TMP/src/compile_commands.json
+  "$BIN/compile-db-pack" "$db" -o "$TMP/compile_commands.bin" > /dev/null
+  analyze "$TMP/run" -p "$TMP/compile_commands.bin"
+  expect "$(report_value "$TMP/run" db_format)" packed db_format
+  analyze "$TMP/plain" -p "$db"
+  expect "$(report_value "$TMP/plain" db_format)" json db_format
+  same_outputs "$TMP/plain" "$TMP/run"
+  ! "$BIN/analyze" -p "$TMP/compile_commands.bin" -stream-db > /dev/null 2>&1
+}
+
+if [ $# -gt 0 ]; then
+  set -eE -o pipefail
+  trap 'echo "line $LINENO: $BASH_COMMAND failed" >&2' ERR
+  TMP=$(mktemp -d)
+  trap 'rm -rf "$TMP"' EXIT
+  "$@"
+  exit
+fi
+
+failures=0
+for test in $(declare -F | awk '$3 ~ /^test_/ { print $3 }'); do
+  if "$0" "$test"; then
+    echo "PASS $test"
+  else
+    echo "FAIL $test"
+    failures=$((failures + 1))
+  fi
+done
+[ $failures -eq 0 ]
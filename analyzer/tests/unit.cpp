@@ -0,0 +1,204 @@
+#include "../compile-db.hpp"
+#include "../fact-cache.hpp"
+#include "../helper.hpp"
+
+// Tests of the parts of helper.cpp and fact-cache.cpp that need no TU to
+// parse, run by `make test`. Prints every check that fails and exits with 1
+// if any did.
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond << std::endl;     \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static void test_digest_set() {
+  DigestSet set;
+  set.set_verify(true);
+  KeyDigest digest = digest_key("a.h+point+struct.jsonl+");
+  CHECK(!digest.empty());
+  CHECK(set.insert(digest, "a.h+point+struct.jsonl+"));
+  CHECK(!set.insert(digest, "a.h+point+struct.jsonl+"));
+  // Another key with the same digest is told apart, and counted, once
+  CHECK(set.insert(digest, "b.h+line+struct.jsonl+"));
+  CHECK(!set.insert(digest, "b.h+line+struct.jsonl+"));
+  CHECK(set.collisions() == 1);
+  CHECK(set.size() == 2);
+
+  // Without verification the digest alone decides
+  DigestSet unverified;
+  CHECK(unverified.insert(digest, "a.h+point+struct.jsonl+"));
+  CHECK(!unverified.insert(digest, "b.h+line+struct.jsonl+"));
+  CHECK(unverified.collisions() == 0);
+
+  // Keys stay found while the tables grow
+  DigestSet many;
+  for (int i = 0; i < 100000; ++i)
+    CHECK(many.insert(digest_key(std::to_string(i)), std::to_string(i)));
+  for (int i = 0; i < 100000; i += 7)
+    CHECK(!many.insert(digest_key(std::to_string(i)), std::to_string(i)));
+  CHECK(many.size() == 100000);
+}
+
+static void test_reduce_flags() {
+  using clang::tooling::CommandLineArguments;
+  CommandLineArguments reduced = reduce_flags(
+      {"cc", "-O2", "-g", "-g3", "-gdwarf-4", "-gcc-toolchain=/opt/gcc",
+       "-Wall", "-Wp,-MMD,a.d", "-fplugin=x.so", "--param", "a=1",
+       "-funsigned-char", "-c", "a.c"},
+      "a.c");
+  // -O defines __OPTIMIZE__ and stays, -gcc-toolchain= is no debug flag
+  CHECK(reduced == CommandLineArguments({"cc", "-w", "-O2",
+                                         "-gcc-toolchain=/opt/gcc",
+                                         "-Wp,-MMD,a.d", "-funsigned-char",
+                                         "-c", "a.c"}));
+}
+
+static void test_ioctl_handlers() {
+  IoctlHandlers handlers;
+  handlers.add(R"({"name":"fops","filename":"/src/a.c:3",)"
+               R"("source":"fops = {\n .unlocked_ioctl = a_ioctl,\n}"})");
+  // Not a handler: sets no ioctl function
+  handlers.add(R"({"name":"fops","filename":"/src/b.c:3",)"
+               R"("source":"fops = {\n .open = b_open,\n}"})");
+  CHECK(handlers.size() == 1);
+
+  // A usage naming the definition of its variable only matches the handler
+  // defined there
+  CHECK(handlers.resolve(
+      R"({"alias":"fops","name":"register_a","target":"/src/a.c:3"})"));
+  CHECK(!handlers.resolve(
+      R"({"alias":"fops","name":"register_b","target":"/src/b.c:3"})"));
+  CHECK(!handlers.resolve(
+      R"({"alias":"fops","name":"register_a","target":"/src/a.c:4"})"));
+  // One without matches by name
+  CHECK(handlers.resolve(R"({"alias":"fops","name":"use_extern"})"));
+  CHECK(!handlers.resolve(R"({"alias":"other","name":"use_other"})"));
+}
+
+static void test_relocate() {
+  CheckoutDir dir{"/home/u/linux", "/data/linux"};
+  CheckoutDir other{"/tmp/tree", "/srv/tree"};
+  const std::pair<const char *, const char *> cases[] = {
+      {"/data/linux/include/a.h", "$DIR/include/a.h"},
+      {"/home/u/linux/a.h", "$CWD/a.h"},
+      {"-I/data/linux/include", "-I$DIR/include"},
+      {"/data/linux/a.h:1:2 <Spelling=/home/u/linux/b.h:3:4>:1",
+       "$DIR/a.h:1:2 <Spelling=$CWD/b.h:3:4>:1"},
+      // Only whole path components at the start of a path
+      {"/data/linux2/a.h", "/data/linux2/a.h"},
+      {"/mnt/data/linux/a.h", "/mnt/data/linux/a.h"},
+      {"price $DIR", "price $$DIR"},
+  };
+  for (const auto &c : cases) {
+    CHECK(relocate(c.first, dir) == c.second);
+    CHECK(unrelocate(relocate(c.first, dir), dir) == c.first);
+  }
+  // Facts cached from one checkout name the paths of another
+  CHECK(unrelocate(relocate("/data/linux/a.h /home/u/linux/b.h", dir),
+                   other) == "/srv/tree/a.h /tmp/tree/b.h");
+
+  // Keys name either directory the same way
+  CHECK(relocate("-I/home/u/linux/include", dir, true) ==
+        relocate("-I/data/linux/include", dir, true));
+
+  // The longer of two nested directories wins
+  CheckoutDir nested{"/src", "/src/linux"};
+  CHECK(relocate("/src/linux/a.h /src/a.h", nested) == "$DIR/a.h $CWD/a.h");
+}
+
+static void test_merge_fact_segments() {
+  std::string dir = std::filesystem::temp_directory_path().string();
+  std::string first = dir + "/unit-segment-0";
+  std::string second = dir + "/unit-segment-1";
+  std::ofstream(first) << "aa\t{\"name\":\"x\"}\n"
+                       << "cc\t{\"name\":\"z\"}\n";
+  std::ofstream(second) << "aa\t{\"name\":\"w\"}\n"
+                        << "bb\t{\"name\":\"y\"}\n"
+                        << "cc\t{\"name\":\"z\"}\n";
+
+  // One fact per key, the variant that sorts first, in key order
+  std::ostringstream out;
+  uint64_t duplicates = 0;
+  CHECK(merge_fact_segments({first, second}, out, false, duplicates) == 3);
+  CHECK(out.str() == "{\"name\":\"w\"}\n{\"name\":\"y\"}\n"
+                     "{\"name\":\"z\"}\n");
+  CHECK(duplicates == 2);
+
+  // A dropped fact takes its key's other variants with it
+  std::ostringstream kept;
+  duplicates = 0;
+  CHECK(merge_fact_segments({second, first}, kept, true, duplicates,
+                            [](llvm::StringRef fact) {
+                              return !fact.contains("\"w\"");
+                            }) == 2);
+  CHECK(kept.str() == "bb\t{\"name\":\"y\"}\ncc\t{\"name\":\"z\"}\n");
+  std::filesystem::remove(first);
+  std::filesystem::remove(second);
+}
+
+static void test_packed_compilation_database() {
+  std::string error;
+  auto json = clang::tooling::JSONCompilationDatabase::loadFromBuffer(
+      R"([{"directory": "/src", "file": "a.c", "output": "a.o",
+           "arguments": ["cc", "-DA", "-c", "a.c"]},
+          {"directory": "/src/sub", "file": "../b.c",
+           "command": "cc -DB -c ../b.c"},
+          {"directory": "/src", "file": "a.c",
+           "arguments": ["cc", "-DA2", "-c", "a.c"]}])",
+      error, clang::tooling::JSONCommandLineSyntax::AutoDetect);
+  CHECK(json);
+  std::string path =
+      std::filesystem::temp_directory_path().string() + "/unit-db.bin";
+  CHECK(PackedCompilationDatabase::pack(*json, path, error));
+  CHECK(PackedCompilationDatabase::is_packed(path));
+  auto packed = PackedCompilationDatabase::load(path, error);
+  CHECK(packed);
+  if (!json || !packed)
+    return;
+
+  auto same = [](const std::vector<clang::tooling::CompileCommand> &a,
+                 const std::vector<clang::tooling::CompileCommand> &b) {
+    if (a.size() != b.size())
+      return false;
+    for (size_t i = 0; i < a.size(); ++i)
+      if (a[i].Directory != b[i].Directory || a[i].Filename != b[i].Filename ||
+          a[i].Output != b[i].Output || a[i].CommandLine != b[i].CommandLine)
+        return false;
+    return true;
+  };
+  CHECK(packed->size() == 3);
+  CHECK(packed->file(1) == "../b.c");
+  CHECK(same(packed->getAllCompileCommands(), json->getAllCompileCommands()));
+  CHECK(packed->getAllFiles() ==
+        std::vector<std::string>({"/src/a.c", "/src/b.c"}));
+  // Looked up by absolute path, as given, or not at all
+  CHECK(same(packed->getCompileCommands("/src/a.c"),
+             json->getCompileCommands("/src/a.c")));
+  CHECK(packed->getCompileCommands("/src/a.c").size() == 2);
+  CHECK(packed->getCompileCommands("/src/b.c").size() == 1);
+  CHECK(packed->getCompileCommands("../b.c").size() == 1);
+  CHECK(packed->getCompileCommands("/src/c.c").empty());
+
+  // Anything else is not taken for a packed database
+  std::ofstream(path) << "[]";
+  CHECK(!PackedCompilationDatabase::is_packed(path));
+  CHECK(!PackedCompilationDatabase::load(path, error));
+  std::filesystem::remove(path);
+}
+
+int main() {
+  test_digest_set();
+  test_reduce_flags();
+  test_ioctl_handlers();
+  test_relocate();
+  test_merge_fact_segments();
+  test_packed_compilation_database();
+  if (failures)
+    std::cerr << failures << " checks failed" << std::endl;
+  return failures ? 1 : 0;
+}
@@ -1,45 +1,12 @@
+#include "compile-db.hpp"
 #include "helper.hpp"
 
 using namespace clang;
 using namespace clang::tooling;
 using json = nlohmann::json;
 
-std::set<std::string> handler_names;
-
-bool ProcessParents(const clang::DynTypedNode &Node, ASTContext *context,
-                    std::string referred_name) {
-  auto parents = context->getParents(Node);
-  if (parents.empty()) {
-    return false; // Reached the root or a node with no parents
-  }
-
-  for (const auto &parent : parents) {
-    if (auto *FD = parent.get<FunctionDecl>()) {
-      // Try cast the FunctionDecl to a NamedDecl
-      if (auto *ND = dyn_cast<NamedDecl>(FD)) {
-        output_decl(ND, "usage.jsonl", true, referred_name);
-        return true;
-      }
-    } else if (const auto *VD = parent.get<VarDecl>()) {
-      output_decl(VD, "usage.jsonl", true, referred_name);
-      return true;
-    } else {
-      // Recurse to process the parents of this parent
-      if (ProcessParents(parent, context, referred_name)) {
-        return true;
-      }
-    }
-  }
-  return false;
-}
-
-bool is_handler_name(std::string name) {
-  // Check whether the name is in the handler names
-  if (handler_names.find(name) != handler_names.end()) {
-    return true;
-  }
-  return false;
-}
+// Loaded once from handler_names.txt and never modified afterwards
+llvm::StringSet<> handler_names;
 
 class StructVisitor : public RecursiveASTVisitor<StructVisitor> {
 public:
@@ -50,10 +17,43 @@ public:
         collect_struct(collect_struct), collect_func(collect_func),
         collect_handler(collect_handler) {}
 
+  // Track the innermost function or variable being traversed, so that a
+  // reference is attributed without asking for the AST parent map
+  bool TraverseDecl(Decl *decl) {
+    bool encloses = decl && (isa<FunctionDecl>(decl) || isa<VarDecl>(decl));
+    if (encloses)
+      enclosing.push_back(cast<NamedDecl>(decl));
+    bool result = RecursiveASTVisitor<StructVisitor>::TraverseDecl(decl);
+    if (encloses)
+      enclosing.pop_back();
+    return result;
+  }
+
+  // Look the handler names up in the identifier table of this TU, so that
+  // references can be matched by pointer. A name that is not in the table
+  // was never spelled in the TU, unless it is in the PCH the TU loaded,
+  // whose identifiers are only read into the table when asked for. Returns
+  // false if none of them was spelled.
+  bool resolve_handlers(const IdentifierTable &idents) {
+    handlers.clear();
+    IdentifierInfoLookup *external = idents.getExternalIdentifierLookup();
+    for (const auto &entry : handler_names) {
+      auto ident = idents.find(entry.getKey());
+      if (ident != idents.end())
+        handlers.insert(ident->getValue());
+      else if (external)
+        if (IdentifierInfo *loaded = external->get(entry.getKey()))
+          handlers.insert(loaded);
+    }
+    return !handlers.empty();
+  }
+
   bool VisitDeclRefExpr(DeclRefExpr *expr) {
-    std::string name = expr->getNameInfo().getAsString();
-    if (is_handler_name(name)) {
-      ProcessParents(clang::DynTypedNode::create(*expr), context, name);
+    const IdentifierInfo *ident =
+        expr->getNameInfo().getName().getAsIdentifierInfo();
+    if (ident && handlers.count(ident) && !enclosing.empty()) {
+      output_decl(enclosing.back(), "usage.jsonl", true,
+                  ident->getName().str());
     }
     return true;
   }
@@ -64,22 +64,40 @@ private:
   bool collect_struct;
   bool collect_func;
   bool collect_handler;
+  std::vector<NamedDecl *> enclosing;
+  llvm::SmallPtrSet<const IdentifierInfo *, 16> handlers;
 };
 
 class StructConsumer : public clang::ASTConsumer {
 public:
-  explicit StructConsumer(ASTContext *context, bool collect_enum = true,
-                          bool collect_struct = true, bool collect_func = true,
+  explicit StructConsumer(ASTContext *context, Preprocessor &pp,
+                          bool collect_enum = true, bool collect_struct = true,
+                          bool collect_func = true,
                           bool collect_handler = false)
       : visitor(context, collect_enum, collect_struct, collect_func,
-                collect_handler) {}
+                collect_handler),
+        headers(pp.getHeaderSearchInfo()), macros(watch_header_macros(pp)) {
+    watch_tu_tokens(pp);
+  }
+
+  // Cuts the parse short once the TU is over its time or memory budget
+  bool HandleTopLevelDecl(DeclGroupRef group) override {
+    return group.isNull() ||
+           !tu_over_budget((*group.begin())->getASTContext());
+  }
 
   void HandleTranslationUnit(clang::ASTContext &context) override {
-    visitor.TraverseDecl(context.getTranslationUnitDecl());
+    if (!visitor.resolve_handlers(context.Idents)) {
+      run_report().add("tus_without_handler_names", 1);
+      return;
+    }
+    traverse_unharvested_decls(visitor, context, headers, macros);
   }
 
 private:
   StructVisitor visitor;
+  HeaderSearch &headers;
+  HeaderMacroStates *macros;
 };
 
 class StructAction : public clang::ASTFrontendAction {
@@ -87,72 +105,85 @@ public:
   std::unique_ptr<clang::ASTConsumer>
   CreateASTConsumer(clang::CompilerInstance &compiler,
                     llvm::StringRef) override {
-    return std::make_unique<StructConsumer>(&compiler.getASTContext());
+    return std::make_unique<StructConsumer>(
+        &compiler.getASTContext(), compiler.getPreprocessor());
   }
 };
 
 int main(int argc, const char **argv) {
-  llvm::cl::OptionCategory MyToolCategory("my-tool options");
-  llvm::cl::opt<std::string> OptCompileCommands(
-      "p", llvm::cl::desc("Specify path compile_commands.json"),
-      llvm::cl::Required, llvm::cl::cat(MyToolCategory));
+  RunOptions options(".usage-work", "usage-report.json");
+  llvm::cl::opt<bool> OptPrefilter(
+      "prefilter",
+      llvm::cl::desc("Skip TUs whose main file does not contain any handler "
+                     "name"),
+      llvm::cl::init(true), llvm::cl::cat(options.category));
   llvm::cl::ParseCommandLineOptions(argc, argv);
-
-  // Load compile_commands.json manually
-  std::string ErrorMessage;
-  auto CompilationDatabase = JSONCompilationDatabase::loadFromFile(
-      OptCompileCommands, ErrorMessage,
-      clang::tooling::JSONCommandLineSyntax::AutoDetect);
-
-  if (!CompilationDatabase) {
-    llvm::errs() << "Error loading compile_commands.json: " << ErrorMessage
-                 << "\n";
+  if (!validate_run_options(options))
     return 1;
-  }
 
-  // Extract source files from the loaded database
+  // Load compile_commands.json, or its packed form, manually, unless it is
+  // read while parsing
+  std::unique_ptr<clang::tooling::CompilationDatabase> CompilationDatabase;
   std::vector<std::string> sources;
-  for (const auto &command : CompilationDatabase->getAllCompileCommands()) {
-    // Only add .c and .h files
-    if (command.Filename.find(".c") == std::string::npos &&
-        command.Filename.find(".h") == std::string::npos)
-      continue;
-    sources.push_back(command.Filename);
+  if (!options.stream_db) {
+    std::string ErrorMessage;
+    CompilationDatabase = load_compilation_database(options.compile_commands,
+                                                    sources, ErrorMessage);
+    if (!CompilationDatabase) {
+      llvm::errs() << "Error loading compile_commands.json: " << ErrorMessage
+                   << "\n";
+      return 1;
+    }
   }
 
   // Load the handler names
   std::ifstream handler_file("handler_names.txt");
   std::string line;
+  std::vector<std::string> handler_list;
   while (std::getline(handler_file, line)) {
-    handler_names.insert(line);
+    if (handler_names.insert(line).second)
+      handler_list.push_back(line);
   }
   std::cout << "Loaded " << handler_names.size() << " handler names"
             << std::endl;
+  MultiPatternMatcher handler_matcher(handler_list);
+
+  // Usage facts depend on the handler names as much as on the sources
+  std::string config = "usage";
+  for (const auto &name : handler_list)
+    config += "\n" + name;
+  apply_run_options(options, config);
 
   auto frontendAction = newFrontendActionFactory<StructAction>();
-  std::vector<std::future<void>> futures;
-  int maxThreads = 100;
-  Semaphore sem(maxThreads);
-  // Assuming 'sources' is a vector of strings containing source paths
-  for (const auto &sourcePath : sources) {
-    sem.wait(); // Wait for an available slot
-
-    // Capture necessary variables by reference
-    futures.push_back(
-        std::async(std::launch::async, [&sem, &sourcePath, &CompilationDatabase,
-                                        &frontendAction]() {
-          std::cout << sourcePath << std::endl;
-
-          // Processing logic with ClangTool
-          std::vector<std::string> currentSource = {sourcePath};
-          ClangTool tool(*CompilationDatabase, currentSource);
-          tool.run(frontendAction.get());
-
-          sem.notify(); // Signal that this thread is done
-        }));
+  auto prefilter = [&](const clang::tooling::CompilationDatabase &db,
+                       const std::string &sourcePath) {
+    // Most TUs never spell any handler name, a text scan of the main file
+    // is far cheaper than parsing them
+    if (!OptPrefilter)
+      return false;
+    auto buffer = llvm::MemoryBuffer::getFile(main_file_path(db, sourcePath));
+    if (!buffer || handler_matcher.search((*buffer)->getBuffer()))
+      return false;
+    run_report().add("tus_prefiltered", 1);
+    return true;
+  };
+  if (options.stream_db) {
+    StreamingCompilationDatabase database(options.compile_commands,
+                                          is_tool_source);
+    run_sources(database, frontendAction.get(), options.jobs(),
+                options.file_cache_limit, prefilter);
+    // The TUs parsed so far stay journaled for -resume
+    if (!database.error().empty()) {
+      llvm::errs() << "Error reading compile_commands.json: "
+                   << database.error() << "\n";
+      return 1;
+    }
+  } else {
+    run_sources(*CompilationDatabase, sources, frontendAction.get(),
+                options.jobs(), options.file_cache_limit, prefilter);
   }
 
-  for (auto &fut : futures) {
-    fut.wait();
-  }
+  // Append every worker's shard to the final .jsonl files
+  merge_output_shards();
+  finish_run_report(options.report);
 }
\ No newline at end of file